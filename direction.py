@@ -36,18 +36,31 @@ class PIDController(object):
 class AntennaArray(object):
     speed_of_light= 299792458.0
 
-    def __init__(self, antennas, fft_len, dir_len, fq_low, fq_high):
+    # doa_engine may be a libsofi.Sofi instance that was set up
+    # using set_antennas with the same antennas and dir_len.
+    # The direction infos are then calculated in libsofi.
+    # calibration_sink may be a libsofi.Sofi instance that
+    # applies the phase compensation to the phases it returns.
+    # detector may be a libsofi.Sofi instance whose signal
+    # detector replaces find_signalpoints/find_noisepoints,
+    # see update_points_native.
+    def __init__(self, antennas, fft_len, dir_len, fq_low, fq_high,
+                 doa_engine=None, calibration_sink=None, detector=None):
         self.fft_len= fft_len
         self.dir_len= dir_len
+        self.doa_engine= doa_engine
+        self.calibration_sink= calibration_sink
+        self.detector= detector
 
         self.frequencies= np.linspace(fq_low, fq_high, self.fft_len)
         self.wavelengths= self.speed_of_light/self.frequencies
 
         self.antennas= antennas
         self.antenna_count= len(antennas)
-        self.edges_count= math.factorial(self.antenna_count - 1)
+        self.edges_count= self.antenna_count * (self.antenna_count - 1) // 2
 
-        # Initilize the per antenna offset compensation PID controllers.
+        # Initilize the per antenna phase offset compensation PID controllers.
+        # Delays between the receivers are compensated by libsofi.
         # The kp, ki, kd were determined by guessing and
         # looking at the controller behavior.
         # I guess they could use some optimization
@@ -56,11 +69,6 @@ class AntennaArray(object):
             for ant in antennas
         )
 
-        self.ant_sample_err_comps= list(
-            PIDController(1.5, 2.5, 0.06)
-            for ant in antennas
-        )
-
         # Matricies that describe the effect of
         # Taking the phase differeces between antennas
         # to get from antenna->edges. (effect_mat)
@@ -89,7 +97,7 @@ class AntennaArray(object):
         )
 
         edge_distances= np.fromiter(
-            (dx*dx + dy*dy for (dx, dy) in edge_dxy),
+            (math.hypot(dx, dy) for (dx, dy) in edge_dxy),
             np.float64
         )
 
@@ -137,6 +145,17 @@ class AntennaArray(object):
 
         return(pmat @ phase_vector)
 
+    def get_direction_infos_native(self, phases):
+        # The frames here are centered on bin 0,
+        # libsofi uses the fft output order and
+        # bins relative to the center frequency
+        half= self.fft_len // 2
+
+        fft_phases= tuple(np.fft.ifftshift(ph) for ph in phases)
+        spans= list((st - half, en - half) for (st, en) in self.signal_points)
+
+        return(self.doa_engine.directions(fft_phases, spans))
+
     def find_peaks(self, magnitudes):
         testwidths= np.linspace(14, 18, 5)
 
@@ -190,15 +209,11 @@ class AntennaArray(object):
         # and reduce the effect matrix
         red_effect_mat= effect_mat[0:,1:]
 
-        # With 6 edges for 3 errors (assuming 4 antennas)
-        # the calculation is overdefined.
-        # To counter that errors[0:3] are added to errors[3:6]
-        # to form a new three element error vector.
-        # The same operations are performed on the effect matrix
-        rect_effect_mat= red_effect_mat[0:3,] + red_effect_mat[3:,]
-
-        # Invert the matrix to get from edge errors > antenna errors
-        inv_effect_mat= np.linalg.inv(rect_effect_mat)
+        # With N*(N-1)/2 edges for N-1 errors the
+        # calculation is overdefined for more than three antennas.
+        # Use the least squares solution given by the pseudo inverse
+        # to get from edge errors > antenna errors
+        inv_effect_mat= np.linalg.pinv(red_effect_mat)
 
         return(inv_effect_mat)
 
@@ -208,16 +223,11 @@ class AntennaArray(object):
     def edge_to_ant_errors(self, edge_err):
         np_edge_err= np.array(edge_err)
 
-        # We want to solve for 3 errors (assuming 4 antennas)
-        # For that we only need thre variables.
-        # The first step is to reduce the 6 input errors to 3
-        red_edge_err= np_edge_err[:3] + np_edge_err[3:]
-
         # The error for the first antenna is assumed to be zero
         # only the other errors will be set
         ant_err= np.zeros(self.antenna_count)
 
-        ant_err[1:]= self.inv_effect_mat @ red_edge_err
+        ant_err[1:]= self.inv_effect_mat @ np_edge_err
 
         return(ant_err)
 
@@ -228,80 +238,96 @@ class AntennaArray(object):
         )
 
         if len(noise_point_vals) < 3:
-            return((0,0))
+            return(0)
 
         # The phase error is the mena offset of the
         # phases from zero
         phase_error= noise_point_vals.mean()
 
-        sample_error= sum(
-            (bv - av)
-            for (av, bv)
-            in zip(noise_point_vals[:-1], noise_point_vals[1:])
-        ) / (len(noise_point_vals) - 1)
-
-        return((-phase_error, -sample_error))
+        return(-phase_error)
 
-    def compensate_edge_errors(self, edge_frame, phase_offset, sample_offset):
-        shift_start= phase_offset - sample_offset/2
-        shift_end= phase_offset + sample_offset/2
-
-        comp= np.linspace(shift_start, shift_end, self.fft_len)
-
-        return(remainder(edge_frame + comp))
+    def compensate_edge_errors(self, edge_frame, phase_offset):
+        return(remainder(edge_frame + phase_offset))
 
     def process_edge_frameset(self, phases, magnitude):
         # Take the per antenna compensation factors
         # that were calculated in the previous frames
         ant_phase_comps= np.fromiter((c.last for c in self.ant_phase_err_comps), np.float32)
-        ant_sample_comps= np.fromiter((c.last for c in self.ant_sample_err_comps), np.float32)
 
-        # Calculate the per edge compensation factors
-        # from the per antenna factors
-        edge_phase_comps= self.ant_to_edge_errors(ant_phase_comps)
-        edge_sample_comps= self.ant_to_edge_errors(ant_sample_comps)
+        if self.calibration_sink is not None:
+            # libsofi rotates the spectra of the antennas,
+            # the phases arrive already compensated
+            self.calibration_sink.set_calibration(ant_phase_comps)
+
+            edge_phase_comps= np.zeros(self.edges_count)
 
-        # These Arrays will be used to store
+        else:
+            # Calculate the per edge compensation factors
+            # from the per antenna factors
+            edge_phase_comps= self.ant_to_edge_errors(ant_phase_comps)
+
+        # This Array will be used to store
         # the errors in the current frame
         edge_phase_errors= np.zeros(len(edge_phase_comps))
-        edge_sample_errors= np.zeros(len(edge_sample_comps))
 
         # Zip together all the parameters that will be needed
         # in the per edge loop
-        edges_properties= zip(it.count(0), phases, edge_phase_comps, edge_sample_comps)
+        edges_properties= zip(it.count(0), phases, edge_phase_comps)
 
         compensated_phases= list()
 
-        for (i, edge_frame, edge_ph_comp, edge_sa_comp) in edges_properties:
-            edge_frame_compensated= self.compensate_edge_errors(edge_frame, edge_ph_comp, edge_sa_comp)
+        for (i, edge_frame, edge_ph_comp) in edges_properties:
+            if self.calibration_sink is not None:
+                edge_frame_compensated= edge_frame
+
+            else:
+                edge_frame_compensated= self.compensate_edge_errors(edge_frame, edge_ph_comp)
 
             compensated_phases.append(edge_frame_compensated)
 
             # Calculate and store the current errors
             # For later analysis
-            (edge_phase_errors[i], edge_sample_errors[i])= self.calc_edge_errors(edge_frame_compensated)
+            edge_phase_errors[i]= self.calc_edge_errors(edge_frame_compensated)
 
         # Calculate direction informations
-        dir_infos= list(
-            self.get_direction_info(compensated_phases, st, en)
-            for (st, en) in self.signal_points
-        )
+        if self.doa_engine is not None:
+            dir_infos= self.get_direction_infos_native(compensated_phases)
+
+        else:
+            dir_infos= list(
+                self.get_direction_info(compensated_phases, st, en)
+                for (st, en) in self.signal_points
+            )
 
         # Determine the per antenna errors from the
         # per edge errors. This uses a Matrix that
         # inverts the effect of calculating the phase differences
         ant_phase_errors= self.edge_to_ant_errors(edge_phase_errors)
-        ant_sample_errors= self.edge_to_ant_errors(edge_sample_errors)
 
         # Update the PID controllers
         for (comp, err) in zip(self.ant_phase_err_comps, ant_phase_errors):
             comp.update(err)
 
-        for (comp, err) in zip(self.ant_sample_err_comps, ant_sample_errors):
-            comp.update(err)
-
         return(dir_infos, compensated_phases)
 
+    def update_points_native(self):
+        # The detector runs on every result in libsofi
+        # and returns bins relative to the center frequency
+        half= self.fft_len // 2
+
+        self.signal_points= list(
+            (st + half, en + half)
+            for (st, en) in self.detector.spans(self.detector.SPAN_SIGNAL)
+        )
+
+        noise_points= list(
+            (st + half, en + half)
+            for (st, en) in self.detector.spans(self.detector.SPAN_NOISE)
+        )
+
+        if len(noise_points) >= 3:
+            self.noise_points= noise_points
+
     def find_signalpoints(self, magnitudes):
         peaks= self.find_peaks(magnitudes)
 
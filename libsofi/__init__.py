@@ -23,13 +23,110 @@ import ctypes as ct
 moddir= os.path.dirname(__file__)
 _libsofi= np.ctypeslib.load_library('libsofi', moddir)
 
+# Mirrors struct st_histogram and struct st_report in stats.h
+HIST_BUCKETS= 32
+
+class _Histogram(ct.Structure):
+    _fields_= [
+        ('count', ct.c_uint64),
+        ('sum_ns', ct.c_uint64),
+        ('max_ns', ct.c_uint64),
+        ('buckets', ct.c_uint64 * HIST_BUCKETS)
+    ]
+
+    # Bucket i counts values in [2^i, 2^(i+1)) ns,
+    # percentiles are the upper bound of their bucket
+    def percentile_us(self, p):
+        total= sum(self.buckets)
+
+        if total == 0:
+            return(0.0)
+
+        rank= int(p * (total - 1)) + 1
+        seen= 0
+
+        for (i, cnt) in enumerate(self.buckets):
+            seen+= cnt
+
+            if seen >= rank:
+                return(min(2.0**(i+1), self.max_ns) / 1000)
+
+        return(self.max_ns / 1000)
+
+    def to_dict(self):
+        return({
+            'count': self.count,
+            'mean_us': (self.sum_ns / self.count / 1000) if self.count else 0.0,
+            'p50_us': self.percentile_us(0.5),
+            'p99_us': self.percentile_us(0.99),
+            'max_us': self.max_ns / 1000
+        })
+
+class _Report(ct.Structure):
+    _fields_= [
+        ('capture_buffers', ct.c_uint64),
+        ('capture_bytes', ct.c_uint64),
+        ('capture_dropped', ct.c_uint64),
+        ('capture_gaps', ct.c_uint64),
+        ('capture_padded', ct.c_uint64),
+        ('capture_skipped', ct.c_uint64),
+        ('capture_lost_sync', ct.c_uint64),
+        ('capture_rec_stopped', ct.c_uint64),
+        ('ring_overruns', ct.c_uint64),
+        ('ring_fill', ct.c_uint64),
+        ('ring_fill_max', ct.c_uint64),
+        ('ring_len', ct.c_uint64),
+        ('dequeue', _Histogram),
+        ('ring_write', _Histogram),
+
+        ('fft_frames', ct.c_uint64),
+        ('fft_buffers', ct.c_uint64),
+        ('fft_in_use', ct.c_uint64),
+        ('fft_in_use_max', ct.c_uint64),
+        ('fft_load', _Histogram),
+        ('fft_compute', _Histogram),
+        ('fft_latency', _Histogram),
+        ('fft_buffer_wait', _Histogram),
+
+        ('results', ct.c_uint64),
+        ('results_dropped', ct.c_uint64),
+        ('combiner_wait', _Histogram),
+        ('combiner_step', _Histogram),
+
+        ('drift_measurements', ct.c_uint64),
+        ('drift_slips', ct.c_uint64)
+    ]
+
+    def to_dict(self):
+        return(dict(
+            (name, getattr(self, name).to_dict() if typ is _Histogram else getattr(self, name))
+            for (name, typ) in self._fields_
+        ))
+
 class Sofi(object):
-    def __init__(self):
-        self._sofi_new= _libsofi.sofi_new
-        self._sofi_new.argtypes= []
-        self._sofi_new.restype= ct.c_void_p
+    INTEGRATE_BLOCK= 0
+    INTEGRATE_SLIDING= 1
+    INTEGRATE_EXPONENTIAL= 2
+
+    SPAN_SIGNAL= 0
+    SPAN_NOISE= 1
+
+    # devices optionally lists one device per sdr,
+    # e.g. 'synth:seed=1' or 'rtl_tcp:localhost:1234'
+    def __init__(self, num_sdrs=4, covariance=False, devices=None):
+        self._sofi_new_devices= _libsofi.sofi_new_devices
+        self._sofi_new_devices.argtypes= [
+            ct.c_uint64, ct.POINTER(ct.c_char_p)
+        ]
+        self._sofi_new_devices.restype= ct.c_void_p
+
+        if devices is not None:
+            num_sdrs= len(devices)
+            devices= (ct.c_char_p * num_sdrs)(
+                *(dev.encode() for dev in devices)
+            )
 
-        self._raw= self._sofi_new()
+        self._raw= self._sofi_new_devices(num_sdrs, devices)
 
         if self._raw is None:
             raise Exception('Opening Sofi instance failed')
@@ -40,6 +137,11 @@ class Sofi(object):
 
         self.num_sdrs= self._sofi_get_nsdrs(self._raw)
 
+        self._sofi_get_nedges= _libsofi.sofi_get_nedges
+        self._sofi_get_nedges.argtypes= [ct.c_void_p]
+        self._sofi_get_nedges.restype= ct.c_uint64
+
+        self.num_edges= self._sofi_get_nedges(self._raw)
 
         self._sofi_get_fftlen= _libsofi.sofi_get_fftlen
         self._sofi_get_fftlen.argtypes= [ct.c_void_p]
@@ -54,10 +156,73 @@ class Sofi(object):
 
         self._sofi_read= _libsofi.sofi_read
         self._sofi_read.argtypes= [
-            ct.c_void_p, self.real_type, self.real_type * 6
+            ct.c_void_p, self.real_type, self.real_type * self.num_edges
         ]
         self._sofi_read.restype= ct.c_bool
 
+        self._sofi_read_latest= _libsofi.sofi_read_latest
+        self._sofi_read_latest.argtypes= [
+            ct.c_void_p, self.real_type, self.real_type * self.num_edges,
+            self.real_type
+        ]
+        self._sofi_read_latest.restype= ct.c_uint64
+
+        self.seq= 0
+
+        self._sofi_set_integration= _libsofi.sofi_set_integration
+        self._sofi_set_integration.argtypes= [
+            ct.c_void_p, ct.c_uint32, ct.c_uint64, ct.c_uint64
+        ]
+        self._sofi_set_integration.restype= ct.c_bool
+
+        self._sofi_get_delays= _libsofi.sofi_get_delays
+        self._sofi_get_delays.argtypes= [ct.c_void_p, self.real_type]
+        self._sofi_get_delays.restype= ct.c_bool
+
+        self._sofi_set_calibration= _libsofi.sofi_set_calibration
+        self._sofi_set_calibration.argtypes= [
+            ct.c_void_p, self.real_type, self.real_type
+        ]
+        self._sofi_set_calibration.restype= ct.c_bool
+
+        self._sofi_get_spans= _libsofi.sofi_get_spans
+        self._sofi_get_spans.argtypes= [
+            ct.c_void_p, ct.c_uint32, ct.POINTER(ct.c_int32), ct.c_uint64
+        ]
+        self._sofi_get_spans.restype= ct.c_uint64
+
+        self._sofi_set_antennas= _libsofi.sofi_set_antennas
+        self._sofi_set_antennas.argtypes= [
+            ct.c_void_p, self.real_type, ct.c_uint64
+        ]
+        self._sofi_set_antennas.restype= ct.c_bool
+
+        # The spans are pairs of int32 as in struct doa_span
+        self._sofi_get_directions= _libsofi.sofi_get_directions
+        self._sofi_get_directions.argtypes= [
+            ct.c_void_p, self.real_type * self.num_edges,
+            ct.POINTER(ct.c_int32), ct.c_uint64, self.real_type
+        ]
+        self._sofi_get_directions.restype= ct.c_bool
+
+        self._sofi_get_directions_music= _libsofi.sofi_get_directions_music
+        self._sofi_get_directions_music.argtypes= [
+            ct.c_void_p, self.real_type,
+            ct.POINTER(ct.c_int32), ct.c_uint64, ct.c_uint64, self.real_type
+        ]
+        self._sofi_get_directions_music.restype= ct.c_bool
+
+        self.dir_len= 0
+
+        self._sofi_get_stats= _libsofi.sofi_get_stats
+        self._sofi_get_stats.argtypes= [ct.c_void_p, ct.POINTER(_Report)]
+        self._sofi_get_stats.restype= ct.c_bool
+
+        _libsofi.sofi_get_stats_size.restype= ct.c_uint64
+
+        if _libsofi.sofi_get_stats_size() != ct.sizeof(_Report):
+            raise Exception('libsofi was built with a different stats layout')
+
         self._sofi_destroy= _libsofi.sofi_destroy
         self._sofi_destroy.argtypes= [ct.c_void_p]
         self._sofi_destroy.restype= ct.c_bool
@@ -69,22 +234,162 @@ class Sofi(object):
         self.mag_buf= self._sofi_alloc_real()
         self.phase_bufs= list(
             self._sofi_alloc_real()
-            for i in range(6)
+            for i in range(self.num_edges)
         )
 
+        self.covariance= covariance
+
+        if covariance:
+            self._sofi_get_cov_stride= _libsofi.sofi_get_cov_stride
+            self._sofi_get_cov_stride.argtypes= [ct.c_void_p]
+            self._sofi_get_cov_stride.restype= ct.c_uint64
+
+            self._sofi_alloc_covariance= _libsofi.sofi_alloc_covariance
+            self._sofi_alloc_covariance.argtypes= [ct.c_void_p]
+            self._sofi_alloc_covariance.restype= self.real_type
+
+            self._sofi_read_covariance= _libsofi.sofi_read_covariance
+            self._sofi_read_covariance.argtypes= [
+                ct.c_void_p, self.real_type, self.real_type * self.num_edges,
+                self.real_type
+            ]
+            self._sofi_read_covariance.restype= ct.c_bool
+
+            cov_stride= self._sofi_get_cov_stride(self._raw)
+            n= self.num_sdrs
+
+            # The matrices are padded to cov_stride complex values
+            # per bin. Map them without copying.
+            self.cov_buf= self._sofi_alloc_covariance(self._raw)
+            self.np_cov= np.ctypeslib.as_array(
+                self.cov_buf, (self.fft_len, 2 * cov_stride)
+            ).view(np.complex64)[:, :n*n].reshape(self.fft_len, n, n)
+
+    # Select how many fft frames are integrated per output
+    # and after how many new frames the next output is ready.
+    # See cb_set_integration in combiner.c
+    def set_integration(self, mode, window, hop=0):
+        if not self._sofi_set_integration(self._raw, mode, window, hop):
+            raise Exception('Setting integration mode failed')
+
+    # Delays of the SDRs relative to the first one in
+    # samples, as tracked in the background. They are
+    # already compensated in the phases and covariances
+    # that are returned
+    def delays(self):
+        delays= (ct.c_float * self.num_sdrs)()
+
+        self._sofi_get_delays(self._raw, delays)
+
+        return(np.array(delays, np.float32))
+
+    # Per SDR phase corrections in radians and delay
+    # corrections in samples, None for no correction.
+    # They are applied to the phases and covariances of
+    # one of the next results. See cb_set_calibration
+    def set_calibration(self, phases=None, delays=None):
+        def as_floats(values):
+            if values is None:
+                return(None)
+
+            return((ct.c_float * self.num_sdrs)(*values))
+
+        if not self._sofi_set_calibration(
+                self._raw, as_floats(phases), as_floats(delays)):
+            raise Exception('Setting calibration failed')
+
+    # Spans of bins that the detector in libsofi found to
+    # contain signals (or only noise for kind=SPAN_NOISE) in
+    # the last result, as (first, last) pairs relative to the
+    # center frequency like directions() takes them.
+    # See cfar.h
+    def spans(self, kind=SPAN_SIGNAL):
+        max_spans= self.fft_len // 2 + 1
+        np_spans= np.zeros((max_spans, 2), np.int32)
+
+        num= self._sofi_get_spans(
+            self._raw, kind,
+            np_spans.ctypes.data_as(ct.POINTER(ct.c_int32)), max_spans
+        )
+
+        return(list(tuple(int(v) for v in span) for span in np_spans[:num]))
+
+    # Set up direction finding for an array with one antenna
+    # per SDR at the (x, y) positions in meters.
+    # The pseudo spectra have dir_len test angles from -pi to pi
+    def set_antennas(self, antennas, dir_len=1024):
+        positions= np.array(antennas, np.float32).reshape(self.num_sdrs * 2)
+
+        if not self._sofi_set_antennas(
+                self._raw, positions.ctypes.data_as(self.real_type), dir_len):
+            raise Exception('Setting up direction finding failed')
+
+        self.dir_len= dir_len
+
+    # Bearing pseudo spectra of the signals in spans, one row
+    # per span. phases are the edge phases in the order sofi
+    # returns them, spans are (first, last) pairs of bins relative
+    # to the center frequency, last is not part of the signal.
+    # See doa_spectra in doa.c
+    def directions(self, phases, spans):
+        phases= tuple(np.ascontiguousarray(ph, np.float32) for ph in phases)
+        phase_pointers= (self.real_type * self.num_edges)(
+            *(ph.ctypes.data_as(self.real_type) for ph in phases)
+        )
+
+        np_spans= np.array(spans, np.int32).reshape(len(spans), 2)
+        spectra= np.zeros((len(spans), self.dir_len), np.float32)
+
+        ok= self._sofi_get_directions(
+            self._raw, phase_pointers,
+            np_spans.ctypes.data_as(ct.POINTER(ct.c_int32)), len(spans),
+            spectra.ctypes.data_as(self.real_type)
+        )
+
+        if not ok:
+            raise Exception('Calculating directions failed')
+
+        return(spectra)
+
+    # Like directions, but using MUSIC on the covariance
+    # matrices of the last result. Requires covariance=True.
+    # num_sources is the number of emitters per bin,
+    # 0 estimates it. See doa_music in doa.c
+    def directions_music(self, spans, num_sources=0):
+        if not self.covariance:
+            raise Exception('MUSIC requires covariance output')
+
+        np_spans= np.array(spans, np.int32).reshape(len(spans), 2)
+        spectra= np.zeros((len(spans), self.dir_len), np.float32)
+
+        ok= self._sofi_get_directions_music(
+            self._raw, self.cov_buf,
+            np_spans.ctypes.data_as(ct.POINTER(ct.c_int32)), len(spans),
+            num_sources, spectra.ctypes.data_as(self.real_type)
+        )
+
+        if not ok:
+            raise Exception('Calculating directions failed')
+
+        return(spectra)
+
+    # Counters and latency histograms of all stages,
+    # summed up over all SDRs. Latencies are in us,
+    # see struct st_report in stats.h
+    def stats(self):
+        report= _Report()
+
+        self._sofi_get_stats(self._raw, ct.byref(report))
+
+        return(report.to_dict())
+
     def __del__(self):
         self._sofi_destroy(self._raw)
 
     def __iter__(self):
         return self
 
-    def __next__(self):
-        phase_pointers= (self.real_type * 6)(*self.phase_bufs)
-
-        self._sofi_read(
-            self._raw, self.mag_buf, phase_pointers
-        )
-
+    def _results(self):
         np_mag= np.ctypeslib.as_array(self.mag_buf, (self.fft_len, ))
 
         np_phase= tuple(
@@ -92,4 +397,42 @@ class Sofi(object):
             for phb in self.phase_bufs
         )
 
+        if self.covariance:
+            return(np_mag, np_phase, self.np_cov)
+
         return(np_mag, np_phase)
+
+    # Blocks until a result that was not returned before is ready.
+    # Results are calculated in the background, those that are not
+    # read in time are dropped.
+    def __next__(self):
+        phase_pointers= (self.real_type * self.num_edges)(*self.phase_bufs)
+
+        if self.covariance:
+            self._sofi_read_covariance(
+                self._raw, self.mag_buf, phase_pointers, self.cov_buf
+            )
+
+        else:
+            self._sofi_read(
+                self._raw, self.mag_buf, phase_pointers
+            )
+
+        return(self._results())
+
+    # Returns the most recent result without blocking
+    # or None if there was no new result since the last call.
+    def latest(self):
+        phase_pointers= (self.real_type * self.num_edges)(*self.phase_bufs)
+
+        seq= self._sofi_read_latest(
+            self._raw, self.mag_buf, phase_pointers,
+            self.cov_buf if self.covariance else None
+        )
+
+        if seq == 0 or seq == self.seq:
+            return(None)
+
+        self.seq= seq
+
+        return(self._results())
@@ -0,0 +1,155 @@
+/*
+ * Copyright 2016 Leonard Göhrs <leonard@goehrs.eu>
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+
+/* Microbenchmark for the per frame cross spectrum
+ * accumulation in the combiner. Compares the
+ * per edge volk chain (conjugate multiply into a temp
+ * buffer followed by an add) with the fused cb_cmac kernel.
+ * The benchmark is single threaded. */
+
+#define FFT_LEN (1024)
+#define FRAMES (2048)
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include <string.h>
+#include <time.h>
+#include <math.h>
+
+#include <volk/volk.h>
+
+#include "combiner.h"
+
+static double now_sec(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return(ts.tv_sec + ts.tv_nsec * 1e-9);
+}
+
+static void accumulate_volk(size_t num_ffts, fftwf_complex **spectra,
+                            fftwf_complex **accs, fftwf_complex *tmp)
+{
+  for(size_t ina=0, ei=0; ina<num_ffts; ina++) {
+    for(size_t inb=ina+1; inb<num_ffts; inb++, ei++) {
+      volk_32fc_x2_multiply_conjugate_32fc(tmp, spectra[ina], spectra[inb], FFT_LEN);
+
+      volk_32f_x2_add_32f((float *)accs[ei], (float *)accs[ei],
+                          (float *)tmp, 2*FFT_LEN);
+    }
+  }
+}
+
+static bool bench(size_t num_ffts)
+{
+  size_t num_edges= num_ffts * (num_ffts - 1) / 2;
+
+  fftwf_complex *spectra[num_ffts];
+  fftwf_complex *accs_volk[num_edges];
+  fftwf_complex *accs_fused[num_edges];
+  fftwf_complex *tmp= fftwf_alloc_complex(FFT_LEN);
+
+  if (!tmp) return(false);
+
+  for (size_t fi=0; fi<num_ffts; fi++) {
+    spectra[fi]= fftwf_alloc_complex(FFT_LEN);
+    if (!spectra[fi]) return(false);
+
+    float *vals= (float *)spectra[fi];
+
+    for (size_t i=0; i<2*FFT_LEN; i++) {
+      vals[i]= (float)rand() / RAND_MAX - 0.5f;
+    }
+  }
+
+  for (size_t ei=0; ei<num_edges; ei++) {
+    accs_volk[ei]= fftwf_alloc_complex(FFT_LEN);
+    accs_fused[ei]= fftwf_alloc_complex(FFT_LEN);
+
+    if (!accs_volk[ei] || !accs_fused[ei]) return(false);
+
+    memset(accs_volk[ei], 0, sizeof(fftwf_complex) * FFT_LEN);
+    memset(accs_fused[ei], 0, sizeof(fftwf_complex) * FFT_LEN);
+  }
+
+  double start= now_sec();
+
+  for (size_t frame=0; frame<FRAMES; frame++) {
+    accumulate_volk(num_ffts, spectra, accs_volk, tmp);
+  }
+
+  double t_volk= now_sec() - start;
+
+  start= now_sec();
+
+  for (size_t frame=0; frame<FRAMES; frame++) {
+    cb_cmac(num_ffts, spectra, accs_fused, NULL, 0, FFT_LEN);
+  }
+
+  double t_fused= now_sec() - start;
+
+  double max_rel_err= 0;
+
+  for (size_t ei=0; ei<num_edges; ei++) {
+    const float *v= (const float *)accs_volk[ei];
+    const float *f= (const float *)accs_fused[ei];
+
+    for (size_t i=0; i<2*FFT_LEN; i++) {
+      double err= fabs(v[i] - f[i]) / (fabs(v[i]) + 1e-3);
+
+      if (err > max_rel_err) max_rel_err= err;
+    }
+  }
+
+  printf("N=%-2ld edges=%-3ld volk %8.2f us/frame  fused %8.2f us/frame  speedup %.2fx  (max rel error %.1e)\n",
+         num_ffts, num_edges,
+         t_volk * 1e6 / FRAMES, t_fused * 1e6 / FRAMES,
+         t_volk / t_fused, max_rel_err);
+
+  for (size_t fi=0; fi<num_ffts; fi++) fftwf_free(spectra[fi]);
+
+  for (size_t ei=0; ei<num_edges; ei++) {
+    fftwf_free(accs_volk[ei]);
+    fftwf_free(accs_fused[ei]);
+  }
+
+  fftwf_free(tmp);
+
+  return(true);
+}
+
+int main(__attribute__((unused)) int argc, __attribute__((unused))char **argv)
+{
+  static const size_t sizes[]= {4, 8, 16};
+
+  for (size_t si=0; si < sizeof(sizes)/sizeof(*sizes); si++) {
+    if (!bench(sizes[si])) {
+      fprintf(stderr, "bench_combiner: allocation failed\n");
+      return(1);
+    }
+  }
+
+  return(0);
+}
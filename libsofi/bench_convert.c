@@ -0,0 +1,140 @@
+/*
+ * Copyright 2016 Leonard Göhrs <leonard@goehrs.eu>
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+
+/* Microbenchmark for the u8 IQ -> windowed complex float
+ * conversion. Compares the scalar loop that used to live
+ * in ft_load_samples with the available cv_kernels.
+ * The benchmark is single threaded, so the reported
+ * rates are samples per second per core. */
+
+#define FFT_LEN (1024)
+#define ITERATIONS (1<<15)
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include <string.h>
+#include <time.h>
+#include <math.h>
+
+#include <fftw3.h>
+
+#include "convert.h"
+#include "window.h"
+
+static double now_sec(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return(ts.tv_sec + ts.tv_nsec * 1e-9);
+}
+
+static void convert_scalar(fftwf_complex *dst, const uint8_t *src,
+                           float *window, size_t len)
+{
+  for (size_t pos=0; pos<len; pos++) {
+    dst[pos][0]= ((float)src[2*pos] - 127.5)/127.5 * window[pos];
+    dst[pos][1]= ((float)src[2*pos + 1] - 127.5)/127.5 * window[pos];
+  }
+}
+
+static void report(const char *name, double elapsed, double max_err)
+{
+  double rate= (double)FFT_LEN * ITERATIONS / elapsed;
+
+  printf("%-10s %8.1f MS/s  (max error %.2e)\n", name, rate/1e6, max_err);
+}
+
+int main(__attribute__((unused)) int argc, __attribute__((unused))char **argv)
+{
+  float *window= window_hamming(FFT_LEN);
+  uint8_t *samples= malloc(2*FFT_LEN);
+  fftwf_complex *ref= fftwf_alloc_complex(FFT_LEN);
+  fftwf_complex *out= fftwf_alloc_complex(FFT_LEN);
+
+  if (!window || !samples || !ref || !out) {
+    fprintf(stderr, "bench_convert: allocation failed\n");
+    return(1);
+  }
+
+  for (size_t i=0; i<2*FFT_LEN; i++) {
+    samples[i]= rand();
+  }
+
+  double start= now_sec();
+
+  for (size_t it=0; it<ITERATIONS; it++) {
+    convert_scalar(ref, samples, window, FFT_LEN);
+    __asm__ volatile("" : : "r" (ref) : "memory");
+  }
+
+  report("scalar", now_sec() - start, 0);
+
+  struct converter cv;
+
+  if (!cv_init(&cv, window, FFT_LEN, SDR_FORMAT_CU8)) {
+    return(1);
+  }
+
+  printf("cv_init selected: %s\n", cv.kernel->name);
+
+  for (const struct cv_kernel *k= cv_kernels; k->name; k++) {
+    if (k->format != SDR_FORMAT_CU8) continue;
+
+    if (!k->supported()) {
+      printf("%-10s not supported\n", k->name);
+      continue;
+    }
+
+    cv_set_kernel(&cv, k->name);
+
+    start= now_sec();
+
+    for (size_t it=0; it<ITERATIONS; it++) {
+      cv_convert(&cv, out, samples, 0, FFT_LEN);
+      __asm__ volatile("" : : "r" (out) : "memory");
+    }
+
+    double elapsed= now_sec() - start;
+    double max_err= 0;
+
+    for (size_t pos=0; pos<FFT_LEN; pos++) {
+      for (size_t c=0; c<2; c++) {
+        double err= fabs(out[pos][c] - ref[pos][c]);
+
+        if (err > max_err) max_err= err;
+      }
+    }
+
+    report(k->name, elapsed, max_err);
+  }
+
+  cv_destroy(&cv);
+  fftwf_free(ref);
+  fftwf_free(out);
+  free(samples);
+  free(window);
+
+  return(0);
+}
@@ -0,0 +1,416 @@
+/*
+ * Copyright 2016 Leonard Göhrs <leonard@goehrs.eu>
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+
+#include <errno.h>
+#include <string.h>
+#include <math.h>
+
+#include "capture_thread.h"
+
+#include "sdr.h"
+#include "sample_ring.h"
+#include "recorder.h"
+
+/* Filler for samples the device lost. 0x80 is the mid-scale
+ * (zero) value of unsigned 8 bit samples and within 0.4%
+ * of it for unsigned 16 bit samples */
+#define CT_PAD_VALUE (0x80)
+#define CT_PAD_CHUNK (4096)
+
+/**
+ * Write len bytes of silence to the ring so that the
+ * samples after a gap keep their position in time.
+ * The recording gets the same padding, so that ring
+ * positions, like the sync offset, match it.
+ */
+static bool ct_pad(struct capture_thread *ct, uint64_t len, uint32_t sequence)
+{
+  uint8_t pad[CT_PAD_CHUNK];
+
+  if (ct->rec && !rec_pad(ct->rec, len, CT_PAD_VALUE, sequence)) {
+    fprintf(stderr, "ct_pad: recording %s failed, recording stopped\n",
+            ct->dev->dev_path);
+
+    st_add(&ct->stats.rec_stopped, 1);
+    ct->rec= NULL;
+  }
+
+  memset(pad, CT_PAD_VALUE, sizeof(pad));
+
+  while (len) {
+    size_t chunk= (len < sizeof(pad)) ? len : sizeof(pad);
+
+    if (!sr_write(&ct->ring, pad, chunk)) {
+      return(false);
+    }
+
+    len-= chunk;
+  }
+
+  return(true);
+}
+
+/**
+ * Number of buffers of last_len bytes the device lost between
+ * the previous buffer and the one that was just dequeued,
+ * or -1 if the new buffer is not newer than the previous one.
+ * Every skipped sequence number is a lost buffer.
+ * Devices that timestamp their buffers additionally reveal losses
+ * that the sequence numbers do not show, e.g. when the driver
+ * itself dropped data.
+ */
+static int64_t ct_lost_buffers(struct capture_thread *ct, uint32_t seq_delta,
+                               int64_t elapsed_ns, size_t last_len)
+{
+  if (seq_delta == 0 || seq_delta > INT32_MAX) {
+    return(-1);
+  }
+
+  int64_t lost= seq_delta - 1;
+
+  uint32_t samp_rate= atomic_load_explicit(&ct->dev->samp_rate, memory_order_relaxed);
+  size_t sample_size= sdr_sample_size(sdr_format(ct->dev));
+
+  if ((sdr_caps(ct->dev) & SDR_CAP_TIMESTAMPS) && samp_rate && last_len) {
+    double buf_ns= 1e9 * last_len / sample_size / samp_rate;
+
+    /* Rounded to whole buffers, so jitter of less than
+     * half a buffer is never mistaken for a loss */
+    int64_t elapsed= llround(elapsed_ns / buf_ns);
+
+    if (elapsed - 1 > lost) {
+      lost= elapsed - 1;
+    }
+  }
+
+  return(lost);
+}
+
+static void *ct_main(void *dat)
+{
+  struct capture_thread *ct= dat;
+  uint32_t last_sequence= 0;
+  uint64_t last_timestamp= 0;
+  size_t last_len= 0;
+  bool first= true;
+
+  fprintf(stderr, "ct_main: capturing from %s\n", ct->dev->dev_path);
+
+  while (atomic_load_explicit(&ct->running, memory_order_relaxed)) {
+    void *samples;
+
+    uint64_t t_dequeue= st_now_ns();
+
+    ssize_t bytes_rd= sdr_peek(ct->dev, SIZE_MAX, &samples);
+
+    if (bytes_rd < 0) {
+      sr_close(&ct->ring);
+      return((void *)false);
+    }
+
+    uint64_t t_dequeued= st_now_ns();
+    uint32_t sequence= ct->dev->buffer_reader.sequence;
+    uint64_t timestamp= ct->dev->buffer_reader.timestamp_ns;
+
+    int64_t lost= first ? 0 : ct_lost_buffers(ct, sequence - last_sequence,
+                                              timestamp - last_timestamp,
+                                              last_len);
+
+    if (lost < 0) {
+      /* A buffer that was already delivered or is older than the
+       * last one. Writing it would shift all following samples */
+      st_add(&ct->stats.skipped, 1);
+
+      if (!sdr_done(ct->dev)) {
+        sr_close(&ct->ring);
+        return((void *)false);
+      }
+
+      continue;
+    }
+
+    if (lost > 0) {
+      st_add(&ct->stats.gaps, 1);
+      st_add(&ct->stats.dropped, lost);
+    }
+
+    if (lost > 0 && (uint64_t)lost * last_len > ct->ring.len) {
+      /* A jump this large is more likely a restarted driver
+       * or a bad timestamp than lost samples. Padding it would
+       * stall capture, realigning the receivers is left to
+       * the drift tracker or a new synchronization */
+      st_add(&ct->stats.lost_sync, 1);
+    }
+    else if (lost > 0) {
+      /* Keep the samples after the gap where they belong in
+       * time, so that the receivers stay aligned without
+       * having to synchronize them again */
+      uint64_t pad_len= lost * last_len;
+
+      st_add(&ct->stats.padded, pad_len);
+
+      if (!ct_pad(ct, pad_len, last_sequence)) {
+        break;
+      }
+    }
+
+    first= false;
+    last_sequence= sequence;
+    last_timestamp= timestamp;
+    last_len= bytes_rd;
+
+    st_latency_add(&ct->stats.dequeue, t_dequeued - t_dequeue);
+    st_add(&ct->stats.buffers, 1);
+    st_add(&ct->stats.bytes, bytes_rd);
+
+    /* A failing recording must not take down capture */
+    if (ct->rec && !rec_write(ct->rec, samples, bytes_rd,
+                              ct->dev->buffer_reader.sequence,
+                              ct->dev->buffer_reader.timestamp_ns)) {
+      fprintf(stderr, "ct_main: recording %s failed, recording stopped\n",
+              ct->dev->dev_path);
+
+      st_add(&ct->stats.rec_stopped, 1);
+      ct->rec= NULL;
+    }
+
+    if (!sr_write(&ct->ring, samples, bytes_rd)) {
+      /* The ring was closed by ct_stop */
+      break;
+    }
+
+    st_latency_add(&ct->stats.ring_write, st_now_ns() - t_dequeued);
+    st_max(&ct->stats.fill_max, sr_fill(&ct->ring));
+
+    if (!sdr_done(ct->dev)) {
+      sr_close(&ct->ring);
+      return((void *)false);
+    }
+  }
+
+  fprintf(stderr, "ct_main: stopped capturing from %s\n", ct->dev->dev_path);
+
+  return((void *)true);
+}
+
+bool ct_setup(struct capture_thread *ct, struct sdr *dev, size_t ring_len)
+{
+  if (!ct || !dev) {
+    fprintf(stderr, "ct_setup: No ct or sdr structure\n");
+
+    return (false);
+  }
+
+  ct->dev= dev;
+  ct->rec= NULL;
+  ct->direct= !(sdr_caps(dev) & SDR_CAP_LIVE);
+  atomic_init(&ct->running, false);
+
+  atomic_init(&ct->stats.buffers, 0);
+  atomic_init(&ct->stats.bytes, 0);
+  atomic_init(&ct->stats.dropped, 0);
+  atomic_init(&ct->stats.gaps, 0);
+  atomic_init(&ct->stats.padded, 0);
+  atomic_init(&ct->stats.lost_sync, 0);
+  atomic_init(&ct->stats.rec_stopped, 0);
+  atomic_init(&ct->stats.skipped, 0);
+  atomic_init(&ct->stats.fill_max, 0);
+  st_latency_init(&ct->stats.dequeue);
+  st_latency_init(&ct->stats.ring_write);
+
+  if (ct->direct) {
+    return(true);
+  }
+
+  if (!sr_init(&ct->ring, ring_len)) {
+    fprintf(stderr, "ct_setup: setting up sample ring failed\n");
+
+    return (false);
+  }
+
+  return(true);
+}
+
+/**
+ * Record everything the device delivers from now on.
+ * Must be called before ct_start and is only
+ * supported for live devices.
+ */
+bool ct_set_recorder(struct capture_thread *ct, struct recorder *rec)
+{
+  if (ct->direct || atomic_load(&ct->running)) {
+    fprintf(stderr, "ct_set_recorder: device is not live or already running\n");
+
+    return(false);
+  }
+
+  ct->rec= rec;
+
+  return(true);
+}
+
+bool ct_start(struct capture_thread *ct)
+{
+  if (!ct) {
+    fprintf(stderr, "ct_start: No ct structure\n");
+
+    return(false);
+  }
+
+  if (ct->direct || atomic_load(&ct->running)) {
+    return(true);
+  }
+
+  atomic_store(&ct->running, true);
+
+  if (pthread_create(&ct->thread, NULL, &ct_main, ct) != 0) {
+    fprintf(stderr, "ct_start: pthread_create failed\n");
+
+    atomic_store(&ct->running, false);
+
+    return(false);
+  }
+
+  return(true);
+}
+
+/**
+ * Stop the capture thread.
+ * The ring is closed, the consumer may still
+ * read the samples that were captured before.
+ */
+bool ct_stop(struct capture_thread *ct)
+{
+  if (!ct) {
+    fprintf(stderr, "ct_stop: No ct structure\n");
+
+    return(false);
+  }
+
+  if (!atomic_load(&ct->running)) {
+    return (true);
+  }
+
+  atomic_store(&ct->running, false);
+  sr_close(&ct->ring);
+
+  void *status= NULL;
+
+  if (pthread_join(ct->thread, &status) != 0) {
+    fprintf(stderr, "ct_stop: Could not join thread\n");
+
+    return(false);
+  }
+
+  return(status != NULL);
+}
+
+ssize_t ct_peek(struct capture_thread *ct, size_t len, void **samples)
+{
+  if (ct->direct) {
+    return(sdr_peek(ct->dev, len, samples));
+  }
+
+  return(sr_peek(&ct->ring, len, samples));
+}
+
+bool ct_done(struct capture_thread *ct)
+{
+  if (ct->direct) {
+    return(sdr_done(ct->dev));
+  }
+
+  return(sr_done(&ct->ring));
+}
+
+bool ct_seek(struct capture_thread *ct, size_t len)
+{
+  if (ct->direct) {
+    return(sdr_seek(ct->dev, len));
+  }
+
+  return(sr_seek(&ct->ring, len));
+}
+
+/**
+ * Number of bytes the consumer read or skipped so far.
+ * Only tracked for live devices.
+ */
+uint64_t ct_consumed(struct capture_thread *ct)
+{
+  return(ct->direct ? 0 : atomic_load(&ct->ring.tail));
+}
+
+/**
+ * Add the statistics of this capture thread to report
+ */
+void ct_get_stats(struct capture_thread *ct, struct st_report *report)
+{
+  if (ct->direct) {
+    return;
+  }
+
+  uint64_t fill_max= st_load(&ct->stats.fill_max);
+
+  report->capture_buffers+= st_load(&ct->stats.buffers);
+  report->capture_bytes+= st_load(&ct->stats.bytes);
+  report->capture_dropped+= st_load(&ct->stats.dropped);
+  report->capture_gaps+= st_load(&ct->stats.gaps);
+  report->capture_padded+= st_load(&ct->stats.padded);
+  report->capture_skipped+= st_load(&ct->stats.skipped);
+  report->capture_lost_sync+= st_load(&ct->stats.lost_sync);
+  report->capture_rec_stopped+= st_load(&ct->stats.rec_stopped);
+  report->ring_overruns+= atomic_load_explicit(&ct->ring.overruns, memory_order_relaxed);
+  report->ring_fill+= sr_fill(&ct->ring);
+  report->ring_len+= ct->ring.len;
+
+  if (fill_max > report->ring_fill_max) report->ring_fill_max= fill_max;
+
+  st_latency_read(&ct->stats.dequeue, &report->dequeue);
+  st_latency_read(&ct->stats.ring_write, &report->ring_write);
+}
+
+bool ct_destroy(struct capture_thread *ct)
+{
+  if (!ct) {
+    fprintf(stderr, "ct_destroy: No ct structure\n");
+
+    return (false);
+  }
+
+  if (!ct_stop(ct)) {
+    fprintf(stderr, "ct_destroy: stopping the thread failed\n");
+
+    return (false);
+  }
+
+  if (ct->direct) {
+    return(true);
+  }
+
+  return(sr_destroy(&ct->ring));
+}
@@ -0,0 +1,90 @@
+/*
+ * Copyright 2016 Leonard Göhrs <leonard@goehrs.eu>
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+
+#include <pthread.h>
+
+#include "sdr.h"
+#include "sample_ring.h"
+#include "recorder.h"
+#include "stats.h"
+
+/* The capture thread does nothing but dequeue
+ * buffers from the sdr, copy them into a ring
+ * and requeue them.
+ * This keeps the kernel buffers flowing even if
+ * the consumer stalls for a while.
+ * Devices that are not SDR_CAP_LIVE can not overflow,
+ * for them no thread is started and the consumer
+ * reads from the device directly. */
+struct capture_thread {
+  struct sdr *dev;
+  bool direct;
+
+  _Atomic bool running;
+  pthread_t thread;
+
+  struct sample_ring ring;
+
+  /* Optional, every device buffer is queued for it
+   * before it is handed to the ring. Dropped if the
+   * recorder can not keep up, see stats.rec_stopped */
+  struct recorder *rec;
+
+  /* Written by the capture thread.
+   * Buffers the device lost (gaps in the sequence numbers or
+   * timestamps) are replaced by padded bytes of silence,
+   * unless the gap is longer than the ring, which counts
+   * as lost sync. Buffers that arrive twice or out of
+   * order are skipped */
+  struct {
+    _Atomic uint64_t buffers;
+    _Atomic uint64_t bytes;
+    _Atomic uint64_t dropped;
+    _Atomic uint64_t gaps;
+    _Atomic uint64_t padded;
+    _Atomic uint64_t skipped;
+    _Atomic uint64_t lost_sync;
+    _Atomic uint64_t rec_stopped;
+    _Atomic uint64_t fill_max;
+    struct st_latency dequeue;
+    struct st_latency ring_write;
+  } stats;
+};
+
+bool ct_setup(struct capture_thread *ct, struct sdr *dev, size_t ring_len);
+
+bool ct_set_recorder(struct capture_thread *ct, struct recorder *rec);
+
+bool ct_start(struct capture_thread *ct);
+bool ct_stop(struct capture_thread *ct);
+
+ssize_t ct_peek(struct capture_thread *ct, size_t len, void **samples);
+bool ct_done(struct capture_thread *ct);
+bool ct_seek(struct capture_thread *ct, size_t len);
+uint64_t ct_consumed(struct capture_thread *ct);
+void ct_get_stats(struct capture_thread *ct, struct st_report *report);
+
+bool ct_destroy(struct capture_thread *ct);
@@ -0,0 +1,333 @@
+/*
+ * Copyright 2016 Leonard Göhrs <leonard@goehrs.eu>
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+
+#include "cfar.h"
+
+/* Cells next to a bin that are not used for its
+ * noise estimate, and training cells on every side.
+ * Broadcast stations are about 100 bins wide */
+#define CF_GUARD (8)
+#define CF_TRAIN (32)
+
+/* The noise level may at most double over this many bins */
+#define CF_LEVEL_DOUBLING (64)
+
+/* A side needs this many usable training cells */
+#define CF_MIN_CELLS (4)
+
+/* Bins this close to 0 hold the DC offset of the receivers */
+#define CF_DC_BINS (1)
+
+/* Ratios to the noise level at which bins enter and
+ * leave the signal state. The magnitudes are those of
+ * the cross spectra, so 4 is about 6 dB */
+#define CF_SIGNAL_ON (4.0f)
+#define CF_SIGNAL_OFF (2.0f)
+
+/* Ratios at which bins enter and leave the noise state */
+#define CF_NOISE_ON (1.0f)
+#define CF_NOISE_OFF (1.5f)
+
+/* Shorter runs of bins are not reported as spans */
+#define CF_MIN_SIGNAL (2)
+#define CF_MIN_NOISE (8)
+
+bool cf_init(struct cf_detector *cf, size_t len_fft)
+{
+  if (!cf) {
+    fprintf(stderr, "cf_init: No cf structure\n");
+
+    return(false);
+  }
+
+  if (len_fft < 8 * (CF_GUARD + CF_TRAIN)) {
+    fprintf(stderr, "cf_init: fft length %ld is too short\n", len_fft);
+
+    return(false);
+  }
+
+  cf->len_fft= len_fft;
+  cf->margin= len_fft / 16;
+  cf->slope= exp2f(1.0f / CF_LEVEL_DOUBLING);
+
+  cf->mag= calloc(len_fft, sizeof(*cf->mag));
+  cf->sums= calloc(len_fft + 1, sizeof(*cf->sums));
+  cf->counts= calloc(len_fft + 1, sizeof(*cf->counts));
+  cf->levels= calloc(len_fft, sizeof(*cf->levels));
+  cf->states= calloc(len_fft, sizeof(*cf->states));
+
+  if (!cf->mag || !cf->sums || !cf->counts || !cf->levels || !cf->states) {
+    fprintf(stderr, "cf_init: allocating buffers failed\n");
+
+    return(false);
+  }
+
+  /* Every span is followed by at least one other bin */
+  for (size_t kind=0; kind<2; kind++) {
+    cf->spans[kind]= calloc(len_fft / 2 + 1, sizeof(*cf->spans[kind]));
+    cf->back[kind]= calloc(len_fft / 2 + 1, sizeof(*cf->back[kind]));
+    cf->num_spans[kind]= 0;
+
+    if (!cf->spans[kind] || !cf->back[kind]) {
+      fprintf(stderr, "cf_init: allocating span buffers failed\n");
+
+      return(false);
+    }
+  }
+
+  memset(cf->states, -1, len_fft);
+
+  pthread_mutex_init(&cf->lock, NULL);
+
+  return(true);
+}
+
+/**
+ * Mean of the training cells from start to end-1,
+ * or infinity if too few of them are usable
+ */
+static float cf_side_level(struct cf_detector *cf, size_t start, size_t end)
+{
+  uint32_t count= cf->counts[end] - cf->counts[start];
+
+  if (count < CF_MIN_CELLS) {
+    return(INFINITY);
+  }
+
+  return((cf->sums[end] - cf->sums[start]) / count);
+}
+
+/**
+ * Noise level around bin i, the lower of the levels on
+ * both sides, or infinity if neither side can be used
+ */
+static float cf_noise_level(struct cf_detector *cf, size_t i)
+{
+  size_t lo= cf->margin, hi= cf->len_fft - cf->margin;
+
+  size_t left_start= (i >= lo + CF_GUARD + CF_TRAIN) ? i - CF_GUARD - CF_TRAIN : lo;
+  size_t left_end= (i >= lo + CF_GUARD) ? i - CF_GUARD : lo;
+  size_t right_start= (i + CF_GUARD + 1 <= hi) ? i + CF_GUARD + 1 : hi;
+  size_t right_end= (i + CF_GUARD + CF_TRAIN + 1 <= hi) ? i + CF_GUARD + CF_TRAIN + 1 : hi;
+
+  float left= cf_side_level(cf, left_start, left_end);
+  float right= cf_side_level(cf, right_start, right_end);
+
+  return((left < right) ? left : right);
+}
+
+/**
+ * Turn runs of bins enclosed by signals on both sides
+ * into signal bins, if they are narrower than a training
+ * window. Such a gap can not be told apart from a dip
+ * in the spectrum of a single signal.
+ */
+static void cf_fill_gaps(struct cf_detector *cf)
+{
+  size_t lo= cf->margin, hi= cf->len_fft - cf->margin;
+  size_t last_signal= SIZE_MAX;
+
+  for (size_t i=lo; i<hi; i++) {
+    if (cf->states[i] != CF_SIGNAL) {
+      continue;
+    }
+
+    if (last_signal != SIZE_MAX && i - last_signal > 1 && i - last_signal <= CF_TRAIN) {
+      memset(&cf->states[last_signal + 1], CF_SIGNAL, i - last_signal - 1);
+    }
+
+    last_signal= i;
+  }
+}
+
+/**
+ * Collect the runs of bins in state kind that
+ * are at least min_len bins long into dst
+ */
+static size_t cf_collect(struct cf_detector *cf, enum cf_kind kind, size_t min_len,
+                         struct doa_span *dst)
+{
+  int64_t half= cf->len_fft / 2;
+  size_t num= 0;
+
+  for (size_t i=cf->margin; i<cf->len_fft - cf->margin;) {
+    if (cf->states[i] != (int8_t)kind) {
+      i++;
+      continue;
+    }
+
+    size_t start= i;
+
+    while (i < cf->len_fft - cf->margin && cf->states[i] == (int8_t)kind) i++;
+
+    if (i - start >= min_len) {
+      dst[num].first= (int64_t)start - half;
+      dst[num].last= (int64_t)i - half;
+      num++;
+    }
+  }
+
+  return(num);
+}
+
+/**
+ * Update the detector with the magnitudes of a
+ * combiner output, see cb_step.
+ */
+bool cf_update(struct cf_detector *cf, const float *mag)
+{
+  size_t len= cf->len_fft;
+
+  /* Center the band on bin 0 so that
+   * neighbouring bins are next to each other */
+  memcpy(cf->mag, &mag[len/2], sizeof(*cf->mag) * (len/2));
+  memcpy(&cf->mag[len/2], mag, sizeof(*cf->mag) * (len/2));
+
+  /* Signals found in the last output are not trained on */
+  cf->sums[0]= 0;
+  cf->counts[0]= 0;
+
+  for (size_t i=0; i<len; i++) {
+    bool train= cf->states[i] != CF_SIGNAL;
+
+    cf->sums[i + 1]= cf->sums[i] + (train ? cf->mag[i] : 0);
+    cf->counts[i + 1]= cf->counts[i] + train;
+  }
+
+  size_t lo= cf->margin, hi= len - cf->margin;
+
+  for (size_t i=lo; i<hi; i++) {
+    cf->levels[i]= cf_noise_level(cf, i);
+  }
+
+  /* Bins inside a wide signal have only signal bins in their
+   * training windows, either censored or, before the signal was
+   * found, at its level. The noise floor changes slowly across
+   * the band, so it is limited to the level next to the
+   * signal plus the slope it may have */
+  for (size_t i=lo + 1; i<hi; i++) {
+    float limit= cf->levels[i - 1] * cf->slope;
+
+    if (cf->levels[i] > limit) cf->levels[i]= limit;
+  }
+
+  for (size_t i=hi - 1; i-- > lo;) {
+    float limit= cf->levels[i + 1] * cf->slope;
+
+    if (cf->levels[i] > limit) cf->levels[i]= limit;
+  }
+
+  for (size_t i=lo; i<hi; i++) {
+    if (llabs((int64_t)i - (int64_t)(len/2)) <= CF_DC_BINS) {
+      continue;
+    }
+
+    float noise= cf->levels[i];
+
+    /* Keep the state while the whole band is censored */
+    if (isinf(noise)) {
+      continue;
+    }
+
+    float ratio= cf->mag[i] / noise;
+    int8_t state= cf->states[i];
+
+    if (state == CF_SIGNAL) {
+      if (ratio < CF_SIGNAL_OFF) state= -1;
+    }
+    else if (ratio > CF_SIGNAL_ON) {
+      state= CF_SIGNAL;
+    }
+
+    if (state == CF_NOISE) {
+      if (ratio > CF_NOISE_OFF) state= -1;
+    }
+    else if (state != CF_SIGNAL && ratio < CF_NOISE_ON) {
+      state= CF_NOISE;
+    }
+
+    cf->states[i]= state;
+  }
+
+  cf_fill_gaps(cf);
+
+  size_t num_signals= cf_collect(cf, CF_SIGNAL, CF_MIN_SIGNAL, cf->back[CF_SIGNAL]);
+  size_t num_noise= cf_collect(cf, CF_NOISE, CF_MIN_NOISE, cf->back[CF_NOISE]);
+
+  pthread_mutex_lock(&cf->lock);
+
+  for (size_t kind=0; kind<2; kind++) {
+    struct doa_span *tmp= cf->spans[kind];
+
+    cf->spans[kind]= cf->back[kind];
+    cf->back[kind]= tmp;
+  }
+
+  cf->num_spans[CF_SIGNAL]= num_signals;
+  cf->num_spans[CF_NOISE]= num_noise;
+
+  pthread_mutex_unlock(&cf->lock);
+
+  return(true);
+}
+
+/**
+ * Copy up to max of the spans that were found in the
+ * last output to dst. Returns the number of spans found,
+ * which may be more than max.
+ * May be called from any thread.
+ */
+size_t cf_get_spans(struct cf_detector *cf, enum cf_kind kind,
+                    struct doa_span *dst, size_t max)
+{
+  pthread_mutex_lock(&cf->lock);
+
+  size_t num= cf->num_spans[kind];
+
+  memcpy(dst, cf->spans[kind], sizeof(*dst) * (num < max ? num : max));
+
+  pthread_mutex_unlock(&cf->lock);
+
+  return(num);
+}
+
+void cf_destroy(struct cf_detector *cf)
+{
+  pthread_mutex_destroy(&cf->lock);
+
+  free(cf->mag);
+  free(cf->sums);
+  free(cf->counts);
+  free(cf->levels);
+  free(cf->states);
+  for (size_t kind=0; kind<2; kind++) {
+    free(cf->spans[kind]);
+    free(cf->back[kind]);
+  }
+}
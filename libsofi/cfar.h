@@ -0,0 +1,86 @@
+/*
+ * Copyright 2016 Leonard Göhrs <leonard@goehrs.eu>
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include <pthread.h>
+
+#include "doa.h"
+
+enum cf_kind {
+  CF_SIGNAL= 0,
+  CF_NOISE= 1,
+};
+
+/* Constant false alarm rate detector that finds signal
+ * and noise bins in the magnitudes of every combiner output.
+ * Every bin is compared against the noise level estimated
+ * from the training cells on both sides of it, guard cells
+ * next to it are left out. The level is the mean of the
+ * quieter side, and bins that were detected as signals in
+ * the previous output are not used for training. That way
+ * the edges of wide signals are found right away and the
+ * detection grows into their middle over the next outputs.
+ * The level may only change slowly from bin to bin, so bins
+ * whose training cells are all inside a signal use the level
+ * next to it. Gaps narrower than a training window between
+ * signal bins are closed.
+ * A bin enters and leaves the signal and noise states at
+ * different thresholds, so the spans do not flicker from
+ * one output to the next.
+ * Runs in the combiner thread, see cbt_set_detector. The spans
+ * are read using cf_get_spans from any thread. */
+struct cf_detector {
+  size_t len_fft;
+
+  /* Bins closer than this to the band edges are ignored */
+  size_t margin;
+
+  /* Magnitudes centered on bin 0, prefix sums and
+   * counts of those that may be used for training */
+  float *mag;
+  double *sums;
+  uint32_t *counts;
+
+  /* Noise level per bin, infinity if unknown, and the
+   * factor by which it may change from bin to bin */
+  float *levels;
+  float slope;
+
+  /* Per bin, CF_SIGNAL, CF_NOISE or -1 for neither */
+  int8_t *states;
+
+  /* Per kind, the spans of the last output and the
+   * ones that are being collected. Swapped under lock */
+  pthread_mutex_t lock;
+  struct doa_span *spans[2];
+  struct doa_span *back[2];
+  size_t num_spans[2];
+};
+
+bool cf_init(struct cf_detector *cf, size_t len_fft);
+bool cf_update(struct cf_detector *cf, const float *mag);
+size_t cf_get_spans(struct cf_detector *cf, enum cf_kind kind,
+                    struct doa_span *dst, size_t max);
+void cf_destroy(struct cf_detector *cf);
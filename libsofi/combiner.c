@@ -17,6 +17,7 @@
  * Boston, MA 02110-1301, USA.
  */
 
+
 #include <pthread.h>
 #include <stdio.h>
 #include <stdint.h>
@@ -32,23 +33,393 @@
 
 #include "fft_thread.h"
 
-static uint64_t factorial(uint64_t x)
+/* Worker ranges are rounded to this many bins
+ * to keep the volk kernels on aligned data */
+#define CB_BIN_ALIGN (16)
+
+/* Bins per block of the fused kernel. N spectra of
+ * this many bins have to fit into the L1 cache */
+#define CB_BLOCK_BINS (64)
+
+/**
+ * Number of workers that should be used for
+ * a given number of inputs.
+ * The number of edges grows quadratically with the
+ * number of inputs, so do the number of workers.
+ */
+size_t cb_workers_for(size_t num_ffts)
+{
+  size_t num_edges= num_ffts * (num_ffts - 1) / 2;
+  size_t num_workers= 1 + num_edges / CB_EDGES_PER_WORKER;
+
+  long num_cpus= sysconf(_SC_NPROCESSORS_ONLN);
+
+  if (num_cpus > 0 && num_workers > (size_t)num_cpus) {
+    num_workers= num_cpus;
+  }
+
+  return(num_workers);
+}
+
+/**
+ * Fused conjugate multiply accumulate over all edges.
+ *
+ * For every pair a<b of the num_ffts spectra (in the order
+ * used by cb_init) accs[edge] += spectra[a] * conj(spectra[b])
+ * is calculated for the bins bin_start to bin_end.
+ * If autos is not NULL the auto spectra |spectra[a]|^2 are
+ * accumulated into autos[a] as well.
+ * The bins are processed in blocks that are small enough for
+ * all spectra to stay in the L1 cache while every edge is updated.
+ */
+void cb_cmac(size_t num_ffts, fftwf_complex *const *spectra,
+             fftwf_complex *const *accs, float *const *autos,
+             size_t bin_start, size_t bin_end)
+{
+  for (size_t blk_start= bin_start; blk_start < bin_end; blk_start+= CB_BLOCK_BINS) {
+    size_t blk_end= blk_start + CB_BLOCK_BINS;
+    if (blk_end > bin_end) blk_end= bin_end;
+
+    size_t ei=0;
+
+    for (size_t ina=0; ina<num_ffts; ina++) {
+      const float *restrict a= (const float *)spectra[ina];
+
+      if (autos) {
+        float *restrict aut= autos[ina];
+
+        for (size_t k= blk_start; k < blk_end; k++) {
+          float ar= a[2*k], ai= a[2*k+1];
+
+          aut[k]+= ar*ar + ai*ai;
+        }
+      }
+
+      for (size_t inb=ina+1; inb<num_ffts; inb++, ei++) {
+        const float *restrict b= (const float *)spectra[inb];
+        float *restrict acc= (float *)accs[ei];
+
+        for (size_t k= 2*blk_start; k < 2*blk_end; k+= 2) {
+          float ar= a[k], ai= a[k+1];
+          float br= b[k], bi= b[k+1];
+
+          acc[k]+=   ar*br + ai*bi;
+          acc[k+1]+= ai*br - ar*bi;
+        }
+      }
+    }
+  }
+}
+
+static bool cb_sums_alloc(struct combiner *cb, struct cb_sums *sums)
+{
+  sums->accs= calloc(cb->num_edges, sizeof(*sums->accs));
+  sums->autos= NULL;
+
+  if (!sums->accs) {
+    return(false);
+  }
+
+  for (size_t ei=0; ei<cb->num_edges; ei++) {
+    sums->accs[ei]= fftwf_alloc_complex(cb->len_fft);
+
+    if (!sums->accs[ei]) {
+      return(false);
+    }
+
+    memset(sums->accs[ei], 0, sizeof(*sums->accs[ei]) * cb->len_fft);
+  }
+
+  if (cb->covariance) {
+    sums->autos= calloc(cb->num_ffts, sizeof(*sums->autos));
+
+    if (!sums->autos) {
+      return(false);
+    }
+
+    for (size_t fi=0; fi<cb->num_ffts; fi++) {
+      sums->autos[fi]= fftwf_alloc_real(cb->len_fft);
+
+      if (!sums->autos[fi]) {
+        return(false);
+      }
+
+      memset(sums->autos[fi], 0, sizeof(*sums->autos[fi]) * cb->len_fft);
+    }
+  }
+
+  return(true);
+}
+
+static void cb_sums_free(struct combiner *cb, struct cb_sums *sums)
+{
+  if (sums->accs) {
+    for (size_t ei=0; ei<cb->num_edges; ei++) {
+      fftwf_free(sums->accs[ei]);
+    }
+
+    free(sums->accs);
+  }
+
+  if (sums->autos) {
+    for (size_t fi=0; fi<cb->num_ffts; fi++) {
+      fftwf_free(sums->autos[fi]);
+    }
+
+    free(sums->autos);
+  }
+
+  sums->accs= NULL;
+  sums->autos= NULL;
+}
+
+static void cb_sums_clear(struct combiner *cb, struct cb_sums *sums,
+                          size_t bin_start, size_t bin_end)
+{
+  for (size_t ei=0; ei<cb->num_edges; ei++) {
+    memset(sums->accs[ei] + bin_start, 0,
+           sizeof(*sums->accs[ei]) * (bin_end - bin_start));
+  }
+
+  if (sums->autos) {
+    for (size_t fi=0; fi<cb->num_ffts; fi++) {
+      memset(sums->autos[fi] + bin_start, 0,
+             sizeof(*sums->autos[fi]) * (bin_end - bin_start));
+    }
+  }
+}
+
+/**
+ * dst= dst * dst_scale + src * src_scale
+ * for the bins bin_start to bin_end
+ */
+static void cb_sums_axpby(struct combiner *cb,
+                          struct cb_sums *dst, float dst_scale,
+                          const struct cb_sums *src, float src_scale,
+                          size_t bin_start, size_t bin_end)
+{
+  for (size_t ei=0; ei<cb->num_edges; ei++) {
+    float *restrict d= (float *)dst->accs[ei];
+    const float *restrict sr= (const float *)src->accs[ei];
+
+    for (size_t k= 2*bin_start; k < 2*bin_end; k++) {
+      d[k]= d[k] * dst_scale + sr[k] * src_scale;
+    }
+  }
+
+  if (dst->autos) {
+    for (size_t fi=0; fi<cb->num_ffts; fi++) {
+      float *restrict d= dst->autos[fi];
+      const float *restrict sr= src->autos[fi];
+
+      for (size_t k= bin_start; k < bin_end; k++) {
+        d[k]= d[k] * dst_scale + sr[k] * src_scale;
+      }
+    }
+  }
+}
+
+/**
+ * Write the hermitian covariance matrices for the bins
+ * bin_start to bin_end into cov_dst.
+ */
+static void cb_output_covariance(struct combiner *cb, const struct cb_sums *sums,
+                                 float norm, size_t bin_start, size_t bin_end)
+{
+  size_t n= cb->num_ffts;
+
+  for (size_t k= bin_start; k < bin_end; k++) {
+    float *restrict mat= (float *)(cb->cov_dst + k * cb->cov_stride);
+
+    for (size_t ina=0, ei=0; ina<n; ina++) {
+      mat[2*(ina*n + ina)]= sums->autos[ina][k] * norm;
+      mat[2*(ina*n + ina) + 1]= 0;
+
+      for (size_t inb=ina+1; inb<n; inb++, ei++) {
+        const float *acc= (const float *)(sums->accs[ei] + k);
+        float re= acc[0], im= acc[1];
+
+        if (cb->ramps) {
+          const float *rot= (const float *)(cb->ramps[ei] + k);
+
+          re= acc[0]*rot[0] - acc[1]*rot[1];
+          im= acc[0]*rot[1] + acc[1]*rot[0];
+        }
+
+        mat[2*(ina*n + inb)]=      re * norm;
+        mat[2*(ina*n + inb) + 1]=  im * norm;
+        mat[2*(inb*n + ina)]=      re * norm;
+        mat[2*(inb*n + ina) + 1]= -im * norm;
+      }
+    }
+  }
+}
+
+static bool cb_work(struct cb_worker *w)
 {
-  uint64_t pivot=1;
+  struct combiner *cb= w->cb;
+  size_t bin_start= w->bin_start;
+  size_t bin_end= w->bin_end;
+  size_t bins= bin_end - bin_start;
+
+  struct cb_sums *part= &cb->partials[cb->partial_next];
+
+  /* In sliding mode the partial sum that is about to be
+   * overwritten is the oldest one in the window */
+  if (cb->mode == CB_INTEGRATE_SLIDING && !cb->resync &&
+      cb->partials_filled == cb->num_partials) {
+    cb_sums_axpby(cb, &cb->sum, 1, part, -1, bin_start, bin_end);
+  }
+
+  cb_sums_clear(cb, part, bin_start, bin_end);
+
+  for (uint64_t frame= cb->frame_no; frame < cb->frame_no + cb->hop; frame++) {
+    uint64_t t_wait= st_now_ns();
+
+    for(size_t fi=0; fi<cb->num_ffts; fi++) {
+      w->buffers[fi]= ft_get_frame(&cb->inputs[fi], frame);
 
-  for(uint64_t i=1; i<=x; i++) pivot*=i;
+      if(!w->buffers[fi]) {
+        fprintf(stderr, "cb_work: Getting frame from fft_thread failed\n");
+
+        return(false);
+      }
+
+      w->spectra[fi]= w->buffers[fi]->out;
+    }
+
+    st_latency_add(&w->frame_wait, st_now_ns() - t_wait);
+
+    /* Calculate Phase difference between
+     * the two inputs of every edge for all frequencies */
+    cb_cmac(cb->num_ffts, w->spectra, part->accs, part->autos,
+            bin_start, bin_end);
+
+    for(size_t fi=0; fi<cb->num_ffts; fi++) {
+      if(!ft_release_frame(&cb->inputs[fi], w->buffers[fi])) {
+        fprintf(stderr, "cb_work: Relasing fft frame failed\n");
+
+        return(false);
+      }
+    }
+  }
+
+  const struct cb_sums *out= part;
+
+  if (cb->mode == CB_INTEGRATE_SLIDING) {
+    if (cb->resync) {
+      /* Rebuild the window sum from the partial sums once
+       * per lap of the ring, so the rounding errors of the
+       * running add/subtract do not pile up */
+      cb_sums_axpby(cb, &cb->sum, 0, part, 1, bin_start, bin_end);
+
+      for (size_t pi=0; pi<cb->num_partials; pi++) {
+        if (pi != cb->partial_next) {
+          cb_sums_axpby(cb, &cb->sum, 1, &cb->partials[pi], 1, bin_start, bin_end);
+        }
+      }
+    }
+    else {
+      cb_sums_axpby(cb, &cb->sum, 1, part, 1, bin_start, bin_end);
+    }
+
+    out= &cb->sum;
+  }
+
+  if (cb->mode == CB_INTEGRATE_EXPONENTIAL) {
+    cb_sums_axpby(cb, &cb->sum, cb->decay, part, 1, bin_start, bin_end);
+
+    out= &cb->sum;
+  }
+
+  if (cb->cov_dst) {
+    cb_output_covariance(cb, out, 1.0f / cb->sum_frames, bin_start, bin_end);
+  }
+
+  float *mag_dst= cb->mag_dst + bin_start;
+
+  memset(mag_dst, 0, sizeof(*mag_dst) * bins);
+
+  for(size_t ei=0; ei<cb->num_edges; ei++) {
+    fftwf_complex *acc= out->accs[ei] + bin_start;
+
+    /* Calculate and accumulate magnitudes squared */
+    volk_32fc_magnitude_squared_32f(w->tmp_real, acc, bins);
 
-  return(pivot);
+    volk_32f_x2_add_32f(mag_dst, mag_dst, w->tmp_real, bins);
+
+    /* The phase ramps do not change the magnitudes,
+     * they only have to be applied to the phases */
+    if (cb->ramps) {
+      volk_32fc_x2_multiply_32fc(w->tmp_complex, acc,
+                                 cb->ramps[ei] + bin_start, bins);
+
+      acc= w->tmp_complex;
+    }
+
+    /* Calculate and output phase differences */
+    volk_32fc_s32f_atan2_32f(cb->phase_dsts[ei] + bin_start, acc, 1.0, bins);
+  }
+
+  volk_32f_s32f_normalize(mag_dst,
+                          1.0/(cb->sum_frames * cb->num_edges),
+                          bins);
+
+  return(true);
+}
+
+static void *cb_worker_main(void *dat)
+{
+  struct cb_worker *w= dat;
+  struct combiner *cb= w->cb;
+
+  for(;;) {
+    pthread_mutex_lock(&cb->step_lock);
+
+    while (cb->running && cb->generation == w->generation) {
+      pthread_cond_wait(&cb->step_notify, &cb->step_lock);
+    }
+
+    if (!cb->running) {
+      pthread_mutex_unlock(&cb->step_lock);
+
+      return(NULL);
+    }
+
+    w->generation= cb->generation;
+
+    pthread_mutex_unlock(&cb->step_lock);
+
+    bool ok= cb_work(w);
+
+    pthread_mutex_lock(&cb->step_lock);
+
+    if (!ok) cb->failed= true;
+
+    if (!--cb->workers_pending) {
+      pthread_cond_broadcast(&cb->step_notify);
+    }
+
+    pthread_mutex_unlock(&cb->step_lock);
+  }
 }
 
-bool cb_init(struct combiner *cb, struct fft_thread *ffts, size_t num_ffts)
+/**
+ * Setup a combiner that calculates the cross spectra
+ * of all num_ffts*(num_ffts-1)/2 input pairs.
+ *
+ * @param num_workers number of threads to spread the work on,
+ *        see cb_workers_for. The fft threads must be set up
+ *        with num_workers consumers.
+ */
+bool cb_init(struct combiner *cb, struct fft_thread *ffts, size_t num_ffts, size_t num_workers)
 {
-  if (!cb || !ffts || !num_ffts) {
+  if (!cb || !ffts || num_ffts < 2 || !num_workers) {
     fprintf(stderr, "cb_init: NULL as input\n");
     return (false);
   }
 
-  cb->num_edges= factorial(num_ffts - 1);
+  cb->num_edges= num_ffts * (num_ffts - 1) / 2;
   cb->num_ffts= num_ffts;
   cb->len_fft= ffts[0].len_fft;
 
@@ -59,135 +430,523 @@ bool cb_init(struct combiner *cb, struct fft_thread *ffts, size_t num_ffts)
       fprintf(stderr, "cb_init: fft lengths do not match\n");
       return(false);
     }
+
+    if (ffts[i].consumers != num_workers) {
+      fprintf(stderr, "cb_init: fft thread %ld is not set up for %ld consumers\n",
+              i, num_workers);
+      return(false);
+    }
   }
 
-  cb->tmp_cplx= fftwf_alloc_complex(cb->len_fft);
-  cb->tmp_real= fftwf_alloc_real(cb->len_fft);
+  cb->inputs= ffts;
+  cb->outputs= calloc(cb->num_edges, sizeof(*cb->outputs));
 
-  if(!cb->tmp_cplx || !cb->tmp_real) {
-    fprintf(stderr, "cb_init: allocating temp buffers failed\n");
+  if(!cb->outputs) {
+    fprintf(stderr, "cb_init: allocating output buffers failed\n");
 
     return(false);
   }
 
-  cb->inputs= calloc(num_ffts, sizeof(*cb->inputs));
-  cb->outputs= calloc(num_ffts, sizeof(*cb->outputs));
+  for(size_t ina=0, i=0; ina<num_ffts; ina++) {
+    for(size_t inb=ina+1; inb<num_ffts; inb++, i++) {
+      fprintf(stderr, "cb_init: edge %ld: %ld <-> %ld\n", i, ina, inb);
 
-  if(!cb->inputs || !cb->outputs) {
-    fprintf(stderr, "cb_init: allocating i/o buffers failed\n");
+      cb->outputs[i].input_a= ina;
+      cb->outputs[i].input_b= inb;
+    }
+  }
 
+  cb->ramps= NULL;
+  cb->delays= NULL;
+  cb->cal_phases= NULL;
+  cb->cal_delays= NULL;
+  cb->covariance= false;
+  cb->cov_stride= (num_ffts * num_ffts + CB_COV_ALIGN - 1) & ~(size_t)(CB_COV_ALIGN - 1);
+
+  cb->partials= NULL;
+  cb->num_partials= 0;
+  cb->sum.accs= NULL;
+  cb->sum.autos= NULL;
+
+  if (!cb_set_integration(cb, CB_INTEGRATE_BLOCK, CB_DECIMATOR, 0)) {
     return(false);
   }
 
-  for(size_t fi=0; fi<num_ffts; fi++) {
-    cb->inputs[fi].thread= &ffts[fi];
-    cb->inputs[fi].buffer= NULL;
+  cb->num_workers= num_workers;
+  cb->workers= calloc(num_workers, sizeof(*cb->workers));
+
+  if (!cb->workers) {
+    fprintf(stderr, "cb_init: allocating workers failed\n");
+
+    return(false);
   }
 
-  for(size_t ina=0, i=0; ina<num_ffts; ina++) {
-    for(size_t inb=ina+1; inb<num_ffts; inb++, i++) {
-      fprintf(stderr, "cb_run: edge %ld: %ld <-> %ld\n", i, ina, inb);
+  size_t bins_per_worker= (cb->len_fft + num_workers - 1) / num_workers;
+  bins_per_worker= (bins_per_worker + CB_BIN_ALIGN - 1) & ~(size_t)(CB_BIN_ALIGN - 1);
 
-      cb->outputs[i].input_a= ina;
-      cb->outputs[i].input_b= inb;
+  for (size_t wi=0; wi<num_workers; wi++) {
+    struct cb_worker *w= &cb->workers[wi];
 
-      cb->outputs[i].acc= fftwf_alloc_complex(cb->len_fft);
+    w->cb= cb;
+    w->generation= 0;
+    st_latency_init(&w->frame_wait);
 
-      if(!cb->outputs[i].acc) {
-        fprintf(stderr, "cb_run: allocating mean buffer failed\n");
+    w->bin_start= wi * bins_per_worker;
+    w->bin_end= w->bin_start + bins_per_worker;
 
-        return(false);
-      }
+    if (w->bin_start > cb->len_fft) w->bin_start= cb->len_fft;
+    if (w->bin_end > cb->len_fft) w->bin_end= cb->len_fft;
 
-      memset(cb->outputs[i].acc, 0, sizeof(*cb->outputs[i].acc) * cb->len_fft);
+    w->tmp_real= fftwf_alloc_real(bins_per_worker);
+    w->tmp_complex= fftwf_alloc_complex(bins_per_worker);
+    w->buffers= calloc(num_ffts, sizeof(*w->buffers));
+    w->spectra= calloc(num_ffts, sizeof(*w->spectra));
+
+    if(!w->tmp_real || !w->tmp_complex || !w->buffers || !w->spectra) {
+      fprintf(stderr, "cb_init: allocating temp buffers failed\n");
+
+      return(false);
     }
   }
 
+  pthread_mutex_init(&cb->step_lock, NULL);
+  pthread_cond_init(&cb->step_notify, NULL);
+  cb->generation= 0;
+  cb->workers_pending= 0;
+  cb->running= true;
+  cb->failed= false;
+  st_latency_init(&cb->step_time);
+
+  /* Worker 0 runs on the thread calling cb_step */
+  for (size_t wi=1; wi<num_workers; wi++) {
+    if (pthread_create(&cb->workers[wi].thread, NULL,
+                       &cb_worker_main, &cb->workers[wi]) != 0) {
+      fprintf(stderr, "cb_init: pthread_create failed\n");
+
+      return(false);
+    }
+  }
+
+  fprintf(stderr, "cb_init: %ld edges on %ld workers\n", cb->num_edges, num_workers);
+
   return(true);
 }
 
-bool cb_step(struct combiner *cb, float *mag_dst, float **phase_dsts)
+static void cb_free_integration(struct combiner *cb)
 {
-  do {
-    for(size_t fi=0; fi<cb->num_ffts; fi++) {
-      cb->inputs[fi].buffer= ft_get_frame(cb->inputs[fi].thread, cb->frame_no);
+  for (size_t pi=0; pi<cb->num_partials; pi++) {
+    cb_sums_free(cb, &cb->partials[pi]);
+  }
 
-      if(!cb->inputs[fi].buffer) {
-        fprintf(stderr, "cb_step: Getting frame from fft_thread failed\n");
+  free(cb->partials);
+  cb_sums_free(cb, &cb->sum);
 
-        return(false);
-      }
+  cb->partials= NULL;
+  cb->num_partials= 0;
+}
+
+/**
+ * Select how frames are integrated and restart the integration.
+ * Must not be called while cb_step is running.
+ *
+ * CB_INTEGRATE_BLOCK: every output integrates the next window
+ *   frames, the accumulators are reset afterwards. hop is ignored.
+ * CB_INTEGRATE_SLIDING: every hop frames the sum over the
+ *   last window frames is output. The window is kept as a ring
+ *   of window/hop partial sums, so window must be a multiple of hop.
+ * CB_INTEGRATE_EXPONENTIAL: every hop frames an exponential moving
+ *   average with a time constant of window frames is output.
+ */
+bool cb_set_integration(struct combiner *cb, enum cb_integration mode,
+                        size_t window, size_t hop)
+{
+  size_t num_partials= 1;
+
+  if (!window) {
+    fprintf(stderr, "cb_set_integration: window must not be empty\n");
+
+    return(false);
+  }
+
+  switch (mode) {
+  case CB_INTEGRATE_BLOCK:
+    hop= window;
+    break;
+
+  case CB_INTEGRATE_SLIDING:
+    if (!hop || window % hop) {
+      fprintf(stderr, "cb_set_integration: window must be a multiple of hop\n");
+
+      return(false);
     }
 
-    for(size_t ei=0; ei<cb->num_edges; ei++) {
-      size_t ina= cb->outputs[ei].input_a;
-      size_t inb= cb->outputs[ei].input_b;
+    num_partials= window / hop;
+    break;
 
-      /* Calculate Phase difference between
-       * the two inputs for all frequencies */
-      volk_32fc_x2_multiply_conjugate_32fc(cb->tmp_cplx,
-                                           cb->inputs[ina].buffer->out,
-                                           cb->inputs[inb].buffer->out,
-                                           cb->len_fft);
+  case CB_INTEGRATE_EXPONENTIAL:
+    if (!hop || hop > window) {
+      fprintf(stderr, "cb_set_integration: hop must be between 1 and window\n");
 
-      volk_32f_x2_add_32f((float *)cb->outputs[ei].acc,
-                          (float *)cb->outputs[ei].acc,
-                          (float *)cb->tmp_cplx,
-                          2*cb->len_fft);
+      return(false);
     }
+    break;
 
-    for(size_t fi=0; fi<cb->num_ffts; fi++) {
-      if(!ft_release_frame(cb->inputs[fi].thread, cb->inputs[fi].buffer)) {
-        fprintf(stderr, "cb_step: Relasing fft frame failed\n");
+  default:
+    fprintf(stderr, "cb_set_integration: unknown mode %d\n", mode);
+
+    return(false);
+  }
+
+  /* Allocated aside, so that a failure leaves
+   * the current integration running */
+  struct cb_sums *partials= calloc(num_partials, sizeof(*partials));
+  struct cb_sums sum= {0};
+  bool ok= partials != NULL;
+
+  for (size_t pi=0; ok && pi<num_partials; pi++) {
+    ok= cb_sums_alloc(cb, &partials[pi]);
+  }
+
+  if (ok && mode != CB_INTEGRATE_BLOCK) {
+    ok= cb_sums_alloc(cb, &sum);
+  }
+
+  if (!ok) {
+    fprintf(stderr, "cb_set_integration: allocating sums failed\n");
+
+    for (size_t pi=0; partials && pi<num_partials; pi++) {
+      cb_sums_free(cb, &partials[pi]);
+    }
+
+    free(partials);
+    cb_sums_free(cb, &sum);
+
+    return(false);
+  }
+
+  cb_free_integration(cb);
+
+  cb->mode= mode;
+  cb->window= window;
+  cb->hop= hop;
+
+  cb->partials= partials;
+  cb->num_partials= num_partials;
+  cb->sum= sum;
+
+  cb->partial_next= 0;
+  cb->partials_filled= 0;
+  cb->sum_frames= 0;
+  cb->decay= 1.0f - (float)hop / window;
+
+  return(true);
+}
+
+/**
+ * Start accumulating the auto spectra needed to
+ * output covariance matrices. This restarts the integration.
+ * Must not be called while cb_step is running.
+ */
+bool cb_enable_covariance(struct combiner *cb)
+{
+  if (cb->covariance) {
+    return(true);
+  }
+
+  cb->covariance= true;
+
+  if (!cb_set_integration(cb, cb->mode, cb->window, cb->hop)) {
+    /* The sums that are kept have no auto spectra */
+    cb->covariance= false;
+
+    return(false);
+  }
+
+  return(true);
+}
+
+static void cb_free_ramps(struct combiner *cb)
+{
+  if (cb->ramps) {
+    for (size_t ei=0; ei<cb->num_edges; ei++) {
+      fftwf_free(cb->ramps[ei]);
+    }
+
+    free(cb->ramps);
+  }
+
+  cb->ramps= NULL;
+}
+
+/**
+ * Recalculate the phase ramps of all edges from the delays
+ * and the calibration, or free them if there is neither
+ */
+static bool cb_update_ramps(struct combiner *cb)
+{
+  if (!cb->delays && !cb->cal_phases && !cb->cal_delays) {
+    cb_free_ramps(cb);
+
+    return(true);
+  }
+
+  if (!cb->ramps) {
+    cb->ramps= calloc(cb->num_edges, sizeof(*cb->ramps));
+
+    if (!cb->ramps) {
+      fprintf(stderr, "cb_update_ramps: allocating phase ramps failed\n");
+
+      return(false);
+    }
+
+    for (size_t ei=0; ei<cb->num_edges; ei++) {
+      cb->ramps[ei]= fftwf_alloc_complex(cb->len_fft);
+
+      if (!cb->ramps[ei]) {
+        fprintf(stderr, "cb_update_ramps: allocating phase ramps failed\n");
+
+        cb_free_ramps(cb);
 
         return(false);
       }
     }
+  }
 
-    cb->frame_no++;
-  } while(cb->frame_no % CB_DECIMATOR);
+  for (size_t ei=0; ei<cb->num_edges; ei++) {
+    size_t ina= cb->outputs[ei].input_a;
+    size_t inb= cb->outputs[ei].input_b;
 
-  memset(mag_dst, 0, sizeof(*mag_dst) * cb->len_fft);
+    double delay= 0, offset= 0;
 
-  for(size_t ei=0; ei<cb->num_edges; ei++) {
-    /* Calculate and accumulate magnitudes squared */
-    volk_32fc_magnitude_squared_32f(cb->tmp_real,
-                                    cb->outputs[ei].acc,
-                                    cb->len_fft);
+    if (cb->delays) delay+= cb->delays[ina] - cb->delays[inb];
+    if (cb->cal_delays) delay+= cb->cal_delays[ina] - cb->cal_delays[inb];
+    if (cb->cal_phases) offset= cb->cal_phases[ina] - cb->cal_phases[inb];
 
-    volk_32f_x2_add_32f(mag_dst, mag_dst,
-                        cb->tmp_real, cb->len_fft);
+    float *ramp= (float *)cb->ramps[ei];
 
-    /* Calculate and output phase differences */
-    volk_32fc_s32f_atan2_32f(phase_dsts[ei],
-                             cb->outputs[ei].acc,
-                             1.0,
-                             cb->len_fft);
+    for (size_t k=0; k<cb->len_fft; k++) {
+      double bin= (k < cb->len_fft/2) ? (double)k : (double)k - cb->len_fft;
+      double phase= offset + 2 * M_PI * bin * delay / cb->len_fft;
 
-    /* Reset accumulators */
-    memset(cb->outputs[ei].acc, 0,
-           sizeof(*cb->outputs[ei].acc) * cb->len_fft);
+      ramp[2*k]= cos(phase);
+      ramp[2*k+1]= sin(phase);
+    }
   }
 
-  volk_32f_s32f_normalize(mag_dst,
-                          1.0/(CB_DECIMATOR * cb->num_edges),
-                          cb->len_fft);
+  return(true);
+}
+
+/**
+ * Copy num values from src to the array at *dst,
+ * which is allocated on first use. A NULL src frees it.
+ */
+static bool cb_store_inputs(float **dst, const float *src, size_t num)
+{
+  if (!src) {
+    free(*dst);
+    *dst= NULL;
+
+    return(true);
+  }
+
+  if (!*dst) {
+    *dst= calloc(num, sizeof(**dst));
+
+    if (!*dst) {
+      fprintf(stderr, "cb_store_inputs: allocation failed\n");
+
+      return(false);
+    }
+  }
+
+  memcpy(*dst, src, sizeof(**dst) * num);
 
   return(true);
 }
 
+/**
+ * Compensate delays between the inputs that are
+ * smaller than a sample, as found by sync_sdrs.
+ * An input that lags by d samples has its spectrum
+ * rotated by exp(2*pi*j*k*d/len_fft) for the signed bin
+ * index k. As the rotation does not change from frame to
+ * frame it is applied once per output to the integrated
+ * cross spectra instead of to every frame.
+ * Must not be called while cb_step is running.
+ *
+ * @param delays num_ffts delays in samples or NULL
+ *        to disable the compensation
+ */
+bool cb_set_delays(struct combiner *cb, const float *delays)
+{
+  if (!cb_store_inputs(&cb->delays, delays, cb->num_ffts)) {
+    return(false);
+  }
+
+  return(cb_update_ramps(cb));
+}
+
+/**
+ * Set the calibration of the antennas. The spectrum of
+ * input i is rotated by
+ *   exp(j*(phases[i] + 2*pi*k*delays[i]/len_fft))
+ * in addition to the delay compensation of cb_set_delays.
+ * The rotations are folded into the same phase ramps, so
+ * the calibration costs nothing per frame.
+ * Must not be called while cb_step is running.
+ *
+ * @param phases num_ffts phase corrections in radians or NULL
+ * @param delays num_ffts delay corrections in samples or NULL
+ */
+bool cb_set_calibration(struct combiner *cb, const float *phases, const float *delays)
+{
+  if (!cb_store_inputs(&cb->cal_phases, phases, cb->num_ffts) ||
+      !cb_store_inputs(&cb->cal_delays, delays, cb->num_ffts)) {
+    return(false);
+  }
+
+  return(cb_update_ramps(cb));
+}
+
+/**
+ * The integrated cross spectrum of an edge that the
+ * last output of cb_step was calculated from. It is not
+ * normalized and neither the delays nor the calibration
+ * are compensated in it.
+ * Valid until the next cb_step.
+ */
+const fftwf_complex *cb_cross_spectrum(struct combiner *cb, size_t edge)
+{
+  if (cb->mode == CB_INTEGRATE_BLOCK) {
+    size_t last= (cb->partial_next + cb->num_partials - 1) % cb->num_partials;
+
+    return(cb->partials[last].accs[edge]);
+  }
+
+  return(cb->sum.accs[edge]);
+}
+
+/**
+ * Integrate the next hop frames and output the results,
+ * see cb_set_integration.
+ *
+ * @param mag_dst mean magnitude of all edges, len_fft values
+ * @param phase_dsts phase of the cross spectrum per edge,
+ *        num_edges arrays of len_fft values
+ * @param cov_dst NULL or the covariance matrices of all inputs.
+ *        len_fft row-major num_ffts x num_ffts matrices, every
+ *        cov_stride complex values. Requires cb_enable_covariance.
+ */
+bool cb_step(struct combiner *cb, float *mag_dst, float **phase_dsts,
+             fftwf_complex *cov_dst)
+{
+  if (cov_dst && !cb->covariance) {
+    fprintf(stderr, "cb_step: covariance output is not enabled\n");
+
+    return(false);
+  }
+
+  uint64_t t_start= st_now_ns();
+
+  pthread_mutex_lock(&cb->step_lock);
+
+  cb->mag_dst= mag_dst;
+  cb->phase_dsts= phase_dsts;
+  cb->cov_dst= cov_dst;
+  cb->failed= false;
+
+  /* Number of frames the output will represent */
+  switch (cb->mode) {
+  case CB_INTEGRATE_SLIDING:
+    cb->sum_frames= cb->hop * (cb->partials_filled < cb->num_partials ?
+                               cb->partials_filled + 1 : cb->num_partials);
+    break;
+
+  case CB_INTEGRATE_EXPONENTIAL:
+    cb->sum_frames= cb->sum_frames * cb->decay + cb->hop;
+    break;
+
+  default:
+    cb->sum_frames= cb->window;
+  }
+
+  cb->resync= (cb->partial_next == cb->num_partials - 1);
+
+  cb->workers_pending= cb->num_workers - 1;
+  cb->generation++;
+
+  pthread_cond_broadcast(&cb->step_notify);
+  pthread_mutex_unlock(&cb->step_lock);
+
+  bool ok= cb_work(&cb->workers[0]);
+
+  pthread_mutex_lock(&cb->step_lock);
+
+  while (cb->workers_pending) {
+    pthread_cond_wait(&cb->step_notify, &cb->step_lock);
+  }
+
+  ok= ok && !cb->failed;
+
+  pthread_mutex_unlock(&cb->step_lock);
+
+  cb->frame_no+= cb->hop;
+
+  cb->partial_next= (cb->partial_next + 1) % cb->num_partials;
+
+  if (cb->partials_filled < cb->num_partials) {
+    cb->partials_filled++;
+  }
+
+  st_latency_add(&cb->step_time, st_now_ns() - t_start);
+
+  return(ok);
+}
+
+/**
+ * Add the statistics of the combiner and its workers to report
+ */
+void cb_get_stats(struct combiner *cb, struct st_report *report)
+{
+  for (size_t wi=0; wi<cb->num_workers; wi++) {
+    st_latency_read(&cb->workers[wi].frame_wait, &report->combiner_wait);
+  }
+
+  st_latency_read(&cb->step_time, &report->combiner_step);
+}
+
 bool cb_cleanup(struct combiner *cb)
 {
-  fftwf_free(cb->tmp_cplx);
-  fftwf_free(cb->tmp_real);
+  pthread_mutex_lock(&cb->step_lock);
 
-  free(cb->inputs);
+  cb->running= false;
 
-  for(size_t ei=0; ei<cb->num_edges; ei++) {
-    fftwf_free(cb->outputs[ei].acc);
+  pthread_cond_broadcast(&cb->step_notify);
+  pthread_mutex_unlock(&cb->step_lock);
+
+  for (size_t wi=0; wi<cb->num_workers; wi++) {
+    if (wi && pthread_join(cb->workers[wi].thread, NULL) != 0) {
+      fprintf(stderr, "cb_cleanup: Could not join worker thread\n");
+
+      return(false);
+    }
+
+    fftwf_free(cb->workers[wi].tmp_real);
+    fftwf_free(cb->workers[wi].tmp_complex);
+    free(cb->workers[wi].buffers);
+    free(cb->workers[wi].spectra);
   }
 
+  free(cb->workers);
+
   free(cb->outputs);
 
+  cb_free_integration(cb);
+  cb_free_ramps(cb);
+
+  free(cb->delays);
+  free(cb->cal_phases);
+  free(cb->cal_delays);
+
   return(true);
 }
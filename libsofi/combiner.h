@@ -19,10 +19,66 @@
 
 #pragma once
 
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include <pthread.h>
+
 #include "fft_thread.h"
+#include "stats.h"
 
+/* Default number of frames to integrate per output */
 #define CB_DECIMATOR (1024)
 
+/* Aim for at least this many edges per worker
+ * before spreading the work over multiple cores */
+#define CB_EDGES_PER_WORKER (16)
+
+/* Covariance matrices start on a new cache line,
+ * the stride is a multiple of this many complex values */
+#define CB_COV_ALIGN (8)
+
+struct combiner;
+
+/* How frames are integrated between two outputs.
+ * See cb_set_integration */
+enum cb_integration {
+  CB_INTEGRATE_BLOCK= 0,
+  CB_INTEGRATE_SLIDING= 1,
+  CB_INTEGRATE_EXPONENTIAL= 2,
+};
+
+/* A set of accumulators for all edges and,
+ * if covariance output is enabled, all inputs */
+struct cb_sums {
+  fftwf_complex **accs;
+  float **autos;
+};
+
+/* Every worker handles a contiguous range of fft bins
+ * for all edges. Each worker fetches the fft frames
+ * on its own and is counted as a separate consumer
+ * by the fft threads. */
+struct cb_worker {
+  struct combiner *cb;
+
+  size_t bin_start;
+  size_t bin_end;
+
+  float *tmp_real;
+  fftwf_complex *tmp_complex;
+
+  struct fft_buffer **buffers;
+  fftwf_complex **spectra;
+
+  pthread_t thread;
+  uint64_t generation;
+
+  /* Time spent in ft_get_frame waiting for the fft threads */
+  struct st_latency frame_wait;
+};
+
 struct combiner {
   size_t num_edges;
   size_t num_ffts;
@@ -30,22 +86,79 @@ struct combiner {
 
   uint64_t frame_no;
 
-  fftwf_complex *tmp_cplx;
-  float *tmp_real;
-
-  struct {
-    struct fft_thread *thread;
-    struct fft_buffer *buffer;
-  } *inputs;
+  struct fft_thread *inputs;
 
   struct {
     size_t input_a;
     size_t input_b;
-
-    fftwf_complex *acc;
   } *outputs;
+
+  /* NULL or per edge phase ramps that remove the
+   * fractional sample delays between the inputs and
+   * apply the calibration. Applied to the outputs,
+   * see cb_set_delays and cb_set_calibration */
+  fftwf_complex **ramps;
+
+  /* Per input, NULL if not set */
+  float *delays;
+  float *cal_phases;
+  float *cal_delays;
+
+  /* Also accumulate the auto spectra per input */
+  bool covariance;
+  size_t cov_stride;
+
+  /* Integration state. Frames are accumulated into
+   * partials[partial_next], block mode uses it as output,
+   * sliding mode keeps a ring of num_partials hop sized
+   * partial sums and exponential mode decays them into sum */
+  enum cb_integration mode;
+  size_t window;
+  size_t hop;
+
+  struct cb_sums *partials;
+  size_t num_partials;
+  size_t partial_next;
+  size_t partials_filled;
+
+  struct cb_sums sum;
+  float sum_frames;
+  float decay;
+
+  struct cb_worker *workers;
+  size_t num_workers;
+
+  /* Per step hand-off to the worker threads */
+  pthread_mutex_t step_lock;
+  pthread_cond_t step_notify;
+  uint64_t generation;
+  size_t workers_pending;
+  bool running;
+  bool failed;
+
+  float *mag_dst;
+  float **phase_dsts;
+  fftwf_complex *cov_dst;
+  bool resync;
+
+  /* Duration of cb_step, written by its caller */
+  struct st_latency step_time;
 };
 
-bool cb_init(struct combiner *cb, struct fft_thread *ffts, size_t num_ffts);
-bool cb_step(struct combiner *cb, float *mag_dst, float **phase_dsts);
+size_t cb_workers_for(size_t num_ffts);
+
+void cb_cmac(size_t num_ffts, fftwf_complex *const *spectra,
+             fftwf_complex *const *accs, float *const *autos,
+             size_t bin_start, size_t bin_end);
+
+bool cb_init(struct combiner *cb, struct fft_thread *ffts, size_t num_ffts, size_t num_workers);
+bool cb_set_integration(struct combiner *cb, enum cb_integration mode,
+                        size_t window, size_t hop);
+bool cb_enable_covariance(struct combiner *cb);
+bool cb_set_delays(struct combiner *cb, const float *delays);
+bool cb_set_calibration(struct combiner *cb, const float *phases, const float *delays);
+const fftwf_complex *cb_cross_spectrum(struct combiner *cb, size_t edge);
+bool cb_step(struct combiner *cb, float *mag_dst, float **phase_dsts,
+             fftwf_complex *cov_dst);
+void cb_get_stats(struct combiner *cb, struct st_report *report);
 bool cb_cleanup(struct combiner *cb);
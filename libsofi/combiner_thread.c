@@ -0,0 +1,458 @@
+/*
+ * Copyright 2016 Leonard Göhrs <leonard@goehrs.eu>
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+
+#include <string.h>
+
+#include "combiner_thread.h"
+
+#include "combiner.h"
+#include "drift.h"
+#include "cfar.h"
+#include "futex_event.h"
+
+#define CBT_FRESH (1u << 31)
+
+/**
+ * Apply integration changes requested by
+ * cbt_set_integration/cbt_enable_covariance
+ * and calibration changes from cbt_set_calibration.
+ */
+static bool cbt_apply_config(struct combiner_thread *cbt)
+{
+  struct combiner *cb= cbt->cb;
+
+  if (atomic_load(&cbt->want_covariance) && !cb->covariance) {
+    if (!cb_enable_covariance(cb)) {
+      return(false);
+    }
+  }
+
+  pthread_mutex_lock(&cbt->config_lock);
+
+  if (cbt->config_pending) {
+    cbt->config_ok= cb_set_integration(cb, cbt->mode, cbt->window, cbt->hop);
+    cbt->config_pending= false;
+
+    pthread_cond_broadcast(&cbt->config_done);
+  }
+
+  bool ok= true;
+
+  if (cbt->cal_pending) {
+    ok= cb_set_calibration(cb,
+                           cbt->cal_has_phases ? cbt->cal_phases : NULL,
+                           cbt->cal_has_delays ? cbt->cal_delays : NULL);
+    cbt->cal_pending= false;
+  }
+
+  pthread_mutex_unlock(&cbt->config_lock);
+
+  return(ok);
+}
+
+static void *cbt_main(void *dat)
+{
+  struct combiner_thread *cbt= dat;
+  struct combiner *cb= cbt->cb;
+  bool ok= true;
+
+  uint64_t seq= 0;
+
+  while (ok && atomic_load_explicit(&cbt->running, memory_order_relaxed)) {
+    struct cbt_result *res= &cbt->results[cbt->back];
+
+    if (!cbt_apply_config(cbt)) {
+      ok= false;
+      break;
+    }
+
+    if (cb->covariance && !res->cov) {
+      res->cov= aligned_alloc(64, sizeof(*res->cov) * cb->len_fft * cb->cov_stride);
+
+      if (!res->cov) {
+        fprintf(stderr, "cbt_main: allocating covariance buffer failed\n");
+
+        ok= false;
+        break;
+      }
+    }
+
+    if (!cb_step(cb, res->mag, res->phases, cb->covariance ? res->cov : NULL)) {
+      fprintf(stderr, "cbt_main: combiner step failed\n");
+
+      ok= false;
+      break;
+    }
+
+    res->seq= ++seq;
+
+    /* Swap the finished result into the middle slot
+     * and continue with the one that was there */
+    uint32_t prev= atomic_exchange(&cbt->middle, cbt->back | CBT_FRESH);
+    cbt->back= prev & ~CBT_FRESH;
+
+    st_add(&cbt->stats.results, 1);
+
+    if (prev & CBT_FRESH) {
+      st_add(&cbt->stats.dropped, 1);
+    }
+
+    fe_notify(&cbt->published);
+
+    if (cbt->detector) {
+      cf_update(cbt->detector, res->mag);
+    }
+
+    /* A failing tracker must not take down the combiner */
+    if (cbt->drift && !dt_update(cbt->drift)) {
+      fprintf(stderr, "cbt_main: drift tracking failed, tracking stopped\n");
+
+      cbt->drift= NULL;
+    }
+  }
+
+  /* Wake up everyone waiting for results or
+   * configuration changes that will never come */
+  atomic_store(&cbt->running, false);
+  fe_notify(&cbt->published);
+
+  pthread_mutex_lock(&cbt->config_lock);
+  pthread_cond_broadcast(&cbt->config_done);
+  pthread_mutex_unlock(&cbt->config_lock);
+
+  return((void *)ok);
+}
+
+bool cbt_setup(struct combiner_thread *cbt, struct combiner *cb)
+{
+  if (!cbt || !cb) {
+    fprintf(stderr, "cbt_setup: No cbt or combiner structure\n");
+
+    return(false);
+  }
+
+  cbt->cb= cb;
+  atomic_init(&cbt->running, false);
+
+  for (size_t ri=0; ri<3; ri++) {
+    struct cbt_result *res= &cbt->results[ri];
+
+    res->seq= 0;
+    res->cov= NULL;
+    res->mag= fftwf_alloc_real(cb->len_fft);
+    res->phases= calloc(cb->num_edges, sizeof(*res->phases));
+
+    if (!res->mag || !res->phases) {
+      fprintf(stderr, "cbt_setup: allocating result buffers failed\n");
+
+      return(false);
+    }
+
+    for (size_t ei=0; ei<cb->num_edges; ei++) {
+      res->phases[ei]= fftwf_alloc_real(cb->len_fft);
+
+      if (!res->phases[ei]) {
+        fprintf(stderr, "cbt_setup: allocating result buffers failed\n");
+
+        return(false);
+      }
+    }
+  }
+
+  cbt->back= 0;
+  cbt->front= 1;
+  atomic_init(&cbt->middle, 2);
+  fe_init(&cbt->published);
+
+  atomic_init(&cbt->want_covariance, false);
+  cbt->drift= NULL;
+  cbt->detector= NULL;
+  atomic_init(&cbt->stats.results, 0);
+  atomic_init(&cbt->stats.dropped, 0);
+
+  pthread_mutex_init(&cbt->config_lock, NULL);
+  pthread_cond_init(&cbt->config_done, NULL);
+  cbt->config_pending= false;
+  cbt->config_ok= false;
+
+  cbt->cal_pending= false;
+  cbt->cal_phases= calloc(cb->num_ffts, sizeof(*cbt->cal_phases));
+  cbt->cal_delays= calloc(cb->num_ffts, sizeof(*cbt->cal_delays));
+
+  if (!cbt->cal_phases || !cbt->cal_delays) {
+    fprintf(stderr, "cbt_setup: allocating calibration buffers failed\n");
+
+    return(false);
+  }
+
+  return(true);
+}
+
+/**
+ * Run the signal detector cf on every result, see cfar.h.
+ * Must be called before cbt_start.
+ */
+bool cbt_set_detector(struct combiner_thread *cbt, struct cf_detector *cf)
+{
+  if (atomic_load(&cbt->running)) {
+    fprintf(stderr, "cbt_set_detector: combiner thread is already running\n");
+
+    return(false);
+  }
+
+  cbt->detector= cf;
+
+  return(true);
+}
+
+/**
+ * Keep the inputs aligned using dt, see drift.h.
+ * Must be called before cbt_start.
+ */
+bool cbt_set_drift_tracker(struct combiner_thread *cbt, struct drift_tracker *dt)
+{
+  if (atomic_load(&cbt->running)) {
+    fprintf(stderr, "cbt_set_drift_tracker: combiner thread is already running\n");
+
+    return(false);
+  }
+
+  cbt->drift= dt;
+
+  return(true);
+}
+
+bool cbt_start(struct combiner_thread *cbt)
+{
+  if (!cbt) {
+    fprintf(stderr, "cbt_start: No cbt structure\n");
+
+    return(false);
+  }
+
+  if (atomic_load(&cbt->running)) {
+    return(true);
+  }
+
+  atomic_store(&cbt->running, true);
+
+  if (pthread_create(&cbt->thread, NULL, &cbt_main, cbt) != 0) {
+    fprintf(stderr, "cbt_start: pthread_create failed\n");
+
+    atomic_store(&cbt->running, false);
+
+    return(false);
+  }
+
+  return(true);
+}
+
+/**
+ * Stop the combiner thread.
+ * The step that is currently running is finished
+ * first, so the fft threads must still be running
+ * or already be stopped.
+ */
+bool cbt_stop(struct combiner_thread *cbt)
+{
+  if (!cbt) {
+    fprintf(stderr, "cbt_stop: No cbt structure\n");
+
+    return(false);
+  }
+
+  if (!atomic_exchange(&cbt->running, false)) {
+    return(true);
+  }
+
+  void *status= NULL;
+
+  if (pthread_join(cbt->thread, &status) != 0) {
+    fprintf(stderr, "cbt_stop: Could not join thread\n");
+
+    return(false);
+  }
+
+  return(status != NULL);
+}
+
+/**
+ * Add the statistics of the combiner thread
+ * and the combiner to report
+ */
+void cbt_get_stats(struct combiner_thread *cbt, struct st_report *report)
+{
+  report->results+= st_load(&cbt->stats.results);
+  report->results_dropped+= st_load(&cbt->stats.dropped);
+
+  cb_get_stats(cbt->cb, report);
+}
+
+/**
+ * Get the most recent result without blocking.
+ * The result stays valid until the next call
+ * to cbt_latest or cbt_next.
+ * Returns NULL if nothing was published yet.
+ */
+const struct cbt_result *cbt_latest(struct combiner_thread *cbt)
+{
+  if (atomic_load(&cbt->middle) & CBT_FRESH) {
+    uint32_t prev= atomic_exchange(&cbt->middle, cbt->front);
+    cbt->front= prev & ~CBT_FRESH;
+  }
+
+  struct cbt_result *res= &cbt->results[cbt->front];
+
+  return(res->seq ? res : NULL);
+}
+
+/**
+ * Wait for a result newer than seq and return
+ * the most recent one.
+ * Returns NULL if the thread stopped.
+ */
+const struct cbt_result *cbt_next(struct combiner_thread *cbt, uint64_t seq)
+{
+  for (;;) {
+    uint32_t ev_seq= fe_prepare(&cbt->published);
+
+    const struct cbt_result *res= cbt_latest(cbt);
+
+    if (res && res->seq > seq) {
+      fe_cancel(&cbt->published);
+
+      return(res);
+    }
+
+    if (!atomic_load(&cbt->running)) {
+      fe_cancel(&cbt->published);
+
+      return(NULL);
+    }
+
+    fe_wait(&cbt->published, ev_seq);
+  }
+}
+
+/**
+ * Change the integration mode, see cb_set_integration.
+ * Blocks until the combiner thread applied the change.
+ */
+bool cbt_set_integration(struct combiner_thread *cbt, enum cb_integration mode,
+                         size_t window, size_t hop)
+{
+  pthread_mutex_lock(&cbt->config_lock);
+
+  while (cbt->config_pending && atomic_load(&cbt->running)) {
+    pthread_cond_wait(&cbt->config_done, &cbt->config_lock);
+  }
+
+  cbt->mode= mode;
+  cbt->window= window;
+  cbt->hop= hop;
+  cbt->config_pending= true;
+
+  while (cbt->config_pending && atomic_load(&cbt->running)) {
+    pthread_cond_wait(&cbt->config_done, &cbt->config_lock);
+  }
+
+  bool ok= !cbt->config_pending && cbt->config_ok;
+
+  cbt->config_pending= false;
+
+  pthread_mutex_unlock(&cbt->config_lock);
+
+  return(ok);
+}
+
+/**
+ * Request covariance output for all following results
+ */
+void cbt_enable_covariance(struct combiner_thread *cbt)
+{
+  atomic_store(&cbt->want_covariance, true);
+}
+
+/**
+ * Change the calibration, see cb_set_calibration.
+ * Does not wait for the change to be applied, it
+ * takes effect with the next result.
+ */
+bool cbt_set_calibration(struct combiner_thread *cbt, const float *phases,
+                         const float *delays)
+{
+  size_t num= cbt->cb->num_ffts;
+
+  pthread_mutex_lock(&cbt->config_lock);
+
+  cbt->cal_has_phases= phases != NULL;
+  cbt->cal_has_delays= delays != NULL;
+
+  if (phases) memcpy(cbt->cal_phases, phases, sizeof(*phases) * num);
+  if (delays) memcpy(cbt->cal_delays, delays, sizeof(*delays) * num);
+
+  cbt->cal_pending= true;
+
+  pthread_mutex_unlock(&cbt->config_lock);
+
+  return(true);
+}
+
+bool cbt_destroy(struct combiner_thread *cbt)
+{
+  if (!cbt) {
+    fprintf(stderr, "cbt_destroy: No cbt structure\n");
+
+    return(false);
+  }
+
+  if (!cbt_stop(cbt)) {
+    fprintf(stderr, "cbt_destroy: stopping the thread failed\n");
+
+    return(false);
+  }
+
+  for (size_t ri=0; ri<3; ri++) {
+    struct cbt_result *res= &cbt->results[ri];
+
+    for (size_t ei=0; ei<cbt->cb->num_edges; ei++) {
+      fftwf_free(res->phases[ei]);
+    }
+
+    free(res->phases);
+    fftwf_free(res->mag);
+    free(res->cov);
+  }
+
+  free(cbt->cal_phases);
+  free(cbt->cal_delays);
+
+  pthread_mutex_destroy(&cbt->config_lock);
+  pthread_cond_destroy(&cbt->config_done);
+
+  return(true);
+}
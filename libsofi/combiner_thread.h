@@ -0,0 +1,120 @@
+/*
+ * Copyright 2016 Leonard Göhrs <leonard@goehrs.eu>
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+
+#include <pthread.h>
+
+#include "combiner.h"
+#include "futex_event.h"
+
+struct drift_tracker;
+struct cf_detector;
+
+/* One set of combiner outputs */
+struct cbt_result {
+  /* Counts up from 1, 0 means no result yet */
+  uint64_t seq;
+
+  float *mag;
+  float **phases;
+
+  /* Only allocated once covariance output was requested */
+  fftwf_complex *cov;
+};
+
+/* The combiner thread calls cb_step in a loop and
+ * publishes the results into a triple buffer.
+ * The producer always has a result slot to write to,
+ * so a slow reader only misses results but never
+ * stalls the fft threads.
+ * There may only be one reader at a time. */
+struct combiner_thread {
+  struct combiner *cb;
+
+  _Atomic bool running;
+  pthread_t thread;
+
+  struct cbt_result results[3];
+
+  /* Owned by the producer and the reader respectively */
+  uint32_t back;
+  uint32_t front;
+
+  /* Index of the slot in between, CBT_FRESH is set
+   * if it holds a result the reader has not seen */
+  _Atomic uint32_t middle;
+  struct futex_event published;
+
+  _Atomic bool want_covariance;
+
+  /* Optional, updated after every cb_step */
+  struct drift_tracker *drift;
+  struct cf_detector *detector;
+
+  /* Integration changes are applied by the thread
+   * in between two cb_step calls */
+  pthread_mutex_t config_lock;
+  pthread_cond_t config_done;
+  bool config_pending;
+  bool config_ok;
+  enum cb_integration mode;
+  size_t window;
+  size_t hop;
+
+  /* Calibration changes do not wait for the thread,
+   * the last one before a cb_step is applied */
+  bool cal_pending;
+  bool cal_has_phases;
+  bool cal_has_delays;
+  float *cal_phases;
+  float *cal_delays;
+
+  /* Written by the thread. Results are dropped
+   * if they are replaced before the reader saw them */
+  struct {
+    _Atomic uint64_t results;
+    _Atomic uint64_t dropped;
+  } stats;
+};
+
+bool cbt_setup(struct combiner_thread *cbt, struct combiner *cb);
+bool cbt_set_drift_tracker(struct combiner_thread *cbt, struct drift_tracker *dt);
+bool cbt_set_detector(struct combiner_thread *cbt, struct cf_detector *cf);
+
+bool cbt_start(struct combiner_thread *cbt);
+bool cbt_stop(struct combiner_thread *cbt);
+
+const struct cbt_result *cbt_latest(struct combiner_thread *cbt);
+const struct cbt_result *cbt_next(struct combiner_thread *cbt, uint64_t seq);
+
+bool cbt_set_integration(struct combiner_thread *cbt, enum cb_integration mode,
+                         size_t window, size_t hop);
+void cbt_enable_covariance(struct combiner_thread *cbt);
+bool cbt_set_calibration(struct combiner_thread *cbt, const float *phases,
+                         const float *delays);
+void cbt_get_stats(struct combiner_thread *cbt, struct st_report *report);
+
+bool cbt_destroy(struct combiner_thread *cbt);
@@ -0,0 +1,331 @@
+/*
+ * Copyright 2016 Leonard Göhrs <leonard@goehrs.eu>
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include <string.h>
+#include <time.h>
+
+#include <fftw3.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CV_X86
+#endif
+
+#include "convert.h"
+
+#define CV_PROFILE_ITERATIONS (256)
+
+static void cv_32f_from_u8_generic(float *dst, const uint8_t *src,
+                                   const float *scale, const float *offset,
+                                   size_t num)
+{
+  for (size_t i=0; i<num; i++) {
+    dst[i]= (float)src[i] * scale[i] + offset[i];
+  }
+}
+
+/* Assumes a little endian host, like the rest of the code */
+static void cv_32f_from_u16_generic(float *dst, const uint8_t *src,
+                                    const float *scale, const float *offset,
+                                    size_t num)
+{
+  const uint16_t *src16= (const uint16_t *)src;
+
+  for (size_t i=0; i<num; i++) {
+    dst[i]= (float)src16[i] * scale[i] + offset[i];
+  }
+}
+
+static bool cv_supported_generic(void)
+{
+  return(true);
+}
+
+static double cv_time_kernel(struct converter *cv, const struct cv_kernel *k,
+                             float *dst, const uint8_t *src)
+{
+  struct timespec start, end;
+
+  /* Warm up caches before timing */
+  k->fn(dst, src, cv->scale, cv->offset, 2*cv->len_fft);
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  for (size_t it=0; it<CV_PROFILE_ITERATIONS; it++) {
+    k->fn(dst, src, cv->scale, cv->offset, 2*cv->len_fft);
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  return((end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9);
+}
+
+/* Like volk_profile, but done on the fly:
+ * run every supported kernel on the actual tables
+ * and keep the fastest one. Depending on the compiler
+ * flags the auto-vectorized generic kernel may
+ * very well win. */
+static const struct cv_kernel *cv_profile_kernels(struct converter *cv)
+{
+  const struct cv_kernel *best= NULL;
+  double best_time= 0;
+
+  float *dst= fftwf_alloc_real(2*cv->len_fft);
+  uint8_t *src= calloc(cv->sample_size, cv->len_fft);
+
+  if (!dst || !src) {
+    fftwf_free(dst);
+    free(src);
+
+    return(NULL);
+  }
+
+  for (const struct cv_kernel *k= cv_kernels; k->name; k++) {
+    if (k->format != cv->format || !k->supported()) continue;
+
+    double elapsed= cv_time_kernel(cv, k, dst, src);
+
+    if (!best || elapsed < best_time) {
+      best= k;
+      best_time= elapsed;
+    }
+  }
+
+  fftwf_free(dst);
+  free(src);
+
+  return(best);
+}
+
+#ifdef CV_X86
+__attribute__((target("sse4.1")))
+static void cv_32f_from_u8_sse4_1(float *dst, const uint8_t *src,
+                                  const float *scale, const float *offset,
+                                  size_t num)
+{
+  size_t i=0;
+
+  for (; i + 16 <= num; i+= 16) {
+    __m128i raw= _mm_loadu_si128((const __m128i *)(src + i));
+
+    for (size_t q=0; q<4; q++) {
+      __m128i ints= _mm_cvtepu8_epi32(raw);
+      __m128 vals= _mm_cvtepi32_ps(ints);
+
+      vals= _mm_mul_ps(vals, _mm_loadu_ps(scale + i + 4*q));
+      vals= _mm_add_ps(vals, _mm_loadu_ps(offset + i + 4*q));
+
+      _mm_storeu_ps(dst + i + 4*q, vals);
+
+      raw= _mm_srli_si128(raw, 4);
+    }
+  }
+
+  cv_32f_from_u8_generic(dst + i, src + i, scale + i, offset + i, num - i);
+}
+
+static bool cv_supported_sse4_1(void)
+{
+  return(__builtin_cpu_supports("sse4.1"));
+}
+
+__attribute__((target("avx2,fma")))
+static void cv_32f_from_u8_avx2(float *dst, const uint8_t *src,
+                                const float *scale, const float *offset,
+                                size_t num)
+{
+  size_t i=0;
+
+  for (; i + 32 <= num; i+= 32) {
+    __m128i raw_lo= _mm_loadu_si128((const __m128i *)(src + i));
+    __m128i raw_hi= _mm_loadu_si128((const __m128i *)(src + i + 16));
+
+    __m256 v0= _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(raw_lo));
+    __m256 v1= _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_srli_si128(raw_lo, 8)));
+    __m256 v2= _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(raw_hi));
+    __m256 v3= _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_srli_si128(raw_hi, 8)));
+
+    v0= _mm256_fmadd_ps(v0, _mm256_loadu_ps(scale + i +  0), _mm256_loadu_ps(offset + i +  0));
+    v1= _mm256_fmadd_ps(v1, _mm256_loadu_ps(scale + i +  8), _mm256_loadu_ps(offset + i +  8));
+    v2= _mm256_fmadd_ps(v2, _mm256_loadu_ps(scale + i + 16), _mm256_loadu_ps(offset + i + 16));
+    v3= _mm256_fmadd_ps(v3, _mm256_loadu_ps(scale + i + 24), _mm256_loadu_ps(offset + i + 24));
+
+    _mm256_storeu_ps(dst + i +  0, v0);
+    _mm256_storeu_ps(dst + i +  8, v1);
+    _mm256_storeu_ps(dst + i + 16, v2);
+    _mm256_storeu_ps(dst + i + 24, v3);
+  }
+
+  cv_32f_from_u8_generic(dst + i, src + i, scale + i, offset + i, num - i);
+}
+
+static bool cv_supported_avx2(void)
+{
+  return(__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"));
+}
+
+__attribute__((target("avx512f")))
+static void cv_32f_from_u8_avx512f(float *dst, const uint8_t *src,
+                                   const float *scale, const float *offset,
+                                   size_t num)
+{
+  size_t i=0;
+
+  for (; i + 32 <= num; i+= 32) {
+    __m128i raw_lo= _mm_loadu_si128((const __m128i *)(src + i));
+    __m128i raw_hi= _mm_loadu_si128((const __m128i *)(src + i + 16));
+
+    __m512 v0= _mm512_cvtepi32_ps(_mm512_cvtepu8_epi32(raw_lo));
+    __m512 v1= _mm512_cvtepi32_ps(_mm512_cvtepu8_epi32(raw_hi));
+
+    v0= _mm512_fmadd_ps(v0, _mm512_loadu_ps(scale + i), _mm512_loadu_ps(offset + i));
+    v1= _mm512_fmadd_ps(v1, _mm512_loadu_ps(scale + i + 16), _mm512_loadu_ps(offset + i + 16));
+
+    _mm512_storeu_ps(dst + i, v0);
+    _mm512_storeu_ps(dst + i + 16, v1);
+  }
+
+  cv_32f_from_u8_generic(dst + i, src + i, scale + i, offset + i, num - i);
+}
+
+static bool cv_supported_avx512f(void)
+{
+  return(__builtin_cpu_supports("avx512f"));
+}
+#endif
+
+const struct cv_kernel cv_kernels[]= {
+#ifdef CV_X86
+  {.name= "avx512f", .format= SDR_FORMAT_CU8,
+   .fn= cv_32f_from_u8_avx512f, .supported= cv_supported_avx512f},
+  {.name= "avx2", .format= SDR_FORMAT_CU8,
+   .fn= cv_32f_from_u8_avx2, .supported= cv_supported_avx2},
+  {.name= "sse4_1", .format= SDR_FORMAT_CU8,
+   .fn= cv_32f_from_u8_sse4_1, .supported= cv_supported_sse4_1},
+#endif
+  {.name= "generic", .format= SDR_FORMAT_CU8,
+   .fn= cv_32f_from_u8_generic, .supported= cv_supported_generic},
+  {.name= "generic_u16", .format= SDR_FORMAT_CU16LE,
+   .fn= cv_32f_from_u16_generic, .supported= cv_supported_generic},
+  {.name= NULL}
+};
+
+/**
+ * Prepare the conversion tables for a given window.
+ *
+ * @param window window coefficients of length len_fft or NULL for no window
+ * @param format the native sample format of the source device
+ */
+bool cv_init(struct converter *cv, float *window, size_t len_fft,
+             enum sdr_format format)
+{
+  if (!cv || !len_fft) {
+    fprintf(stderr, "cv_init: No cv structure or zero length\n");
+    return(false);
+  }
+
+  cv->len_fft= len_fft;
+  cv->format= format;
+  cv->sample_size= sdr_sample_size(format);
+  cv->scale= fftwf_alloc_real(2*len_fft);
+  cv->offset= fftwf_alloc_real(2*len_fft);
+
+  if (!cv->scale || !cv->offset) {
+    fprintf(stderr, "cv_init: allocating conversion tables failed\n");
+    return(false);
+  }
+
+  float half_scale= (format == SDR_FORMAT_CU16LE) ? 32767.5f : 127.5f;
+
+  /* ((x - 127.5)/127.5) * w == x * (w/127.5) - w */
+  for (size_t pos=0; pos<len_fft; pos++) {
+    float w= window ? window[pos] : 1.0f;
+
+    cv->scale[2*pos]= cv->scale[2*pos + 1]= w / half_scale;
+    cv->offset[2*pos]= cv->offset[2*pos + 1]= -w;
+  }
+
+  cv->kernel= cv_profile_kernels(cv);
+
+  if (!cv->kernel) {
+    fprintf(stderr, "cv_init: selecting a conversion kernel failed\n");
+    return(false);
+  }
+
+  return(true);
+}
+
+/**
+ * Force the use of a specific kernel.
+ * Mostly useful for benchmarking.
+ */
+bool cv_set_kernel(struct converter *cv, const char *name)
+{
+  for (const struct cv_kernel *k= cv_kernels; k->name; k++) {
+    if (!strcmp(k->name, name)) {
+      if (k->format != cv->format) {
+        fprintf(stderr, "cv_set_kernel: kernel %s does not handle this sample format\n", name);
+        return(false);
+      }
+
+      if (!k->supported()) {
+        fprintf(stderr, "cv_set_kernel: kernel %s is not supported by this cpu\n", name);
+        return(false);
+      }
+
+      cv->kernel= k;
+      return(true);
+    }
+  }
+
+  fprintf(stderr, "cv_set_kernel: unknown kernel %s\n", name);
+
+  return(false);
+}
+
+/**
+ * Convert num_samples IQ samples that belong at
+ * position pos of the fft input.
+ */
+void cv_convert(struct converter *cv, fftwf_complex *dst,
+                const void *samples, size_t pos, size_t num_samples)
+{
+  cv->kernel->fn((float *)(dst + pos), samples,
+                 cv->scale + 2*pos, cv->offset + 2*pos,
+                 2*num_samples);
+}
+
+bool cv_destroy(struct converter *cv)
+{
+  if (!cv) {
+    fprintf(stderr, "cv_destroy: No cv structure\n");
+    return(false);
+  }
+
+  fftwf_free(cv->scale);
+  fftwf_free(cv->offset);
+
+  return(true);
+}
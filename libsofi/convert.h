@@ -0,0 +1,68 @@
+/*
+ * Copyright 2016 Leonard Göhrs <leonard@goehrs.eu>
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include <fftw3.h>
+
+#include "sdr.h"
+
+/* Conversion of raw interleaved IQ samples
+ * to windowed complex floats.
+ *
+ * The offset, scaling and window coefficients are
+ * folded into two tables so that every value
+ * is converted using a single multiply-add:
+ *   out[i]= in[i] * scale[i] + offset[i] */
+typedef void (*cv_kernel_fn)(float *dst, const uint8_t *src,
+                             const float *scale, const float *offset,
+                             size_t num);
+
+struct cv_kernel {
+  const char *name;
+  enum sdr_format format;
+  cv_kernel_fn fn;
+  bool (*supported)(void);
+};
+
+/* Available kernels, terminated by an entry with name NULL */
+extern const struct cv_kernel cv_kernels[];
+
+struct converter {
+  size_t len_fft;
+
+  enum sdr_format format;
+  size_t sample_size;
+
+  float *scale;
+  float *offset;
+
+  const struct cv_kernel *kernel;
+};
+
+bool cv_init(struct converter *cv, float *window, size_t len_fft,
+             enum sdr_format format);
+bool cv_set_kernel(struct converter *cv, const char *name);
+void cv_convert(struct converter *cv, fftwf_complex *dst,
+                const void *samples, size_t pos, size_t num_samples);
+bool cv_destroy(struct converter *cv);
@@ -0,0 +1,520 @@
+/*
+ * Copyright 2016 Leonard Göhrs <leonard@goehrs.eu>
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include <string.h>
+#include <math.h>
+
+#include "doa.h"
+
+#define DOA_SPEED_OF_LIGHT (299792458.0)
+
+/* The cached noise subspace of a bin is used as long as the
+ * covariance moved by less than this relative Frobenius norm */
+#define DOA_MUSIC_TOLERANCE (0.02)
+
+/* Eigenvalues this many times above the smallest one
+ * are counted as sources if num_sources is 0 */
+#define DOA_MUSIC_SIGNAL_RATIO (10.0)
+
+/* Jacobi sweeps, the matrices are small
+ * and converge after a handful */
+#define DOA_JACOBI_SWEEPS (32)
+
+struct doa_music_bin {
+  bool valid;
+  size_t num_sources;
+
+  /* num_ants x num_ants interleaved complex values */
+  float *cov;
+  float *projector;
+
+  /* 1/|En^H a|^2 for all test angles, allocated
+   * once the bin is part of a span */
+  float *spectrum;
+};
+
+/**
+ * Setup the steering tables for an antenna array.
+ *
+ * @param positions num_ants pairs of x and y coordinates in
+ *        meters, in the order of the inputs of the combiner
+ * @param dir_len number of test angles per pseudo spectrum
+ * @param center_freq frequency of bin 0 in Hz
+ * @param samp_rate sample rate in Hz, the bins are
+ *        samp_rate/len_fft apart
+ */
+bool doa_init(struct doa_engine *doa, const float *positions, size_t num_ants,
+              size_t len_fft, size_t dir_len, double center_freq, double samp_rate)
+{
+  if (!doa || !positions) {
+    fprintf(stderr, "doa_init: No doa structure or antenna positions\n");
+
+    return(false);
+  }
+
+  if (num_ants < 2 || !len_fft || dir_len < 2) {
+    fprintf(stderr, "doa_init: need at least two antennas and test angles\n");
+
+    return(false);
+  }
+
+  doa->num_ants= num_ants;
+  doa->num_edges= num_ants * (num_ants - 1) / 2;
+  doa->len_fft= len_fft;
+  doa->dir_len= dir_len;
+
+  doa->geometry= calloc(doa->num_edges * dir_len, sizeof(*doa->geometry));
+  doa->wavenumbers= calloc(len_fft, sizeof(*doa->wavenumbers));
+  doa->music= calloc(len_fft, sizeof(*doa->music));
+
+  if (!doa->geometry || !doa->wavenumbers || !doa->music) {
+    fprintf(stderr, "doa_init: allocating steering tables failed\n");
+
+    return(false);
+  }
+
+  doa->music_solves= 0;
+  doa->music_reuses= 0;
+
+  for (size_t k=0; k<len_fft; k++) {
+    doa->music[k].valid= false;
+    doa->music[k].cov= calloc(2 * num_ants * num_ants, sizeof(float));
+    doa->music[k].projector= calloc(2 * num_ants * num_ants, sizeof(float));
+
+    if (!doa->music[k].cov || !doa->music[k].projector) {
+      fprintf(stderr, "doa_init: allocating subspace cache failed\n");
+
+      return(false);
+    }
+  }
+
+  /* Same edge order as in cb_init */
+  for(size_t ina=0, ei=0; ina<num_ants; ina++) {
+    for(size_t inb=ina+1; inb<num_ants; inb++, ei++) {
+      double dx= positions[2*inb] - positions[2*ina];
+      double dy= positions[2*inb + 1] - positions[2*ina + 1];
+
+      double distance= sqrt(dx*dx + dy*dy);
+      double angle= atan2(dy, dx);
+
+      for (size_t t=0; t<dir_len; t++) {
+        double test_angle= -M_PI + 2 * M_PI * t / (dir_len - 1);
+
+        doa->geometry[ei * dir_len + t]= distance * sin(angle + test_angle);
+      }
+    }
+  }
+
+  for (size_t k=0; k<len_fft; k++) {
+    int64_t bin= (k < len_fft/2) ? (int64_t)k : (int64_t)k - (int64_t)len_fft;
+    double freq= center_freq + bin * samp_rate / len_fft;
+
+    doa->wavenumbers[k]= 2 * M_PI * freq / DOA_SPEED_OF_LIGHT;
+  }
+
+  return(true);
+}
+
+/**
+ * Calculate the bearing pseudo spectra of num_spans signals.
+ * The phase differences of every edge are scaled by the
+ * wavenumber of their bin and averaged over the span, the
+ * results of all signals are then correlated with the
+ * geometry table in one pass.
+ *
+ * @param phases num_edges phase outputs of the combiner
+ * @param dst num_spans rows of dir_len values
+ */
+bool doa_spectra(struct doa_engine *doa, float *const *phases,
+                 const struct doa_span *spans, size_t num_spans, float *dst)
+{
+  if (!doa->geometry) {
+    fprintf(stderr, "doa_spectra: no antennas set up\n");
+
+    return(false);
+  }
+
+  if (!num_spans) {
+    return(true);
+  }
+
+  size_t num_edges= doa->num_edges;
+  size_t dir_len= doa->dir_len;
+  int64_t half= doa->len_fft / 2;
+
+  float weights[num_spans][num_edges];
+
+  for (size_t si=0; si<num_spans; si++) {
+    int64_t first= spans[si].first;
+    int64_t last= spans[si].last;
+
+    if (first < -half || last > half || first >= last) {
+      fprintf(stderr, "doa_spectra: invalid span %ld to %ld\n", first, last);
+
+      return(false);
+    }
+
+    for (size_t ei=0; ei<num_edges; ei++) {
+      double sum= 0;
+
+      for (int64_t bin=first; bin<last; bin++) {
+        size_t k= (bin < 0) ? (size_t)(bin + (int64_t)doa->len_fft) : (size_t)bin;
+
+        sum+= doa->wavenumbers[k] * phases[ei][k];
+      }
+
+      weights[si][ei]= sum / (last - first);
+    }
+  }
+
+  memset(dst, 0, sizeof(*dst) * num_spans * dir_len);
+
+  for (size_t si=0; si<num_spans; si++) {
+    float *spectrum= &dst[si * dir_len];
+
+    for (size_t ei=0; ei<num_edges; ei++) {
+      const float *geometry= &doa->geometry[ei * dir_len];
+      float weight= weights[si][ei];
+
+      for (size_t t=0; t<dir_len; t++) {
+        spectrum[t]+= weight * geometry[t];
+      }
+    }
+  }
+
+  return(true);
+}
+
+/**
+ * Cyclic Jacobi eigenvalue algorithm for the real symmetric
+ * m x m matrix a. The eigenvalues are left on the diagonal
+ * of a, the eigenvectors in the columns of v.
+ */
+static void doa_jacobi(double *a, double *v, size_t m)
+{
+  for (size_t i=0; i<m; i++) {
+    for (size_t j=0; j<m; j++) {
+      v[i*m + j]= (i == j) ? 1 : 0;
+    }
+  }
+
+  for (int sweep=0; sweep<DOA_JACOBI_SWEEPS; sweep++) {
+    double off= 0, diag= 0;
+
+    for (size_t i=0; i<m; i++) {
+      diag+= a[i*m + i] * a[i*m + i];
+
+      for (size_t j=i+1; j<m; j++) {
+        off+= a[i*m + j] * a[i*m + j];
+      }
+    }
+
+    if (off <= 1e-24 * diag) {
+      break;
+    }
+
+    for (size_t p=0; p<m; p++) {
+      for (size_t q=p+1; q<m; q++) {
+        double apq= a[p*m + q];
+
+        if (fabs(apq) < 1e-300) continue;
+
+        double theta= (a[q*m + q] - a[p*m + p]) / (2 * apq);
+        double t= ((theta >= 0) ? 1 : -1) / (fabs(theta) + sqrt(theta*theta + 1));
+        double c= 1 / sqrt(t*t + 1);
+        double s= t * c;
+
+        for (size_t k=0; k<m; k++) {
+          double akp= a[k*m + p], akq= a[k*m + q];
+
+          a[k*m + p]= c*akp - s*akq;
+          a[k*m + q]= s*akp + c*akq;
+        }
+
+        for (size_t k=0; k<m; k++) {
+          double apk= a[p*m + k], aqk= a[q*m + k];
+
+          a[p*m + k]= c*apk - s*aqk;
+          a[q*m + k]= s*apk + c*aqk;
+        }
+
+        for (size_t k=0; k<m; k++) {
+          double vkp= v[k*m + p], vkq= v[k*m + q];
+
+          v[k*m + p]= c*vkp - s*vkq;
+          v[k*m + q]= s*vkp + c*vkq;
+        }
+      }
+    }
+  }
+}
+
+/**
+ * Calculate the projector onto the noise subspace of the
+ * hermitian n x n matrix cov.
+ * The matrix is decomposed in its real form
+ *   [ Re -Im ]
+ *   [ Im  Re ]
+ * whose eigenvalues are those of cov, each appearing twice,
+ * so the 2*(n - sources) smallest eigenvectors span the
+ * noise subspace.
+ */
+static size_t doa_music_solve(const float *cov, float *projector, size_t n,
+                              size_t num_sources)
+{
+  size_t m= 2 * n;
+
+  double a[m*m], v[m*m];
+
+  for (size_t i=0; i<n; i++) {
+    for (size_t j=0; j<n; j++) {
+      double re= cov[2*(i*n + j)], im= cov[2*(i*n + j) + 1];
+
+      a[i*m + j]= re;
+      a[i*m + j + n]= -im;
+      a[(i + n)*m + j]= im;
+      a[(i + n)*m + j + n]= re;
+    }
+  }
+
+  doa_jacobi(a, v, m);
+
+  /* Sort the eigenvector indices by ascending eigenvalue */
+  size_t order[m];
+
+  for (size_t i=0; i<m; i++) {
+    size_t pos= i;
+
+    while (pos > 0 && a[order[pos - 1]*m + order[pos - 1]] > a[i*m + i]) {
+      order[pos]= order[pos - 1];
+      pos--;
+    }
+
+    order[pos]= i;
+  }
+
+  if (!num_sources) {
+    double noise= a[order[0]*m + order[0]];
+
+    for (size_t i=m; i-- > 0 && a[order[i]*m + order[i]] > DOA_MUSIC_SIGNAL_RATIO * noise;) {
+      num_sources++;
+    }
+
+    num_sources/= 2;
+  }
+
+  if (num_sources > n - 1) num_sources= n - 1;
+
+  size_t noise_dim= 2 * (n - num_sources);
+
+  /* The complex projector is the left half of the real one */
+  for (size_t i=0; i<n; i++) {
+    for (size_t j=0; j<n; j++) {
+      double re= 0, im= 0;
+
+      for (size_t e=0; e<noise_dim; e++) {
+        size_t col= order[e];
+
+        re+= v[i*m + col] * v[j*m + col];
+        im+= v[(i + n)*m + col] * v[j*m + col];
+      }
+
+      projector[2*(i*n + j)]= re;
+      projector[2*(i*n + j) + 1]= im;
+    }
+  }
+
+  return(num_sources);
+}
+
+/**
+ * Evaluate the pseudo spectrum of a bin from its projector.
+ * Only the phase differences of the steering vectors matter,
+ * so it is evaluated from the edge geometry table:
+ *   |En^H a|^2 = tr(P) + 2 sum_edges Re(P_ab exp(-j k g_ab))
+ */
+static void doa_music_spectrum(struct doa_engine *doa, struct doa_music_bin *mb,
+                               float wavenumber)
+{
+  size_t n= doa->num_ants;
+  size_t dir_len= doa->dir_len;
+  const float *proj= mb->projector;
+  float *spectrum= mb->spectrum;
+
+  float trace= 0;
+
+  for (size_t i=0; i<n; i++) {
+    trace+= proj[2*(i*n + i)];
+  }
+
+  for (size_t t=0; t<dir_len; t++) {
+    spectrum[t]= trace;
+  }
+
+  for (size_t ina=0, ei=0; ina<n; ina++) {
+    for (size_t inb=ina+1; inb<n; inb++, ei++) {
+      const float *geometry= &doa->geometry[ei * dir_len];
+      float re= 2 * proj[2*(ina*n + inb)];
+      float im= 2 * proj[2*(ina*n + inb) + 1];
+
+      for (size_t t=0; t<dir_len; t++) {
+        float phase= wavenumber * geometry[t];
+
+        spectrum[t]+= re * cosf(phase) + im * sinf(phase);
+      }
+    }
+  }
+
+  /* Invert the accumulated |En^H a|^2 in place */
+  for (size_t t=0; t<dir_len; t++) {
+    spectrum[t]= 1.0f / fmaxf(spectrum[t], 1e-9f);
+  }
+}
+
+/**
+ * Whether the covariance of a bin is close enough
+ * to the cached one to reuse its noise subspace
+ */
+static bool doa_music_cached(struct doa_music_bin *bin, const float *cov, size_t n,
+                             size_t num_sources)
+{
+  if (!bin->valid || (num_sources && num_sources != bin->num_sources)) {
+    return(false);
+  }
+
+  double diff= 0, norm= 0;
+
+  for (size_t i=0; i<2*n*n; i++) {
+    double d= cov[i] - bin->cov[i];
+
+    diff+= d*d;
+    norm+= (double)bin->cov[i] * bin->cov[i];
+  }
+
+  return(diff <= DOA_MUSIC_TOLERANCE * DOA_MUSIC_TOLERANCE * norm);
+}
+
+/**
+ * Calculate MUSIC bearing pseudo spectra for num_spans signals
+ * from the covariance matrices the combiner outputs.
+ * Every bin of a span is decomposed on its own and the pseudo
+ * spectra 1/|En^H a|^2 of the bins are averaged, En being the
+ * noise subspace. Bins whose covariance barely changed since
+ * the last call reuse their subspace and pseudo spectrum.
+ * Not reentrant, the subspace cache is updated.
+ *
+ * @param cov num_ants x num_ants matrices for every bin,
+ *        cov_stride complex values apart. See cb_enable_covariance
+ * @param num_sources number of emitters per bin or 0 to
+ *        count the dominant eigenvalues
+ * @param dst num_spans rows of dir_len values
+ */
+bool doa_music(struct doa_engine *doa, fftwf_complex *cov, size_t cov_stride,
+               const struct doa_span *spans, size_t num_spans, size_t num_sources,
+               float *dst)
+{
+  if (!doa->geometry) {
+    fprintf(stderr, "doa_music: no antennas set up\n");
+
+    return(false);
+  }
+
+  size_t n= doa->num_ants;
+  size_t dir_len= doa->dir_len;
+  int64_t half= doa->len_fft / 2;
+
+  memset(dst, 0, sizeof(*dst) * num_spans * dir_len);
+
+  for (size_t si=0; si<num_spans; si++) {
+    int64_t first= spans[si].first;
+    int64_t last= spans[si].last;
+
+    if (first < -half || last > half || first >= last) {
+      fprintf(stderr, "doa_music: invalid span %ld to %ld\n", first, last);
+
+      return(false);
+    }
+
+    float *spectrum= &dst[si * dir_len];
+
+    for (int64_t bin=first; bin<last; bin++) {
+      size_t k= (bin < 0) ? (size_t)(bin + (int64_t)doa->len_fft) : (size_t)bin;
+
+      struct doa_music_bin *mb= &doa->music[k];
+      const float *mat= (const float *)(cov + k * cov_stride);
+
+      if (doa_music_cached(mb, mat, n, num_sources)) {
+        doa->music_reuses++;
+      }
+      else {
+        if (!mb->spectrum) {
+          mb->spectrum= calloc(dir_len, sizeof(*mb->spectrum));
+
+          if (!mb->spectrum) {
+            fprintf(stderr, "doa_music: allocating pseudo spectrum failed\n");
+
+            return(false);
+          }
+        }
+
+        memcpy(mb->cov, mat, sizeof(*mb->cov) * 2 * n * n);
+        mb->num_sources= doa_music_solve(mat, mb->projector, n, num_sources);
+        mb->valid= true;
+
+        doa_music_spectrum(doa, mb, doa->wavenumbers[k]);
+
+        doa->music_solves++;
+      }
+
+      float norm= 1.0f / (last - first);
+
+      for (size_t t=0; t<dir_len; t++) {
+        spectrum[t]+= norm * mb->spectrum[t];
+      }
+    }
+  }
+
+  return(true);
+}
+
+void doa_destroy(struct doa_engine *doa)
+{
+  free(doa->geometry);
+  free(doa->wavenumbers);
+
+  if (doa->music) {
+    for (size_t k=0; k<doa->len_fft; k++) {
+      free(doa->music[k].cov);
+      free(doa->music[k].projector);
+      free(doa->music[k].spectrum);
+    }
+  }
+
+  free(doa->music);
+
+  doa->geometry= NULL;
+  doa->wavenumbers= NULL;
+  doa->music= NULL;
+}
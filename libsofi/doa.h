@@ -0,0 +1,74 @@
+/*
+ * Copyright 2016 Leonard Göhrs <leonard@goehrs.eu>
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include <fftw3.h>
+
+/* The bins first to last-1 of a signal, as signed bins
+ * relative to the center frequency from -len_fft/2 to
+ * len_fft/2. Mirrored in __init__.py */
+struct doa_span {
+  int32_t first;
+  int32_t last;
+};
+
+/* Direction finding on the phase differences that the
+ * combiner outputs for every edge.
+ * A plane wave from test angle t causes a phase difference of
+ *   wavenumbers[k] * geometry[edge * dir_len + t]
+ * on an edge at bin k. The geometry part does not depend on
+ * the bin, so the per bin steering tables are kept as the
+ * product of the two tables instead of len_fft full tables.
+ * The test angles go from -pi to pi in dir_len steps. */
+struct doa_engine {
+  size_t num_ants;
+  size_t num_edges;
+  size_t len_fft;
+  size_t dir_len;
+
+  /* num_edges rows of dir_len values in meters */
+  float *geometry;
+
+  /* 2*pi/wavelength of every bin, in the order
+   * of the combiner outputs */
+  float *wavenumbers;
+
+  /* MUSIC keeps the noise subspace projector of every bin
+   * and the covariance it was calculated from. The eigen
+   * decomposition is only repeated if the covariance of
+   * the bin changed noticeably, see doa_music */
+  struct doa_music_bin *music;
+  uint64_t music_solves;
+  uint64_t music_reuses;
+};
+
+bool doa_init(struct doa_engine *doa, const float *positions, size_t num_ants,
+              size_t len_fft, size_t dir_len, double center_freq, double samp_rate);
+bool doa_spectra(struct doa_engine *doa, float *const *phases,
+                 const struct doa_span *spans, size_t num_spans, float *dst);
+bool doa_music(struct doa_engine *doa, fftwf_complex *cov, size_t cov_stride,
+               const struct doa_span *spans, size_t num_spans, size_t num_sources,
+               float *dst);
+void doa_destroy(struct doa_engine *doa);
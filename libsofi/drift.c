@@ -0,0 +1,310 @@
+/*
+ * Copyright 2016 Leonard Göhrs <leonard@goehrs.eu>
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+
+#include <string.h>
+#include <math.h>
+
+#include "drift.h"
+
+#include "combiner.h"
+#include "fft_thread.h"
+#include "synchronize.h"
+
+/* Measure at most every this many frames. 1024 frames
+ * of 1024 samples are half a second at 2 MS/s */
+#define DT_INTERVAL_FRAMES (1024)
+
+/* Weight of a new measurement in the smoothed estimate */
+#define DT_GAIN (0.25)
+
+/* Measurements this far off the estimate are
+ * slips, the estimate jumps to them right away */
+#define DT_JUMP (0.5)
+
+/* The correlation peak has to be this many times
+ * stronger than the mean correlation to be used */
+#define DT_MIN_PEAK_RATIO (16)
+
+/* Delays beyond this many samples are removed by skipping
+ * samples. Above 0.5 so that a delay close to half a sample
+ * does not cause skips back and forth */
+#define DT_SLIP_THRESHOLD (0.75)
+
+/* The phase ramps are only recalculated if
+ * an estimate moved by more than this */
+#define DT_MIN_ADJUST (0.005)
+
+/**
+ * Setup a drift tracker for a combiner that was set up
+ * using cb_init.
+ *
+ * @param delays the delays that are already compensated
+ *        using cb_set_delays or NULL for none
+ */
+bool dt_init(struct drift_tracker *dt, struct combiner *cb, const float *delays)
+{
+  if (!dt || !cb) {
+    fprintf(stderr, "dt_init: No dt or combiner structure\n");
+
+    return(false);
+  }
+
+  dt->cb= cb;
+  dt->num_ffts= cb->num_ffts;
+  dt->len_fft= cb->len_fft;
+
+  dt->interval= DT_INTERVAL_FRAMES;
+  dt->next_frame= 0;
+  dt->settle_frame= 0;
+
+  atomic_init(&dt->stats.measurements, 0);
+  atomic_init(&dt->stats.slips, 0);
+
+  dt->estimates= calloc(dt->num_ffts, sizeof(*dt->estimates));
+  dt->delays= calloc(dt->num_ffts, sizeof(*dt->delays));
+  dt->cross= fftwf_alloc_complex(dt->len_fft);
+  dt->correlation= fftwf_alloc_complex(dt->len_fft);
+
+  if (!dt->estimates || !dt->delays || !dt->cross || !dt->correlation) {
+    fprintf(stderr, "dt_init: allocating buffers failed\n");
+
+    return(false);
+  }
+
+  for (size_t fi=0; fi<dt->num_ffts; fi++) {
+    dt->estimates[fi]= delays ? delays[fi] : 0;
+    atomic_init(&dt->delays[fi], dt->estimates[fi]);
+  }
+
+  dt->plan= sync_plan(dt->len_fft, dt->cross, dt->correlation, FFTW_ESTIMATE);
+
+  if (!dt->plan) {
+    fprintf(stderr, "dt_init: fftwf_plan failed\n");
+
+    return(false);
+  }
+
+  return(true);
+}
+
+/**
+ * Measure the delay of an input relative to the first one
+ * in the last combiner output.
+ * Returns false if the correlation has no clear peak.
+ */
+static bool dt_measure(struct drift_tracker *dt, size_t input, double *delay)
+{
+  size_t len= dt->len_fft;
+
+  /* The edges of the first input come first */
+  memcpy(dt->cross, cb_cross_spectrum(dt->cb, input - 1), sizeof(*dt->cross) * len);
+
+  fftwf_execute(dt->plan);
+
+  const float *corr= (const float *)dt->correlation;
+
+  size_t peak= 0;
+  float peak_mag_sq= 0;
+  double mean_mag_sq= 0;
+
+  for (size_t i=0; i<len; i++) {
+    float ms= corr[2*i]*corr[2*i] + corr[2*i+1]*corr[2*i+1];
+
+    mean_mag_sq+= ms;
+
+    if (ms > peak_mag_sq) {
+      peak_mag_sq= ms;
+      peak= i;
+    }
+  }
+
+  mean_mag_sq/= len;
+
+  if (peak_mag_sq < DT_MIN_PEAK_RATIO * mean_mag_sq) {
+    return(false);
+  }
+
+  int64_t lag= (peak < len/2) ? (int64_t)peak : (int64_t)peak - (int64_t)len;
+
+  /* Same sign convention as in sync_sdrs, a positive
+   * delay means the input lags behind the first one */
+  *delay= -(lag + sync_refine_peak(dt->cross, len, lag));
+
+  return(true);
+}
+
+/**
+ * Remove the integer delays in slips by letting the
+ * fft threads skip samples at the same frame
+ */
+static bool dt_skip(struct drift_tracker *dt, const int64_t *slips)
+{
+  struct combiner *cb= dt->cb;
+  int64_t min_slip= 0;
+  size_t max_buffers= 0;
+
+  for (size_t fi=0; fi<dt->num_ffts; fi++) {
+    if (slips[fi] < min_slip) min_slip= slips[fi];
+    if (cb->inputs[fi].buffers_count > max_buffers) max_buffers= cb->inputs[fi].buffers_count;
+  }
+
+  /* Frames up to cb->frame_no - 1 are released, so the
+   * fft threads can not have loaded this one yet */
+  uint64_t frame= cb->frame_no + max_buffers;
+
+  /* Either all inputs skip or none does, a partial
+   * skip would leave the receivers misaligned.
+   * Nothing was changed, the next measurement tries again */
+  for (size_t fi=0; fi<dt->num_ffts; fi++) {
+    if (slips[fi] != min_slip && !ft_can_skip(&cb->inputs[fi], frame)) {
+      fprintf(stderr, "dt_update: input %ld can not skip at frame %ld\n", fi, frame);
+
+      return(true);
+    }
+  }
+
+  fprintf(stderr, "dt_update: realigning at frame %ld, slips:", frame);
+
+  for (size_t fi=0; fi<dt->num_ffts; fi++) {
+    struct fft_thread *ft= &cb->inputs[fi];
+    size_t len= (slips[fi] - min_slip) * ft->conv.sample_size;
+
+    fprintf(stderr, " %+ld", slips[fi]);
+
+    if (len) {
+      ft_schedule_skip(ft, frame, len);
+    }
+
+    dt->estimates[fi]-= slips[fi];
+  }
+
+  fprintf(stderr, "\n");
+
+  /* Measure again as soon as the outputs settled */
+  dt->settle_frame= frame + cb->window;
+  dt->next_frame= dt->settle_frame;
+  st_add(&dt->stats.slips, 1);
+
+  return(true);
+}
+
+/**
+ * Measure the delays in the last combiner output and
+ * correct them. Must be called after cb_step returned.
+ * Cheap if no measurement is due.
+ */
+bool dt_update(struct drift_tracker *dt)
+{
+  struct combiner *cb= dt->cb;
+  size_t num= dt->num_ffts;
+
+  if (cb->frame_no < dt->next_frame || cb->frame_no < dt->settle_frame) {
+    return(true);
+  }
+
+  dt->next_frame= cb->frame_no + dt->interval;
+
+  int64_t slips[num];
+  bool slipped= false;
+  bool adjust= false;
+
+  slips[0]= 0;
+
+  for (size_t fi=1; fi<num; fi++) {
+    double measured;
+
+    slips[fi]= 0;
+
+    if (!dt_measure(dt, fi, &measured)) {
+      continue;
+    }
+
+    double est= dt->estimates[fi];
+
+    est= (fabs(measured - est) > DT_JUMP) ? measured : est + DT_GAIN * (measured - est);
+
+    if (fabs(est) > DT_SLIP_THRESHOLD) {
+      slips[fi]= lround(est);
+      slipped= true;
+    }
+
+    if (fabs(est - atomic_load_explicit(&dt->delays[fi], memory_order_relaxed)) > DT_MIN_ADJUST) {
+      adjust= true;
+    }
+
+    dt->estimates[fi]= est;
+  }
+
+  st_add(&dt->stats.measurements, 1);
+
+  /* The phase ramps are updated once the
+   * skip shows up in the outputs */
+  if (slipped) {
+    return(dt_skip(dt, slips));
+  }
+
+  if (adjust) {
+    float delays[num];
+
+    for (size_t fi=0; fi<num; fi++) {
+      delays[fi]= dt->estimates[fi];
+      atomic_store_explicit(&dt->delays[fi], delays[fi], memory_order_relaxed);
+    }
+
+    return(cb_set_delays(cb, delays));
+  }
+
+  return(true);
+}
+
+/**
+ * Copy the delays that are currently compensated,
+ * one per input. May be called from any thread.
+ */
+void dt_get_delays(struct drift_tracker *dt, float *dst)
+{
+  for (size_t fi=0; fi<dt->num_ffts; fi++) {
+    dst[fi]= atomic_load_explicit(&dt->delays[fi], memory_order_relaxed);
+  }
+}
+
+/**
+ * Add the statistics of this drift tracker to report
+ */
+void dt_get_stats(struct drift_tracker *dt, struct st_report *report)
+{
+  report->drift_measurements+= st_load(&dt->stats.measurements);
+  report->drift_slips+= st_load(&dt->stats.slips);
+}
+
+void dt_destroy(struct drift_tracker *dt)
+{
+  fftwf_destroy_plan(dt->plan);
+  fftwf_free(dt->cross);
+  fftwf_free(dt->correlation);
+  free(dt->estimates);
+  free(dt->delays);
+}
@@ -0,0 +1,79 @@
+/*
+ * Copyright 2016 Leonard Göhrs <leonard@goehrs.eu>
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+
+#include <fftw3.h>
+
+#include "combiner.h"
+#include "stats.h"
+
+/* The drift tracker keeps running receivers aligned.
+ * After every output of the combiner the integrated cross
+ * spectra between the first and every other input are
+ * turned into correlations, whose peaks are the current
+ * delays. Fractional delays are compensated by updating
+ * the combiner phase ramps, once a delay exceeds a sample
+ * the fft threads skip samples to remove the integer part.
+ * It runs in the combiner thread in between two cb_step
+ * calls, see cbt_set_drift_tracker. */
+struct drift_tracker {
+  struct combiner *cb;
+
+  size_t num_ffts;
+  size_t len_fft;
+
+  /* Smoothed measured delay of every input relative
+   * to the first one, in samples */
+  double *estimates;
+
+  /* Delays compensated in the combiner. Written by the
+   * combiner thread, read by dt_get_delays */
+  _Atomic float *delays;
+
+  /* Measurements are taken at most every interval frames */
+  uint64_t interval;
+  uint64_t next_frame;
+
+  /* Outputs that still contain frames from before
+   * the last skip are not measured */
+  uint64_t settle_frame;
+
+  fftwf_complex *cross;
+  fftwf_complex *correlation;
+  fftwf_plan plan;
+
+  /* Written by the combiner thread */
+  struct {
+    _Atomic uint64_t measurements;
+    _Atomic uint64_t slips;
+  } stats;
+};
+
+bool dt_init(struct drift_tracker *dt, struct combiner *cb, const float *delays);
+bool dt_update(struct drift_tracker *dt);
+void dt_get_delays(struct drift_tracker *dt, float *dst);
+void dt_get_stats(struct drift_tracker *dt, struct st_report *report);
+void dt_destroy(struct drift_tracker *dt);
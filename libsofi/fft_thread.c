@@ -22,9 +22,11 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <stdlib.h>
+#include <stdatomic.h>
 
 #include <errno.h>
 #include <string.h>
+#include <time.h>
 
 #include <pthread.h>
 
@@ -32,46 +34,42 @@
 
 #include "fft_thread.h"
 
-#include "sdr.h"
+#include "capture_thread.h"
+#include "convert.h"
+#include "futex_event.h"
+#include "wisdom.h"
+
+/* Frames of a multiple of this many bins keep the SIMD
+ * alignment of the batch buffer, which fftw may use */
+#define FT_ALIGN_BINS (8)
 
 
 static bool ft_load_samples(struct fft_thread *ft, struct fft_buffer *buf)
 {
-  if (!ft || !ft->dev || !buf) {
-    fprintf(stderr, "ft_get_input: No ft, sdr or buf structure\n");
+  if (!ft || !ft->src || !buf) {
+    fprintf(stderr, "ft_get_input: No ft, capture thread or buf structure\n");
 
     return (false);
   }
 
+  size_t sample_size= ft->conv.sample_size;
+
   for(size_t pos=0; pos < ft->len_fft;) {
-    struct {
-      uint8_t r;
-      uint8_t i;
-    } *samples;
+    void *samples;
 
-    size_t bytes_rem= sizeof(*samples) * (ft->len_fft - pos);
-    ssize_t bytes_rd= sdr_peek(ft->dev, bytes_rem, (void *)&samples);
+    size_t bytes_rem= sample_size * (ft->len_fft - pos);
+    ssize_t bytes_rd= ct_peek(ft->src, bytes_rem, &samples);
 
     if (bytes_rd < 0) {
       return(false);
     }
 
-    size_t samples_rd= bytes_rd/sizeof(*samples);
+    size_t samples_rd= bytes_rd/sample_size;
 
-    if (ft->window) {
-      for (size_t i=0; i<samples_rd; i++, pos++) {
-        buf->in[pos][0]= ((float)samples[i].r - 127.5)/127.5 * ft->window[pos];
-        buf->in[pos][1]= ((float)samples[i].i - 127.5)/127.5 * ft->window[pos];
-      }
-    }
-    else {
-      for (size_t i=0; i<samples_rd; i++, pos++) {
-        buf->in[pos][0]= ((float)samples[i].r - 127.5)/127.5;
-        buf->in[pos][1]= ((float)samples[i].i - 127.5)/127.5;
-      }
-    }
+    cv_convert(&ft->conv, buf->in, samples, pos, samples_rd);
+    pos+= samples_rd;
 
-    if (!sdr_done(ft->dev)) {
+    if (!ct_done(ft->src)) {
       return(false);
     }
   }
@@ -79,62 +77,57 @@ static bool ft_load_samples(struct fft_thread *ft, struct fft_buffer *buf)
   return(true);
 }
 
-static bool ft_calculate_fft(struct fft_buffer *buf)
+/**
+ * Transform the batch of frames starting at buf
+ */
+static bool ft_calculate_fft(struct fft_thread *ft, struct fft_buffer *buf)
 {
-  if (!buf || !buf->plan) {
+  if (!buf || !ft->plan) {
     fprintf(stderr, "ft_calculate_fft: No buffer or plan\n");
 
     return (false);
   }
 
-  fftwf_execute(buf->plan);
+  fftwf_execute_dft(ft->plan, buf->in, buf->out);
 
   return(true);
 }
 
-static struct fft_buffer *ft_get_consumed_buffer(struct fft_thread *ft)
+/**
+ * Wait until the slot for frame may be reused
+ */
+static struct fft_buffer *ft_get_consumed_buffer(struct fft_thread *ft, uint64_t frame)
 {
-  pthread_mutex_lock(&ft->buffers_meta_lock);
+  struct fft_buffer *buf= &ft->buffers[frame % ft->buffers_count];
 
   for(;;) {
-    if(!ft->running) {
-      pthread_mutex_unlock(&ft->buffers_meta_lock);
-
+    if(!atomic_load(&ft->running)) {
       return(NULL);
     }
 
-    for (size_t bidx=0; bidx<ft->buffers_count; bidx++) {
-      if (ft->buffers[bidx].consumers==0) {
-        pthread_mutex_unlock(&ft->buffers_meta_lock);
-
-        return(&ft->buffers[bidx]);
-      }
+    if (atomic_load_explicit(&buf->consumers, memory_order_acquire) == 0) {
+      return(buf);
     }
 
-    pthread_cond_wait(&ft->buffers_meta_notify, &ft->buffers_meta_lock);
+    uint32_t seq= fe_prepare(&ft->released_notify);
+
+    if (!atomic_load(&ft->running) || atomic_load(&buf->consumers) == 0) {
+      fe_cancel(&ft->released_notify);
+    }
+    else {
+      fe_wait(&ft->released_notify, seq);
+    }
   }
 }
 
-static struct fft_buffer *ft_get_frame_locked(struct fft_thread *ft, size_t frame)
+static void ft_publish_buffer(struct fft_thread *ft, struct fft_buffer *buf, uint64_t frame)
 {
-  pthread_mutex_lock(&ft->buffers_meta_lock);
-
-  for(;;) {
-    for (size_t bidx=0; bidx<ft->buffers_count; bidx++) {
-      if (ft->buffers[bidx].consumers && ft->buffers[bidx].frame_no==frame) {
-
-        return(&ft->buffers[bidx]);
-      }
-    }
-
-    if(!ft->running) {
-      pthread_mutex_unlock(&ft->buffers_meta_lock);
+  atomic_store_explicit(&buf->frame_no, frame, memory_order_relaxed);
+  atomic_store_explicit(&buf->consumers, ft->consumers, memory_order_relaxed);
 
-      return(NULL);
-    }
+  atomic_store_explicit(&ft->published, frame + 1, memory_order_release);
 
-    pthread_cond_wait(&ft->buffers_meta_notify, &ft->buffers_meta_lock);
-  }
+  fe_notify(&ft->published_notify);
 }
 
 static void *ft_main(void *dat)
@@ -143,50 +136,128 @@ static void *ft_main(void *dat)
 
   fprintf(stderr, "ft_main: thread %p is up and kicking butt!\n", dat);
 
-  for (uint64_t frame= 0; ;frame++) {
-    struct fft_buffer *buf= ft_get_consumed_buffer(ft);
+  for (uint64_t frame= 0; ;frame+= ft->batch_len) {
+    struct fft_buffer *bufs[ft->batch_len];
+    uint64_t loaded_ns[ft->batch_len];
+
+    for (size_t bi=0; bi<ft->batch_len; bi++) {
+      uint64_t t_wait= st_now_ns();
+
+      bufs[bi]= ft_get_consumed_buffer(ft, frame + bi);
+
+      if (!bufs[bi]) {
+        fprintf(stderr, "ft_main: thread %p is going to die\n", dat);
+        return((void *)true);
+      }
+
+      if (frame + bi == atomic_load_explicit(&ft->skip_frame, memory_order_acquire)) {
+        if (!ct_seek(ft->src, ft->skip_len)) {
+          return((void *)false);
+        }
+
+        atomic_store_explicit(&ft->skip_frame, UINT64_MAX, memory_order_relaxed);
+      }
+
+      uint64_t t_load= st_now_ns();
 
-    if (!buf) {
-      fprintf(stderr, "ft_main: thread %p is going to die\n", dat);
-      return(ft->running ? (void *)false : (void *)true);
+      if (!ft_load_samples(ft, bufs[bi])) {
+        return((void *)false);
+      }
+
+      loaded_ns[bi]= st_now_ns();
+
+      st_latency_add(&ft->stats.buffer_wait, t_load - t_wait);
+      st_latency_add(&ft->stats.load, loaded_ns[bi] - t_load);
     }
 
-    if (!ft_load_samples(ft, buf)) {
+    /* The buffers of a batch are adjacent as
+     * buffers_count is a multiple of batch_len */
+    if (!ft_calculate_fft(ft, bufs[0])) {
       return((void *)false);
     }
 
-    if (!ft_calculate_fft(buf)) {
-      return((void *)false);
+    uint64_t computed_ns= st_now_ns();
+
+    st_latency_add(&ft->stats.compute, computed_ns - loaded_ns[ft->batch_len - 1]);
+
+    for (size_t bi=0; bi<ft->batch_len; bi++) {
+      ft_publish_buffer(ft, bufs[bi], frame + bi);
+      st_latency_add(&ft->stats.latency, st_now_ns() - loaded_ns[bi]);
     }
 
-    pthread_mutex_lock(&ft->buffers_meta_lock);
+    uint64_t released= atomic_load_explicit(&ft->released, memory_order_relaxed);
 
-    buf->consumers= ft->consumers;
-    buf->frame_no= frame;
+    st_max(&ft->stats.in_use_max, frame + ft->batch_len - released);
+  }
+}
 
-    pthread_cond_broadcast(&ft->buffers_meta_notify);
-    pthread_mutex_unlock(&ft->buffers_meta_lock);
+/**
+ * Create the plan used by fft threads with
+ * the given length and batch length.
+ * Exported so that wisdom can be trained for it.
+ * The plan is executed on every batch using the
+ * new-array interface, so it must not rely on an alignment
+ * that only the first batch has.
+ */
+fftwf_plan ft_plan(size_t len_fft, size_t batch_len,
+                   fftwf_complex *in, fftwf_complex *out, unsigned flags)
+{
+  if (len_fft % FT_ALIGN_BINS) {
+    flags|= FFTW_UNALIGNED;
   }
+
+  return(ws_plan_dft(len_fft, batch_len, in, out, FFTW_FORWARD, flags));
 }
 
-bool ft_setup(struct fft_thread *ft, struct sdr *dev, float *window, size_t len_fft,
-              size_t buffers_count, uint64_t consumers_count, bool optimize)
+/**
+ * Setup a fft thread.
+ *
+ * @param buffers_count number of frames that may be in flight
+ * @param batch_len number of frames that are transformed at once.
+ *        Larger batches make better use of the cache and SIMD units
+ *        at the cost of latency. Must divide buffers_count.
+ */
+bool ft_setup(struct fft_thread *ft, struct capture_thread *src, float *window, size_t len_fft,
+              size_t buffers_count, size_t batch_len, uint64_t consumers_count, bool optimize)
 {
-  if (!ft || !dev) {
-    fprintf(stderr, "ft_setup: No ft or sdr structure\n");
+  if (!ft || !src) {
+    fprintf(stderr, "ft_setup: No ft or capture thread structure\n");
 
     return (false);
   }
 
-  ft->dev= dev;
-  ft->window= window;
+  if (!batch_len || buffers_count % batch_len) {
+    fprintf(stderr, "ft_setup: batch length %ld does not divide buffer count %ld\n",
+            batch_len, buffers_count);
+
+    return (false);
+  }
+
+  ft->src= src;
   ft->len_fft= len_fft;
   ft->consumers= consumers_count;
-  ft->running= false;
+  atomic_init(&ft->running, false);
+
+  if (!cv_init(&ft->conv, window, len_fft, sdr_format(src->dev))) {
+    fprintf(stderr, "ft_setup: setting up sample conversion failed\n");
+
+    return (false);
+  }
 
   ft->buffers_count= buffers_count;
-  pthread_mutex_init(&ft->buffers_meta_lock, NULL);
-  pthread_cond_init(&ft->buffers_meta_notify, NULL);
+  atomic_init(&ft->published, 0);
+  fe_init(&ft->published_notify);
+  fe_init(&ft->released_notify);
+
+  ft->batch_len= batch_len;
+  atomic_init(&ft->stats.in_use_max, 0);
+  st_latency_init(&ft->stats.load);
+  st_latency_init(&ft->stats.compute);
+  st_latency_init(&ft->stats.latency);
+  st_latency_init(&ft->stats.buffer_wait);
+  atomic_init(&ft->released, 0);
+  atomic_init(&ft->skip_frame, UINT64_MAX);
+  ft->skip_len= 0;
 
   ft->buffers= calloc(buffers_count, sizeof(*ft->buffers));
 
@@ -196,27 +267,30 @@ bool ft_setup(struct fft_thread *ft, struct sdr *dev, float *window, size_t len_
     return (false);
   }
 
-  for (size_t bidx=0; bidx<buffers_count; bidx++) {
-    ft->buffers[bidx].in=  fftwf_alloc_complex(len_fft);
-    ft->buffers[bidx].out= fftwf_alloc_complex(len_fft);
+  ft->in_all=  fftwf_alloc_complex(len_fft * buffers_count);
+  ft->out_all= fftwf_alloc_complex(len_fft * buffers_count);
 
-    if (!ft->buffers[bidx].in || !ft->buffers[bidx].out) {
-      fprintf(stderr, "ft_setup: allocating input/output buffers of length %ld failed\n", len_fft);
+  if (!ft->in_all || !ft->out_all) {
+    fprintf(stderr, "ft_setup: allocating input/output buffers of length %ld failed\n", len_fft);
 
-      return(false);
-    }
+    return(false);
+  }
 
-    ft->buffers[bidx].consumers= 0;
-    ft->buffers[bidx].frame_no= 0;
+  for (size_t bidx=0; bidx<buffers_count; bidx++) {
+    ft->buffers[bidx].in=  ft->in_all + bidx * len_fft;
+    ft->buffers[bidx].out= ft->out_all + bidx * len_fft;
 
-    ft->buffers[bidx].plan= fftwf_plan_dft_1d(len_fft,
-                                              ft->buffers[bidx].in, ft->buffers[bidx].out,
-                                              FFTW_FORWARD, optimize ? FFTW_MEASURE : FFTW_ESTIMATE);
+    atomic_init(&ft->buffers[bidx].consumers, 0);
+    atomic_init(&ft->buffers[bidx].frame_no, 0);
+  }
 
-    if (!ft->buffers[bidx].plan) {
-      fprintf(stderr, "ft_setup: fftwf_plan failed\n");
-      return(false);
-    }
+  /* One plan is shared by all batches, see ft_plan */
+  ft->plan= ft_plan(len_fft, batch_len, ft->in_all, ft->out_all,
+                    optimize ? FFTW_MEASURE : FFTW_ESTIMATE);
+
+  if (!ft->plan) {
+    fprintf(stderr, "ft_setup: fftwf_plan failed\n");
+    return(false);
   }
 
   return(true);
@@ -230,20 +304,22 @@ bool ft_start(struct fft_thread *ft)
     return(false);
   }
 
-  if (ft->running) {
+  if (atomic_load(&ft->running)) {
     return(true);
   }
 
+  atomic_store(&ft->running, true);
+
   int stat= pthread_create(&ft->thread, NULL, &ft_main, ft);
 
   if (stat != 0) {
     fprintf(stderr, "ft_start: pthread_create failed\n");
 
+    atomic_store(&ft->running, false);
+
     return(false);
   }
 
-  ft->running= true;
-
   return(true);
 }
 
@@ -255,52 +331,151 @@ bool ft_stop(struct fft_thread *ft)
     return(false);
   }
 
-  if (!ft->running) {
+  if (!atomic_load(&ft->running)) {
     return (true);
   }
 
-  pthread_mutex_lock(&ft->buffers_meta_lock);
+  atomic_store(&ft->running, false);
 
-  ft->running= false;
+  fe_notify(&ft->released_notify);
+  fe_notify(&ft->published_notify);
 
-  pthread_cond_broadcast(&ft->buffers_meta_notify);
-  pthread_mutex_unlock(&ft->buffers_meta_lock);
+  void *status= NULL;
 
-  bool status= false;
-
-  if (pthread_join(ft->thread, (void **)&status) != 0) {
+  if (pthread_join(ft->thread, &status) != 0) {
     fprintf(stderr, "ft_stop: Could not join thread\n");
 
     return(false);
   }
 
-  return(status);
+  double mean_us, max_us;
+
+  ft_get_latency(ft, &mean_us, &max_us);
+
+  fprintf(stderr, "ft_stop: batch length %ld, frame latency mean %.1fus, max %.1fus\n",
+          ft->batch_len, mean_us, max_us);
+
+  return(status != NULL);
 }
 
+/**
+ * Get frame number frame.
+ * Blocks until the frame is available.
+ *
+ * @return the buffer containing the frame or NULL if the
+ *         thread was stopped before producing it
+ */
 struct fft_buffer *ft_get_frame(struct fft_thread *ft, uint64_t frame)
 {
-  struct fft_buffer *buf= ft_get_frame_locked(ft, frame);
+  struct fft_buffer *buf= &ft->buffers[frame % ft->buffers_count];
+
+  for(;;) {
+    if (atomic_load_explicit(&ft->published, memory_order_acquire) > frame) {
+      break;
+    }
+
+    uint32_t seq= fe_prepare(&ft->published_notify);
+
+    if (atomic_load(&ft->published) > frame) {
+      fe_cancel(&ft->published_notify);
+    }
+    else if (!atomic_load(&ft->running)) {
+      fe_cancel(&ft->published_notify);
+
+      return(NULL);
+    }
+    else {
+      fe_wait(&ft->published_notify, seq);
+    }
+  }
+
+  if (atomic_load_explicit(&buf->frame_no, memory_order_relaxed) != frame) {
+    fprintf(stderr, "ft_get_frame: frame %ld was already released\n", frame);
 
-  pthread_mutex_unlock(&ft->buffers_meta_lock);
+    return(NULL);
+  }
 
   return(buf);
 }
 
 bool ft_release_frame(struct fft_thread *ft, struct fft_buffer *buf)
 {
-  pthread_mutex_lock(&ft->buffers_meta_lock);
+  if (atomic_fetch_sub_explicit(&buf->consumers, 1, memory_order_acq_rel) == 1) {
+    atomic_fetch_add_explicit(&ft->released, 1, memory_order_relaxed);
+    fe_notify(&ft->released_notify);
+  }
+
+  return(true);
+}
 
-  buf->consumers--;
+/**
+ * Whether ft_schedule_skip would accept a skip at frame
+ */
+bool ft_can_skip(struct fft_thread *ft, uint64_t frame)
+{
+  return(atomic_load(&ft->skip_frame) == UINT64_MAX &&
+         atomic_load(&ft->published) <= frame);
+}
 
-  if (!buf->consumers) {
-    pthread_cond_broadcast(&ft->buffers_meta_notify);
+/**
+ * Skip len bytes of input right before frame is loaded,
+ * to realign a running receiver.
+ * frame must not have been loaded yet. This is guaranteed
+ * if a consumer holds back frame - buffers_count or an
+ * earlier one, as its slot is not free before.
+ * Only one skip may be pending at a time.
+ */
+bool ft_schedule_skip(struct fft_thread *ft, uint64_t frame, size_t len)
+{
+  if (!ft_can_skip(ft, frame)) {
+    fprintf(stderr, "ft_schedule_skip: a skip is pending or frame %ld was already loaded\n",
+            frame);
+
+    return(false);
   }
 
-  pthread_mutex_unlock(&ft->buffers_meta_lock);
+  ft->skip_len= len;
+  atomic_store_explicit(&ft->skip_frame, frame, memory_order_release);
 
   return(true);
 }
 
+/**
+ * Get the time it took from the samples of a frame
+ * being loaded to the frame being published.
+ * This includes the time the frame waits for its batch.
+ */
+void ft_get_latency(struct fft_thread *ft, double *mean_us, double *max_us)
+{
+  struct st_histogram hist= {0};
+
+  st_latency_read(&ft->stats.latency, &hist);
+
+  if (mean_us) *mean_us= st_mean_us(&hist);
+  if (max_us) *max_us= hist.max_ns / 1000.0;
+}
+
+/**
+ * Add the statistics of this fft thread to report
+ */
+void ft_get_stats(struct fft_thread *ft, struct st_report *report)
+{
+  uint64_t published= atomic_load_explicit(&ft->published, memory_order_relaxed);
+  uint64_t released= atomic_load_explicit(&ft->released, memory_order_relaxed);
+  uint64_t in_use_max= st_load(&ft->stats.in_use_max);
+
+  report->fft_frames+= published;
+  report->fft_buffers+= ft->buffers_count;
+  report->fft_in_use+= (published > released) ? published - released : 0;
+
+  if (in_use_max > report->fft_in_use_max) report->fft_in_use_max= in_use_max;
+
+  st_latency_read(&ft->stats.load, &report->fft_load);
+  st_latency_read(&ft->stats.compute, &report->fft_compute);
+  st_latency_read(&ft->stats.latency, &report->fft_latency);
+  st_latency_read(&ft->stats.buffer_wait, &report->fft_buffer_wait);
+}
+
 bool ft_destroy(struct fft_thread *ft)
 {
   if (!ft) {
@@ -315,26 +490,25 @@ bool ft_destroy(struct fft_thread *ft)
     return (false);
   }
 
-  pthread_mutex_lock(&ft->buffers_meta_lock);
-
   for(size_t bidx=0; bidx<ft->buffers_count; bidx++) {
-    if(ft->buffers[bidx].consumers) {
+    if(atomic_load(&ft->buffers[bidx].consumers)) {
       fprintf(stderr,
               "ft_destroy: there is still a waiting consumer on frame %ld\n",
-              ft->buffers[bidx].frame_no);
+              atomic_load(&ft->buffers[bidx].frame_no));
 
       return (false);
     }
 
-    fftwf_destroy_plan(ft->buffers[bidx].plan);
-
-    fftwf_free(ft->buffers[bidx].in);
-    fftwf_free(ft->buffers[bidx].out);
   }
 
+  fftwf_destroy_plan(ft->plan);
+
+  fftwf_free(ft->in_all);
+  fftwf_free(ft->out_all);
+
   free(ft->buffers);
 
-  pthread_mutex_unlock(&ft->buffers_meta_lock);
+  cv_destroy(&ft->conv);
 
   return (true);
 }
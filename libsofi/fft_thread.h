@@ -22,47 +22,91 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <stdlib.h>
+#include <stdatomic.h>
 
 #include <pthread.h>
 
 #include <fftw3.h>
 
-#include "sdr.h"
+#include "capture_thread.h"
+#include "convert.h"
+#include "futex_event.h"
+#include "stats.h"
 
 struct fft_buffer {
-  uint64_t consumers;
-  uint64_t frame_no;
+  _Atomic uint64_t consumers;
+  _Atomic uint64_t frame_no;
 
   fftwf_complex *in;
   fftwf_complex *out;
-
-  fftwf_plan plan;
 };
 
 struct fft_thread {
-  struct sdr *dev;
+  struct capture_thread *src;
 
   size_t len_fft;
   uint64_t consumers;
-  bool running;
+  _Atomic bool running;
   pthread_t thread;
 
-  float *window;
+  struct converter conv;
 
+  /* The buffers form a ring, frame n is
+   * always stored in buffers[n % buffers_count].
+   * The producer may only reuse a slot once every
+   * consumer released the frame stored in it. */
   struct fft_buffer *buffers;
-
   size_t buffers_count;
-  pthread_mutex_t buffers_meta_lock;
-  pthread_cond_t buffers_meta_notify;
+
+  /* batch_len consecutive frames are transformed
+   * by a single execution of plan. The in and out
+   * arrays of all buffers are slices of in_all/out_all */
+  size_t batch_len;
+  fftwf_complex *in_all;
+  fftwf_complex *out_all;
+  fftwf_plan plan;
+
+  /* Only written by the fft thread.
+   * latency is the time from a frame being loaded to
+   * it being published, buffer_wait the time spent
+   * waiting for the consumers to release a slot */
+  struct {
+    _Atomic uint64_t in_use_max;
+    struct st_latency load;
+    struct st_latency compute;
+    struct st_latency latency;
+    struct st_latency buffer_wait;
+  } stats;
+
+  /* Frames 0 to published-1 were produced */
+  _Alignas(64) _Atomic uint64_t published;
+  struct futex_event published_notify;
+
+  /* Frames released by all their consumers */
+  _Alignas(64) _Atomic uint64_t released;
+  struct futex_event released_notify;
+
+  /* Samples to skip right before frame skip_frame
+   * is loaded, UINT64_MAX if none. See ft_schedule_skip */
+  _Atomic uint64_t skip_frame;
+  size_t skip_len;
 };
 
-bool ft_setup(struct fft_thread *ft, struct sdr *dev, float *window, size_t len_fft,
-              size_t buffers_count, uint64_t consumers_count, bool optimize);
+fftwf_plan ft_plan(size_t len_fft, size_t batch_len,
+                   fftwf_complex *in, fftwf_complex *out, unsigned flags);
+
+bool ft_setup(struct fft_thread *ft, struct capture_thread *src, float *window, size_t len_fft,
+              size_t buffers_count, size_t batch_len, uint64_t consumers_count, bool optimize);
 
 bool ft_start(struct fft_thread *ft);
 bool ft_stop(struct fft_thread *ft);
 
 struct fft_buffer *ft_get_frame(struct fft_thread *ft, uint64_t frame);
 bool ft_release_frame(struct fft_thread *ft, struct fft_buffer *buf);
+bool ft_can_skip(struct fft_thread *ft, uint64_t frame);
+bool ft_schedule_skip(struct fft_thread *ft, uint64_t frame, size_t len);
+
+void ft_get_latency(struct fft_thread *ft, double *mean_us, double *max_us);
+void ft_get_stats(struct fft_thread *ft, struct st_report *report);
 
 bool ft_destroy(struct fft_thread *ft);
@@ -0,0 +1,85 @@
+/*
+ * Copyright 2016 Leonard Göhrs <leonard@goehrs.eu>
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <limits.h>
+
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+/* A futex_event is a wait/notify primitive for lock-free
+ * data structures. The notifier only enters the kernel
+ * if there actually is someone waiting.
+ *
+ * Waiting looks like this:
+ *
+ *   uint32_t seq= fe_prepare(ev);
+ *   if (condition_met) fe_cancel(ev);
+ *   else fe_wait(ev, seq);
+ *
+ * And notifying:
+ *
+ *   make condition true
+ *   fe_notify(ev);
+ */
+struct futex_event {
+  _Atomic uint32_t seq;
+  _Atomic uint32_t waiters;
+};
+
+static inline void fe_init(struct futex_event *ev)
+{
+  atomic_init(&ev->seq, 0);
+  atomic_init(&ev->waiters, 0);
+}
+
+static inline uint32_t fe_prepare(struct futex_event *ev)
+{
+  atomic_fetch_add(&ev->waiters, 1);
+
+  return(atomic_load(&ev->seq));
+}
+
+static inline void fe_cancel(struct futex_event *ev)
+{
+  atomic_fetch_sub(&ev->waiters, 1);
+}
+
+static inline void fe_wait(struct futex_event *ev, uint32_t seq)
+{
+  /* Returns immediately if seq was changed by
+   * a notification after fe_prepare */
+  syscall(SYS_futex, &ev->seq, FUTEX_WAIT_PRIVATE, seq, NULL, NULL, 0);
+
+  atomic_fetch_sub(&ev->waiters, 1);
+}
+
+static inline void fe_notify(struct futex_event *ev)
+{
+  atomic_fetch_add(&ev->seq, 1);
+
+  if (atomic_load(&ev->waiters)) {
+    syscall(SYS_futex, &ev->seq, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+  }
+}
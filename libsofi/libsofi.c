@@ -17,8 +17,14 @@
  * Boston, MA 02110-1301, USA.
  */
 
-#define NUM_SDRS (4)
+#define DEFAULT_NUM_SDRS (4)
 #define FFT_LEN (1024)
+#define FFT_BUFFERS (32)
+#define FFT_BATCH (4)
+#define SYNC_LEN (1<<18)
+#define CENTER_FREQ (97500000)
+#define SAMP_RATE (2000000)
+#define CAPTURE_RING_LEN (1<<24)
 
 #include <pthread.h>
 #include <stdio.h>
@@ -31,16 +37,34 @@
 #include <unistd.h>
 
 #include "sdr.h"
+#include "capture_thread.h"
 #include "fft_thread.h"
 #include "synchronize.h"
 #include "window.h"
 #include "combiner.h"
+#include "combiner_thread.h"
+#include "drift.h"
+#include "doa.h"
+#include "cfar.h"
+#include "wisdom.h"
+#include "stats.h"
 
 struct sofi_state {
-  struct sdr devs[NUM_SDRS];
-  struct fft_thread ffts[NUM_SDRS];
+  size_t num_sdrs;
+
+  struct sdr *devs;
+  struct capture_thread *caps;
+  struct fft_thread *ffts;
   float *window;
+  float *delays;
   struct combiner cb;
+  struct combiner_thread cbt;
+  struct drift_tracker dt;
+  struct doa_engine doa;
+  struct cf_detector cf;
+
+  /* Sequence number of the last result handed out */
+  uint64_t seq;
 };
 
 float *sofi_alloc_real(void)
@@ -50,8 +74,24 @@ float *sofi_alloc_real(void)
   return(target);
 }
 
-struct sofi_state *sofi_new(void)
+/**
+ * Open, synchronize and start num_sdrs receivers.
+ *
+ * @param devices num_sdrs device specifications as accepted
+ *        by sdr_open (e.g. "synth:seed=1" or "file:rec0.cu8")
+ *        or NULL for /dev/swradio0 to /dev/swradio<num_sdrs-1>.
+ */
+struct sofi_state *sofi_new_devices(uint64_t num_sdrs, const char *const *devices)
 {
+  if (!num_sdrs) {
+    num_sdrs= DEFAULT_NUM_SDRS;
+  }
+
+  if (num_sdrs < 2) {
+    fprintf(stderr, "At least two sdrs are required!\n");
+    return(NULL);
+  }
+
   struct sofi_state *s= calloc(1, sizeof(struct sofi_state));
 
   if(!s) {
@@ -59,12 +99,33 @@ struct sofi_state *sofi_new(void)
     return(NULL);
   }
 
+  s->num_sdrs= num_sdrs;
+  s->devs= calloc(num_sdrs, sizeof(*s->devs));
+  s->caps= calloc(num_sdrs, sizeof(*s->caps));
+  s->ffts= calloc(num_sdrs, sizeof(*s->ffts));
+  s->delays= calloc(num_sdrs, sizeof(*s->delays));
+
+  if(!s->devs || !s->caps || !s->ffts || !s->delays) {
+    fprintf(stderr, "Allocating sdr states failed!\n");
+    return(NULL);
+  }
+
+  /* Every combiner worker consumes every fft frame */
+  size_t num_workers= cb_workers_for(num_sdrs);
+
+  /* Trained wisdom (see sofi_wisdom) turns the
+   * FFTW_MEASURE planning below into a lookup */
+  ws_load(ws_default_path());
+
   s->window= window_hamming(FFT_LEN);
 
-  for (int i=0; i<NUM_SDRS; i++) {
-    char path[128];
+  for (size_t i=0; i<s->num_sdrs; i++) {
+    char default_path[32];
+    const char *path= devices ? devices[i] : default_path;
 
-    sprintf(path, "/dev/swradio%d", i);
+    if (!devices) {
+      sprintf(default_path, "/dev/swradio%ld", i);
+    }
 
     fprintf(stderr, "Open dev %s\n", path);
 
@@ -76,60 +137,117 @@ struct sofi_state *sofi_new(void)
       return (NULL);
     }
 
-    if(!sdr_set_center_freq(&s->devs[i], 975*100*1000)) {
+    if(!sdr_set_center_freq(&s->devs[i], CENTER_FREQ)) {
+      return(NULL);
+    }
+
+    if(!ct_setup(&s->caps[i], &s->devs[i], CAPTURE_RING_LEN)) {
       return(NULL);
     }
 
-    if(!ft_setup(&s->ffts[i], &s->devs[i], s->window,
-                 FFT_LEN, 32, 1, true)) {
+    if(!ft_setup(&s->ffts[i], &s->caps[i], s->window,
+                 FFT_LEN, FFT_BUFFERS, FFT_BATCH, num_workers, true)) {
       return(NULL);
     }
   }
 
-  for (int i=0; i<NUM_SDRS; i++) {
-    fprintf(stderr, "Start dev %d\n", i);
+  for (size_t i=0; i<s->num_sdrs; i++) {
+    fprintf(stderr, "Start dev %ld\n", i);
 
     if(!sdr_start(&s->devs[i])) {
       return(NULL);
     }
+
+    if(!ct_start(&s->caps[i])) {
+      return(NULL);
+    }
   }
 
-  for (int i=NUM_SDRS-1; i>=0; i--) {
-    fprintf(stderr, "Speed up dev %d\n", i);
+  for (size_t i=s->num_sdrs; i-- > 0;) {
+    fprintf(stderr, "Speed up dev %ld\n", i);
 
-    if(!sdr_set_sample_rate(&s->devs[i], 2000000)) {
+    if(!sdr_set_sample_rate(&s->devs[i], SAMP_RATE)) {
       return(NULL);
     }
   }
 
-  fprintf(stderr, "Start syncing\n");
+  /* Recordings made by sofi_record start aligned
+   * and bring the delays that are left along */
+  bool synced= true;
 
-  //fprintf(stderr, "*** WARNING: Skipping sync process ***\n");
-  if(!sync_sdrs(s->devs, NUM_SDRS, 1<<18)) {
-    return(NULL);
+  for (size_t i=0; i<s->num_sdrs; i++) {
+    synced= sdr_file_sync_delay(&s->devs[i], &s->delays[i]) && synced;
+  }
+
+  if (synced) {
+    fprintf(stderr, "Using the sync of the recordings\n");
+  }
+  else {
+    fprintf(stderr, "Start syncing\n");
+
+    //fprintf(stderr, "*** WARNING: Skipping sync process ***\n");
+    if(!sync_sdrs(s->caps, s->num_sdrs, SYNC_LEN, SYNC_WEIGHT_PHAT, s->delays)) {
+      return(NULL);
+    }
   }
 
+  ws_save(ws_default_path());
+
 
   fprintf(stderr, "Start fft threads\n");
 
-  for (int i=0; i<NUM_SDRS; i++) {
-    fprintf(stderr, "Start fft %d\n", i);
+  for (size_t i=0; i<s->num_sdrs; i++) {
+    fprintf(stderr, "Start fft %ld\n", i);
 
     if(!ft_start(&s->ffts[i])) {
       return(NULL);
     }
   }
 
-  if(!cb_init(&s->cb, s->ffts, NUM_SDRS)) {
+  if(!cb_init(&s->cb, s->ffts, s->num_sdrs, num_workers)) {
+    return(NULL);
+  }
+
+  if(!cb_set_delays(&s->cb, s->delays)) {
+    return(NULL);
+  }
+
+  if(!dt_init(&s->dt, &s->cb, s->delays)) {
+    return(NULL);
+  }
+
+  if(!cf_init(&s->cf, FFT_LEN)) {
+    return(NULL);
+  }
+
+  fprintf(stderr, "Start combiner thread\n");
+
+  if(!cbt_setup(&s->cbt, &s->cb) || !cbt_set_drift_tracker(&s->cbt, &s->dt) ||
+     !cbt_set_detector(&s->cbt, &s->cf) || !cbt_start(&s->cbt)) {
     return(NULL);
   }
 
   return(s);
 }
 
-uint64_t sofi_get_nsdrs(__attribute__((unused)) struct sofi_state *s)
+/**
+ * Open, synchronize and start num_sdrs receivers
+ * /dev/swradio0 to /dev/swradio<num_sdrs-1>.
+ * Passing 0 selects the default of 4 receivers.
+ */
+struct sofi_state *sofi_new(uint64_t num_sdrs)
+{
+  return(sofi_new_devices(num_sdrs, NULL));
+}
+
+uint64_t sofi_get_nsdrs(struct sofi_state *s)
+{
+  return(s->num_sdrs);
+}
+
+uint64_t sofi_get_nedges(struct sofi_state *s)
 {
-  return(NUM_SDRS);
+  return(s->cb.num_edges);
 }
 
 uint64_t sofi_get_fftlen(__attribute__((unused)) struct sofi_state *s)
@@ -137,11 +255,241 @@ uint64_t sofi_get_fftlen(__attribute__((unused)) struct sofi_state *s)
   return(FFT_LEN);
 }
 
+uint64_t sofi_get_cov_stride(struct sofi_state *s)
+{
+  return(s->cb.cov_stride);
+}
+
+/**
+ * Allocate a cache aligned buffer for sofi_read_covariance.
+ * The matrix for bin k starts at k*sofi_get_cov_stride()
+ */
+fftwf_complex *sofi_alloc_covariance(struct sofi_state *s)
+{
+  size_t len= sizeof(fftwf_complex) * FFT_LEN * s->cb.cov_stride;
+  fftwf_complex *target= aligned_alloc(64, len);
+
+  return(target);
+}
+
+static void sofi_copy_result(struct sofi_state *s, const struct cbt_result *res,
+                             float *mag_dst, float **phase_dsts,
+                             fftwf_complex *cov_dst)
+{
+  memcpy(mag_dst, res->mag, sizeof(*mag_dst) * FFT_LEN);
+
+  for (size_t ei=0; ei<s->cb.num_edges; ei++) {
+    memcpy(phase_dsts[ei], res->phases[ei], sizeof(*phase_dsts[ei]) * FFT_LEN);
+  }
+
+  if (cov_dst) {
+    memcpy(cov_dst, res->cov, sizeof(*cov_dst) * FFT_LEN * s->cb.cov_stride);
+  }
+
+  s->seq= res->seq;
+}
+
+/**
+ * Wait for a result that was not handed out before
+ */
+static bool sofi_read_next(struct sofi_state *s, float *mag_dst, float **phase_dsts,
+                           fftwf_complex *cov_dst)
+{
+  uint64_t seq= s->seq;
+  const struct cbt_result *res;
+
+  /* Results that were calculated before covariance
+   * output was enabled are skipped */
+  while ((res= cbt_next(&s->cbt, seq)) && cov_dst && !res->cov) {
+    seq= res->seq;
+  }
+
+  if (!res) {
+    fprintf(stderr, "sofi_read: combiner thread stopped\n");
+
+    return(false);
+  }
+
+  sofi_copy_result(s, res, mag_dst, phase_dsts, cov_dst);
+
+  return(true);
+}
+
+/**
+ * Wait for the next result and copy it into the buffers.
+ * Results that are not read in time are dropped, a slow
+ * reader never stalls the signal processing.
+ */
 bool sofi_read(struct sofi_state *s, float *mag_dst, float **phase_dsts)
 {
-  bool ret= cb_step(&s->cb, mag_dst, phase_dsts);
+  return(sofi_read_next(s, mag_dst, phase_dsts, NULL));
+}
+
+/**
+ * Like sofi_read, but additionally output the
+ * full covariance matrix of all sdrs for every bin.
+ */
+bool sofi_read_covariance(struct sofi_state *s, float *mag_dst, float **phase_dsts,
+                          fftwf_complex *cov_dst)
+{
+  cbt_enable_covariance(&s->cbt);
+
+  return(sofi_read_next(s, mag_dst, phase_dsts, cov_dst));
+}
+
+/**
+ * Copy the most recent result into the buffers without waiting.
+ * cov_dst may be NULL, otherwise covariance output is enabled.
+ * The buffers are only written if there is a new result.
+ * Returns the sequence number of the result or 0 if there
+ * was no result yet.
+ */
+uint64_t sofi_read_latest(struct sofi_state *s, float *mag_dst, float **phase_dsts,
+                          fftwf_complex *cov_dst)
+{
+  if (cov_dst) {
+    cbt_enable_covariance(&s->cbt);
+  }
+
+  const struct cbt_result *res= cbt_latest(&s->cbt);
+
+  if (!res || (cov_dst && !res->cov)) {
+    return(0);
+  }
+
+  if (res->seq != s->seq) {
+    sofi_copy_result(s, res, mag_dst, phase_dsts, cov_dst);
+  }
+
+  return(res->seq);
+}
+
+/**
+ * Select the integration mode (0: block, 1: sliding,
+ * 2: exponential), the integration length in frames and
+ * the number of frames between two outputs.
+ * See cb_set_integration.
+ */
+bool sofi_set_integration(struct sofi_state *s, uint32_t mode,
+                          uint64_t window, uint64_t hop)
+{
+  return(cbt_set_integration(&s->cbt, mode, window, hop));
+}
+
+/**
+ * Copy the delays of the receivers relative to the first
+ * one in samples to dst, one value per sdr.
+ * They are found by sync_sdrs, kept up to date by the
+ * drift tracker and compensated in the combiner.
+ */
+bool sofi_get_delays(struct sofi_state *s, float *dst)
+{
+  dt_get_delays(&s->dt, dst);
+
+  return(true);
+}
 
-  return(ret);
+/**
+ * Calibrate the antennas. The spectrum of every sdr is
+ * rotated by its phase correction in radians plus a phase
+ * ramp for its delay correction in samples, on top of the
+ * delays of sofi_get_delays. Either may be NULL for none.
+ * Takes effect with one of the next results, cheap enough
+ * to be called for every result. See cb_set_calibration.
+ */
+bool sofi_set_calibration(struct sofi_state *s, const float *phases,
+                          const float *delays)
+{
+  return(cbt_set_calibration(&s->cbt, phases, delays));
+}
+
+/**
+ * Copy up to max spans of signal (kind 0) or noise (kind 1)
+ * bins that the detector found in the last result to dst.
+ * Returns the number of spans found, which may exceed max.
+ * The spans can be passed to sofi_get_directions.
+ * See cfar.h.
+ */
+uint64_t sofi_get_spans(struct sofi_state *s, uint32_t kind,
+                        struct doa_span *dst, uint64_t max)
+{
+  if (kind != CF_SIGNAL && kind != CF_NOISE) {
+    fprintf(stderr, "sofi_get_spans: unknown kind %u\n", kind);
+
+    return(0);
+  }
+
+  return(cf_get_spans(&s->cf, kind, dst, max));
+}
+
+/**
+ * Set up direction finding for an antenna array.
+ * positions holds the x and y coordinate in meters of the
+ * antenna of every sdr, the pseudo spectra returned by
+ * sofi_get_directions have dir_len test angles from -pi to pi.
+ * Must not be called while sofi_get_directions runs.
+ */
+bool sofi_set_antennas(struct sofi_state *s, const float *positions, uint64_t dir_len)
+{
+  doa_destroy(&s->doa);
+
+  return(doa_init(&s->doa, positions, s->num_sdrs, FFT_LEN, dir_len,
+                  CENTER_FREQ, SAMP_RATE));
+}
+
+/**
+ * Calculate the bearing pseudo spectra of num_spans signals
+ * from the phases returned by sofi_read into dst,
+ * dir_len values per signal. See doa_spectra.
+ */
+bool sofi_get_directions(struct sofi_state *s, float **phases,
+                         const struct doa_span *spans, uint64_t num_spans,
+                         float *dst)
+{
+  return(doa_spectra(&s->doa, phases, spans, num_spans, dst));
+}
+
+/**
+ * Calculate MUSIC pseudo spectra of num_spans signals from
+ * the covariance matrices returned by sofi_read_covariance.
+ * num_sources is the number of emitters per bin, 0 estimates
+ * it from the eigenvalues. See doa_music.
+ */
+bool sofi_get_directions_music(struct sofi_state *s, fftwf_complex *cov,
+                               const struct doa_span *spans, uint64_t num_spans,
+                               uint64_t num_sources, float *dst)
+{
+  return(doa_music(&s->doa, cov, s->cb.cov_stride, spans, num_spans,
+                   num_sources, dst));
+}
+
+/**
+ * Copy the statistics of all stages, summed up over
+ * all devices, to dst. See struct st_report in stats.h.
+ * Cheap enough to be polled a few times per second.
+ */
+bool sofi_get_stats(struct sofi_state *s, struct st_report *dst)
+{
+  memset(dst, 0, sizeof(*dst));
+
+  for (size_t i=0; i<s->num_sdrs; i++) {
+    ct_get_stats(&s->caps[i], dst);
+    ft_get_stats(&s->ffts[i], dst);
+  }
+
+  cbt_get_stats(&s->cbt, dst);
+  dt_get_stats(&s->dt, dst);
+
+  return(true);
+}
+
+/**
+ * Size of struct st_report, so bindings can
+ * check that they use the same layout
+ */
+uint64_t sofi_get_stats_size(void)
+{
+  return(sizeof(struct st_report));
 }
 
 bool sofi_destroy(__attribute__((unused)) struct sofi_state *s)
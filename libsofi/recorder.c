@@ -0,0 +1,397 @@
+/*
+ * Copyright 2016 Leonard Göhrs <leonard@goehrs.eu>
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+
+/* For O_DIRECT */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "recorder.h"
+
+#include "sdr.h"
+
+/* O_DIRECT requires the buffer address, length and
+ * file offset to be multiples of the block size */
+#define REC_DIRECT_ALIGN (4096)
+
+#define REC_INDEX_CHUNK (4096)
+
+/* Padding is queued from a buffer of this size */
+#define REC_FILL_LEN (65536)
+
+/* Samples queued for the writer thread. 8s at 2 MS/s
+ * of 8 bit samples, to ride out slow disks */
+#define REC_RING_LEN (1 << 25)
+
+static bool rec_is_aligned(uint64_t val)
+{
+  return((val % REC_DIRECT_ALIGN) == 0);
+}
+
+/**
+ * Fall back to buffered writes.
+ * Used once a buffer can not be written with O_DIRECT.
+ */
+static bool rec_leave_direct(struct recorder *rec)
+{
+  if (!rec->direct) {
+    return(true);
+  }
+
+  int flags= fcntl(rec->fd, F_GETFL);
+
+  if (flags < 0 || fcntl(rec->fd, F_SETFL, flags & ~O_DIRECT) < 0) {
+    fprintf(stderr, "rec_leave_direct: fcntl failed (%s)\n", strerror(errno));
+    return(false);
+  }
+
+  rec->direct= false;
+
+  return(true);
+}
+
+static bool rec_pwrite_all(struct recorder *rec, const void *buf, size_t len, uint64_t offset)
+{
+  for (size_t pos=0; pos < len; ) {
+    ssize_t wr= pwrite(rec->fd, (const uint8_t *)buf + pos, len - pos, offset + pos);
+
+    if (wr < 0 && errno == EINTR) continue;
+
+    if (wr < 0 && errno == EINVAL && rec->direct) {
+      /* The filesystem refused this O_DIRECT write */
+      if (!rec_leave_direct(rec)) return(false);
+      continue;
+    }
+
+    if (wr <= 0) {
+      fprintf(stderr, "rec_pwrite_all: write failed (%s)\n", strerror(errno));
+      return(false);
+    }
+
+    pos+= wr;
+  }
+
+  return(true);
+}
+
+static bool rec_add_data(struct recorder *rec, const void *samples, size_t len)
+{
+  struct rec_header *hdr= rec->header;
+  uint64_t offset= REC_HEADER_LEN + hdr->data_len;
+
+  if (rec->direct &&
+      !(rec_is_aligned((uintptr_t)samples) && rec_is_aligned(len) && rec_is_aligned(offset))) {
+    if (!rec_leave_direct(rec)) return(false);
+  }
+
+  if (!rec_pwrite_all(rec, samples, len, offset)) {
+    return(false);
+  }
+
+  hdr->data_len+= len;
+
+  return(true);
+}
+
+/**
+ * Write the queued samples to the file
+ * until the ring is closed and drained
+ */
+static void *rec_main(void *dat)
+{
+  struct recorder *rec= dat;
+
+  for (;;) {
+    void *samples;
+    ssize_t len= sr_peek(&rec->ring, SIZE_MAX, &samples);
+
+    if (len < 0) {
+      break;
+    }
+
+    /* Whole blocks keep the following writes aligned,
+     * the rest is written with the next ones */
+    if (len > REC_DIRECT_ALIGN && (len % REC_DIRECT_ALIGN)) {
+      len= sr_peek(&rec->ring, len & ~(ssize_t)(REC_DIRECT_ALIGN - 1), NULL);
+    }
+
+    if (!rec_add_data(rec, samples, len)) {
+      /* Makes the next rec_write fail */
+      atomic_store(&rec->failed, true);
+      sr_close(&rec->ring);
+
+      return((void *)false);
+    }
+
+    sr_done(&rec->ring);
+  }
+
+  return((void *)true);
+}
+
+/**
+ * Create a recording for one channel.
+ * The samples are queued in a ring and written by a
+ * thread of the recorder, so that a slow disk does not
+ * hold back the capture thread. They are written from
+ * the ring with O_DIRECT as long as the buffer lengths
+ * allow it, so they do not pass through the page cache.
+ */
+bool rec_open(struct recorder *rec, const char *path, struct sdr *dev,
+              uint32_t channel, uint32_t num_channels,
+              uint32_t sample_rate, uint32_t center_freq)
+{
+  if (!rec || !path || !dev) {
+    fprintf(stderr, "rec_open: No rec structure, path or device\n");
+    return(false);
+  }
+
+  rec->direct= true;
+  rec->fd= open(path, O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+
+  if (rec->fd < 0 && errno == EINVAL) {
+    /* e.g. tmpfs does not support O_DIRECT */
+    rec->direct= false;
+    rec->fd= open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  }
+
+  if (rec->fd < 0) {
+    fprintf(stderr, "rec_open: open(%s) failed (%s)\n", path, strerror(errno));
+    return(false);
+  }
+
+  rec->header= aligned_alloc(REC_DIRECT_ALIGN, REC_HEADER_LEN);
+  rec->fill= malloc(REC_FILL_LEN);
+  rec->index= NULL;
+  rec->index_count= 0;
+  rec->index_alloc= 0;
+  rec->queued= 0;
+  atomic_init(&rec->failed, false);
+
+  if (!rec->header || !rec->fill || !sr_init(&rec->ring, REC_RING_LEN)) {
+    fprintf(stderr, "rec_open: allocating buffers failed\n");
+    return(false);
+  }
+
+  /* Fault the ring in now instead of on the capture thread */
+  memset(rec->ring.buf, 0, rec->ring.len);
+
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+
+  memset(rec->header, 0, REC_HEADER_LEN);
+  memcpy(rec->header->magic, REC_MAGIC, sizeof(rec->header->magic));
+
+  rec->header->format= sdr_format(dev);
+  rec->header->sample_rate= sample_rate;
+  rec->header->center_freq= center_freq;
+  rec->header->channel= channel;
+  rec->header->num_channels= num_channels;
+  rec->header->sync_offset= -1;
+  rec->header->start_ns= ts.tv_sec * 1000000000ull + ts.tv_nsec;
+
+  /* Written again with the final values by rec_close */
+  if (!rec_pwrite_all(rec, rec->header, REC_HEADER_LEN, 0)) {
+    return(false);
+  }
+
+  if (pthread_create(&rec->thread, NULL, &rec_main, rec) != 0) {
+    fprintf(stderr, "rec_open: pthread_create failed\n");
+    return(false);
+  }
+
+  return(true);
+}
+
+static bool rec_add_index(struct recorder *rec, uint32_t len,
+                          uint32_t sequence, uint64_t timestamp_ns)
+{
+  if (rec->index_count == rec->index_alloc) {
+    size_t alloc= rec->index_alloc + REC_INDEX_CHUNK;
+    struct rec_index_entry *index= realloc(rec->index, alloc * sizeof(*index));
+
+    if (!index) {
+      fprintf(stderr, "rec_add_index: growing the index failed\n");
+      return(false);
+    }
+
+    rec->index= index;
+    rec->index_alloc= alloc;
+  }
+
+  struct rec_index_entry *entry= &rec->index[rec->index_count++];
+
+  entry->offset= rec->queued;
+  entry->timestamp_ns= timestamp_ns;
+  entry->sequence= sequence;
+  entry->len= len;
+
+  return(true);
+}
+
+/**
+ * Queue len bytes for the writer thread and add them to
+ * the index. Fails if the writer fell too far behind.
+ */
+static bool rec_queue(struct recorder *rec, const void *samples, size_t len,
+                      uint32_t sequence, uint64_t timestamp_ns)
+{
+  if (atomic_load(&rec->failed)) {
+    return(false);
+  }
+
+  if (!sr_try_write(&rec->ring, samples, len)) {
+    fprintf(stderr, "rec_queue: the disk can not keep up\n");
+    return(false);
+  }
+
+  if (!rec_add_index(rec, len, sequence, timestamp_ns)) {
+    return(false);
+  }
+
+  rec->queued+= len;
+
+  return(true);
+}
+
+/**
+ * Append one device buffer to the recording.
+ * Meant to be called between sdr_peek and sdr_done,
+ * never blocks. After it failed once the recording
+ * ends at the last buffer that was appended.
+ */
+bool rec_write(struct recorder *rec, const void *samples, size_t len,
+               uint32_t sequence, uint64_t timestamp_ns)
+{
+  return(rec_queue(rec, samples, len, sequence, timestamp_ns));
+}
+
+/**
+ * Append len bytes of value in place of samples
+ * the device lost. sequence is the one of the
+ * buffer before the gap.
+ */
+bool rec_pad(struct recorder *rec, uint64_t len, uint8_t value, uint32_t sequence)
+{
+  memset(rec->fill, value, REC_FILL_LEN);
+
+  while (len) {
+    size_t chunk= (len < REC_FILL_LEN) ? len : REC_FILL_LEN;
+
+    if (!rec_queue(rec, rec->fill, chunk, sequence, 0)) {
+      return(false);
+    }
+
+    len-= chunk;
+  }
+
+  return(true);
+}
+
+/**
+ * Store the sample index at which this channel
+ * is aligned with the other channels and the
+ * fractional delay that is left
+ */
+void rec_set_sync_offset(struct recorder *rec, int64_t sample, float delay)
+{
+  rec->header->sync_offset= sample;
+  rec->header->sync_delay= delay;
+}
+
+/**
+ * Write the remaining samples, append the index
+ * and complete the header.
+ * The capture thread must no longer write to rec.
+ */
+bool rec_close(struct recorder *rec)
+{
+  if (!rec) {
+    fprintf(stderr, "rec_close: No rec structure\n");
+    return(false);
+  }
+
+  void *written;
+
+  sr_close(&rec->ring);
+  pthread_join(rec->thread, &written);
+
+  /* If the writer failed, the index refers to data that
+   * is not in the file. It still describes what is there */
+  bool ok= (written != NULL) && rec_leave_direct(rec);
+
+  while (rec->index_count &&
+         rec->index[rec->index_count - 1].offset + rec->index[rec->index_count - 1].len >
+         rec->header->data_len) {
+    rec->index_count--;
+  }
+
+  rec->header->index_offset= REC_HEADER_LEN + rec->header->data_len;
+  rec->header->index_count= rec->index_count;
+
+  ok= ok && rec_pwrite_all(rec, rec->index, rec->index_count * sizeof(*rec->index),
+                           rec->header->index_offset);
+  ok= ok && rec_pwrite_all(rec, rec->header, REC_HEADER_LEN, 0);
+
+  if (close(rec->fd) < 0) {
+    fprintf(stderr, "rec_close: close failed (%s)\n", strerror(errno));
+    ok= false;
+  }
+
+  free(rec->header);
+  free(rec->fill);
+  free(rec->index);
+  sr_destroy(&rec->ring);
+
+  return(ok);
+}
+
+/**
+ * Read and check the header of a recording
+ */
+bool rec_read_header(int fd, struct rec_header *header)
+{
+  if (pread(fd, header, sizeof(*header), 0) != sizeof(*header)) {
+    fprintf(stderr, "rec_read_header: reading header failed\n");
+    return(false);
+  }
+
+  if (memcmp(header->magic, REC_MAGIC, sizeof(header->magic))) {
+    fprintf(stderr, "rec_read_header: not a sofi recording\n");
+    return(false);
+  }
+
+  if (!header->index_offset) {
+    fprintf(stderr, "rec_read_header: recording was not closed properly\n");
+    return(false);
+  }
+
+  return(true);
+}
@@ -0,0 +1,116 @@
+/*
+ * Copyright 2016 Leonard Göhrs <leonard@goehrs.eu>
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include <stdatomic.h>
+
+#include <pthread.h>
+
+#include "sdr.h"
+#include "sample_ring.h"
+
+/* Raw recordings are stored one file per channel:
+ *
+ *   0                 struct rec_header, padded to REC_HEADER_LEN
+ *   REC_HEADER_LEN    the raw samples, exactly as delivered by the device
+ *   index_offset      index_count struct rec_index_entry
+ *
+ * Every device buffer gets an index entry, so a replay
+ * can look up the data offset for any point in time.
+ * Samples the device lost are padded like in the capture
+ * ring, so the data keeps its position in time. The index
+ * entries of padding repeat the sequence number of the
+ * buffer before the gap and have a timestamp of 0.
+ * The index is appended and the header completed when
+ * the recording is closed. All fields are little endian. */
+
+#define REC_MAGIC "SOFIREC1"
+#define REC_HEADER_LEN (4096)
+
+struct rec_header {
+  char magic[8];
+
+  uint32_t format;
+  uint32_t sample_rate;
+  uint32_t center_freq;
+  uint32_t channel;
+  uint32_t num_channels;
+
+  /* Delay relative to channel 0 that is left after
+   * aligning at sync_offset, in fractions of a sample.
+   * As determined by sync_sdrs, see cb_set_delays */
+  float sync_delay;
+
+  /* Sample index at which the channels are aligned,
+   * as determined by sync_sdrs. -1 if not synchronized */
+  int64_t sync_offset;
+
+  /* CLOCK_REALTIME at the start of the recording */
+  uint64_t start_ns;
+
+  uint64_t data_len;
+  uint64_t index_offset;
+  uint64_t index_count;
+};
+
+struct rec_index_entry {
+  /* Relative to the start of the sample data */
+  uint64_t offset;
+  uint64_t timestamp_ns;
+  uint32_t sequence;
+  uint32_t len;
+};
+
+struct recorder {
+  int fd;
+  bool direct;
+
+  struct rec_header *header;
+  uint8_t *fill;
+
+  /* Filled by the capture thread, written to
+   * the file by the writer thread */
+  struct sample_ring ring;
+  pthread_t thread;
+  _Atomic bool failed;
+
+  /* Written by the capture thread.
+   * Bytes queued so far, the offset of the next entry */
+  uint64_t queued;
+  struct rec_index_entry *index;
+  size_t index_count;
+  size_t index_alloc;
+};
+
+bool rec_open(struct recorder *rec, const char *path, struct sdr *dev,
+              uint32_t channel, uint32_t num_channels,
+              uint32_t sample_rate, uint32_t center_freq);
+bool rec_write(struct recorder *rec, const void *samples, size_t len,
+               uint32_t sequence, uint64_t timestamp_ns);
+bool rec_pad(struct recorder *rec, uint64_t len, uint8_t value, uint32_t sequence);
+void rec_set_sync_offset(struct recorder *rec, int64_t sample, float delay);
+bool rec_close(struct recorder *rec);
+
+bool rec_read_header(int fd, struct rec_header *header);
@@ -21,11 +21,16 @@
 /* This tool displays a spectrum for
  * the connected sdr devices to
  * help you find out which /dev/swradio?
- * is connected to which antenna */
+ * is connected to which antenna.
+ * Other devices may be passed as arguments,
+ * see sdr_open.
+ * Below every spectrum the capture and fft
+ * statistics of the device are shown. */
 
 #define NUM_SDRS (4)
 #define SCREEN_WIDTH (128)
 #define SCREEN_ROWS (12)
+#define CAPTURE_RING_LEN (1<<22)
 
 #include <pthread.h>
 #include <stdio.h>
@@ -39,24 +44,55 @@
 #include <math.h>
 
 #include "sdr.h"
+#include "capture_thread.h"
 #include "fft_thread.h"
+#include "stats.h"
 
 inline float squared(float x)
 {
   return(x*x);
 }
 
-int main(__attribute__((unused)) int argc, __attribute__((unused))char **argv)
+static void print_stats(struct capture_thread *cap, struct fft_thread *fft)
+{
+  struct st_report rep= {0};
+
+  ct_get_stats(cap, &rep);
+  ft_get_stats(fft, &rep);
+
+  if (rep.ring_len) {
+    printf("capture: %lu buffers, %lu dropped in %lu gaps, %lu skipped, %lu lost sync, "
+           "%lu overruns, ring %.1f%% (max %.1f%%), dequeue p50 %.0fus p99 %.0fus\n",
+           rep.capture_buffers, rep.capture_dropped, rep.capture_gaps,
+           rep.capture_skipped, rep.capture_lost_sync, rep.ring_overruns,
+           100.0 * rep.ring_fill / rep.ring_len, 100.0 * rep.ring_fill_max / rep.ring_len,
+           st_percentile_us(&rep.dequeue, 0.5), st_percentile_us(&rep.dequeue, 0.99));
+  }
+
+  printf("fft: %lu frames, %lu/%lu buffers in use (max %lu), "
+         "load p99 %.0fus, compute p99 %.0fus, latency p50 %.0fus p99 %.0fus\n",
+         rep.fft_frames, rep.fft_in_use, rep.fft_buffers, rep.fft_in_use_max,
+         st_percentile_us(&rep.fft_load, 0.99), st_percentile_us(&rep.fft_compute, 0.99),
+         st_percentile_us(&rep.fft_latency, 0.5), st_percentile_us(&rep.fft_latency, 0.99));
+}
+
+int main(int argc, char **argv)
 {
   struct {
     struct sdr sdr;
+    struct capture_thread cap;
     struct fft_thread fft;
     char path[128];
     double amplitudes[SCREEN_WIDTH];
   } devices[NUM_SDRS]= {0};
 
   for (int i=0; i<NUM_SDRS; i++) {
-    sprintf(devices[i].path, "/dev/swradio%d", i);
+    if (i + 1 < argc) {
+      snprintf(devices[i].path, sizeof(devices[i].path), "%s", argv[i + 1]);
+    }
+    else {
+      sprintf(devices[i].path, "/dev/swradio%d", i);
+    }
 
     fprintf(stderr, "Open dev %s\n", devices[i].path);
 
@@ -72,8 +108,12 @@ int main(__attribute__((unused)) int argc, __attribute__((unused))char **argv)
       return(1);
     }
 
-    if(!ft_setup(&devices[i].fft, &devices[i].sdr, NULL,
-                 SCREEN_WIDTH, 32, 1, true)) {
+    if(!ct_setup(&devices[i].cap, &devices[i].sdr, CAPTURE_RING_LEN)) {
+      return(1);
+    }
+
+    if(!ft_setup(&devices[i].fft, &devices[i].cap, NULL,
+                 SCREEN_WIDTH, 32, 4, 1, true)) {
       return(1);
     }
   }
@@ -84,6 +124,10 @@ int main(__attribute__((unused)) int argc, __attribute__((unused))char **argv)
     if(!sdr_start(&devices[i].sdr)) {
       return(1);
     }
+
+    if(!ct_start(&devices[i].cap)) {
+      return(1);
+    }
   }
 
   for (int i=0; i<NUM_SDRS; i++) {
@@ -159,6 +203,8 @@ int main(__attribute__((unused)) int argc, __attribute__((unused))char **argv)
 
           fputc('\n', stdout);
         }
+
+        print_stats(&devices[i].cap, &devices[i].fft);
       }
     }
   }
@@ -0,0 +1,60 @@
+/*
+ * Copyright 2016 Leonard Göhrs <leonard@goehrs.eu>
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+
+#pragma once
+
+#include <stdint.h>
+
+/* Wire format of the rtl_tcp protocol.
+ * The server greets with a 12 byte header
+ * ("RTL0", tuner type, gain count, all big endian)
+ * and then streams interleaved u8 IQ samples.
+ * The client sends 5 byte commands (command byte,
+ * big endian parameter). */
+
+#define RTL_TCP_MAGIC "RTL0"
+#define RTL_TCP_HEADER_LEN (12)
+#define RTL_TCP_CMD_LEN (5)
+
+#define RTL_TCP_SET_FREQ (0x01)
+#define RTL_TCP_SET_SAMPLE_RATE (0x02)
+#define RTL_TCP_SET_GAIN_MODE (0x03)
+#define RTL_TCP_SET_GAIN (0x04)
+#define RTL_TCP_SET_FREQ_CORRECTION (0x05)
+
+static inline void rtl_tcp_pack_u32(uint8_t *dst, uint32_t val)
+{
+  dst[0]= val >> 24;
+  dst[1]= val >> 16;
+  dst[2]= val >> 8;
+  dst[3]= val;
+}
+
+static inline uint32_t rtl_tcp_unpack_u32(const uint8_t *src)
+{
+  return(((uint32_t)src[0] << 24) | ((uint32_t)src[1] << 16) |
+         ((uint32_t)src[2] << 8) | src[3]);
+}
+
+static inline void rtl_tcp_pack_command(uint8_t *dst, uint8_t cmd, uint32_t param)
+{
+  dst[0]= cmd;
+  rtl_tcp_pack_u32(dst + 1, param);
+}
@@ -0,0 +1,256 @@
+/*
+ * Copyright 2016 Leonard Göhrs <leonard@goehrs.eu>
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+
+#include <string.h>
+
+#include "sample_ring.h"
+
+static size_t round_pow2(size_t len)
+{
+  size_t pow2= 1;
+
+  while (pow2 < len) pow2<<= 1;
+
+  return(pow2);
+}
+
+bool sr_init(struct sample_ring *sr, size_t len)
+{
+  if (!sr || !len) {
+    fprintf(stderr, "sr_init: No ring structure or zero length\n");
+    return(false);
+  }
+
+  /* Power of two lengths allow cheap index masking
+   * and guarantee that the ring never wraps in
+   * the middle of a sample.
+   * Larger rings are page aligned, so that they can
+   * be written to disk with O_DIRECT */
+  sr->len= round_pow2(len);
+  sr->buf= aligned_alloc((sr->len >= SR_PAGE_LEN) ? SR_PAGE_LEN : 64, sr->len);
+
+  if (!sr->buf) {
+    fprintf(stderr, "sr_init: Allocating ring of %ld bytes failed\n", sr->len);
+    return(false);
+  }
+
+  atomic_init(&sr->closed, false);
+
+  atomic_init(&sr->head, 0);
+  atomic_init(&sr->overruns, 0);
+  fe_init(&sr->readable);
+
+  atomic_init(&sr->tail, 0);
+  sr->peekpos= 0;
+  fe_init(&sr->writable);
+
+  return(true);
+}
+
+bool sr_destroy(struct sample_ring *sr)
+{
+  if (!sr || !sr->buf) {
+    fprintf(stderr, "sr_destroy: No ring structure\n");
+    return(false);
+  }
+
+  free(sr->buf);
+  sr->buf= NULL;
+
+  return(true);
+}
+
+/**
+ * Mark the ring as closed. Blocked readers and
+ * writers are woken up, readers may still drain
+ * the remaining data.
+ */
+void sr_close(struct sample_ring *sr)
+{
+  atomic_store(&sr->closed, true);
+
+  fe_notify(&sr->readable);
+  fe_notify(&sr->writable);
+}
+
+/**
+ * Copy len bytes into the ring.
+ * Blocks while the ring is full.
+ *
+ * @return false if the ring was closed
+ */
+bool sr_write(struct sample_ring *sr, const void *src, size_t len)
+{
+  const uint8_t *src_bytes= src;
+  uint64_t head= atomic_load_explicit(&sr->head, memory_order_relaxed);
+  bool waited= false;
+
+  while (len) {
+    uint64_t tail= atomic_load_explicit(&sr->tail, memory_order_acquire);
+    size_t space= sr->len - (head - tail);
+
+    if (!space) {
+      uint32_t seq= fe_prepare(&sr->writable);
+
+      if (atomic_load(&sr->closed)) {
+        fe_cancel(&sr->writable);
+        return(false);
+      }
+
+      if (atomic_load(&sr->tail) != tail) {
+        fe_cancel(&sr->writable);
+      }
+      else {
+        if (!waited) {
+          atomic_fetch_add_explicit(&sr->overruns, 1, memory_order_relaxed);
+          waited= true;
+        }
+
+        fe_wait(&sr->writable, seq);
+      }
+
+      continue;
+    }
+
+    size_t offset= head & (sr->len - 1);
+    size_t chunk= sr->len - offset;
+
+    if (chunk > space) chunk= space;
+    if (chunk > len) chunk= len;
+
+    memcpy(sr->buf + offset, src_bytes, chunk);
+
+    src_bytes+= chunk;
+    len-= chunk;
+    head+= chunk;
+
+    atomic_store_explicit(&sr->head, head, memory_order_release);
+    fe_notify(&sr->readable);
+  }
+
+  return(true);
+}
+
+/**
+ * Copy len bytes into the ring if there is
+ * space for all of them, without blocking.
+ *
+ * @return false if the ring is full or was closed
+ */
+bool sr_try_write(struct sample_ring *sr, const void *src, size_t len)
+{
+  uint64_t head= atomic_load_explicit(&sr->head, memory_order_relaxed);
+  uint64_t tail= atomic_load_explicit(&sr->tail, memory_order_acquire);
+
+  if (atomic_load(&sr->closed) || sr->len - (head - tail) < len) {
+    return(false);
+  }
+
+  /* There is only one producer, so this does not block */
+  return(sr_write(sr, src, len));
+}
+
+/**
+ * Get a pointer to the next bytes in the ring.
+ * Blocks until data is available.
+ *
+ * @return the number of contiguous bytes that may be read
+ *         or -1 if the ring is closed and empty
+ */
+ssize_t sr_peek(struct sample_ring *sr, size_t len, void **samples)
+{
+  uint64_t tail= atomic_load_explicit(&sr->tail, memory_order_relaxed);
+  uint64_t head;
+
+  for(;;) {
+    head= atomic_load_explicit(&sr->head, memory_order_acquire);
+
+    if (head != tail) break;
+
+    uint32_t seq= fe_prepare(&sr->readable);
+
+    if (atomic_load(&sr->head) != tail) {
+      fe_cancel(&sr->readable);
+    }
+    else if (atomic_load(&sr->closed)) {
+      fe_cancel(&sr->readable);
+      return(-1);
+    }
+    else {
+      fe_wait(&sr->readable, seq);
+    }
+  }
+
+  size_t offset= tail & (sr->len - 1);
+  size_t avail= head - tail;
+  size_t contig= sr->len - offset;
+
+  size_t len_trunc= len;
+  if (len_trunc > avail) len_trunc= avail;
+  if (len_trunc > contig) len_trunc= contig;
+
+  if (samples) *samples= sr->buf + offset;
+  sr->peekpos= tail + len_trunc;
+
+  return(len_trunc);
+}
+
+/**
+ * Mark the last peeked bytes as done.
+ * The pointer returned by peek is no longer valid after marking it done.
+ */
+bool sr_done(struct sample_ring *sr)
+{
+  atomic_store_explicit(&sr->tail, sr->peekpos, memory_order_release);
+  fe_notify(&sr->writable);
+
+  return(true);
+}
+
+bool sr_seek(struct sample_ring *sr, size_t len)
+{
+  while(len) {
+    ssize_t rd= sr_peek(sr, len, NULL);
+
+    if (rd<0) {
+      return (false);
+    }
+
+    sr_done(sr);
+
+    len-= rd;
+  }
+
+  return (true);
+}
+
+size_t sr_fill(struct sample_ring *sr)
+{
+  uint64_t tail= atomic_load_explicit(&sr->tail, memory_order_relaxed);
+  uint64_t head= atomic_load_explicit(&sr->head, memory_order_relaxed);
+
+  return(head - tail);
+}
@@ -0,0 +1,66 @@
+/*
+ * Copyright 2016 Leonard Göhrs <leonard@goehrs.eu>
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+
+#include <sys/types.h>
+
+#include "futex_event.h"
+
+#define SR_PAGE_LEN (4096)
+
+/* A lock-free single producer/single consumer
+ * byte ring.
+ * The producer pushes data using sr_write, the consumer
+ * uses the same peek/done interface that is also
+ * provided by the sdr devices. */
+struct sample_ring {
+  uint8_t *buf;
+  size_t len;
+
+  _Atomic bool closed;
+
+  /* Written by the producer */
+  _Alignas(64) _Atomic uint64_t head;
+  _Atomic uint64_t overruns;
+  struct futex_event readable;
+
+  /* Written by the consumer */
+  _Alignas(64) _Atomic uint64_t tail;
+  uint64_t peekpos;
+  struct futex_event writable;
+};
+
+bool sr_init(struct sample_ring *sr, size_t len);
+bool sr_destroy(struct sample_ring *sr);
+void sr_close(struct sample_ring *sr);
+
+bool sr_write(struct sample_ring *sr, const void *src, size_t len);
+bool sr_try_write(struct sample_ring *sr, const void *src, size_t len);
+
+ssize_t sr_peek(struct sample_ring *sr, size_t len, void **samples);
+bool sr_done(struct sample_ring *sr);
+bool sr_seek(struct sample_ring *sr, size_t len);
+
+size_t sr_fill(struct sample_ring *sr);
@@ -17,6 +17,7 @@
  * Boston, MA 02110-1301, USA.
  */
 
+
 #include "sdr.h"
 
 #include <stdio.h>
@@ -26,243 +27,184 @@
 
 #include <errno.h>
 #include <string.h>
-#include <sys/mman.h>
-#include <sys/ioctl.h>
-#include <fcntl.h>
-#include <unistd.h>
-
-#include <libv4l2.h>
-#include <linux/videodev2.h>
-
-static bool ioctl_irqsafe(int fh, unsigned long int request, void *arg)
-{
-  int ret;
+#include <time.h>
 
-  do {
-    ret = v4l2_ioctl(fh, request, arg);
-  } while (ret == -1 && ((errno == EINTR) || (errno == EAGAIN)));
+static const struct sdr_ops *sdr_backends[]= {
+  &sdr_v4l2_ops,
+  &sdr_file_ops,
+  &sdr_synth_ops,
+  &sdr_rtltcp_ops,
+  NULL
+};
 
-  return(ret >= 0);
-}
-
-bool sdr_open(struct sdr *sdr, char *path)
+/**
+ * Open a device.
+ *
+ * @param path "<backend>:<args>", e.g. "file:/tmp/rec0.sofirec",
+ *        "synth:seed=1" or "rtl_tcp:localhost:1234".
+ *        Everything without a known backend prefix is
+ *        opened as a V4L2 device.
+ */
+bool sdr_open(struct sdr *sdr, const char *path)
 {
-  struct v4l2_format fmt;
-
   if (!sdr || !path) {
     fprintf(stderr, "sdr_open: No sdr structure or device path\n");
     return (false);
   }
 
-  sdr->dev_path= strdup(path);
-  if (!sdr->dev_path) {
-    fprintf(stderr, "sdr_open: string allocation failed\n");
-    return (false);
-  }
+  memset(sdr, 0, sizeof(*sdr));
+  sdr->fd= -1;
 
-  sdr->fd= open(sdr->dev_path, O_RDWR);
-  if (sdr->fd < 0) {
-    fprintf(stderr, "sdr_open: open(%s) failed (%s)\n",
-            sdr->dev_path, strerror(errno));
+  const char *args= path;
+  sdr->ops= &sdr_v4l2_ops;
 
-    return (false);
-  }
+  for (size_t bi=0; sdr_backends[bi]; bi++) {
+    size_t name_len= strlen(sdr_backends[bi]->name);
 
-  // Set the desired sample format to unsigned 8 bit
-  memset(&fmt, 0, sizeof(fmt));
-  fmt.type= V4L2_BUF_TYPE_SDR_CAPTURE;
-  fmt.fmt.sdr.pixelformat= V4L2_PIX_FMT_SDR_U8;
+    if (!strncmp(path, sdr_backends[bi]->name, name_len) && path[name_len] == ':') {
+      sdr->ops= sdr_backends[bi];
+      args= path + name_len + 1;
 
-  if (!ioctl_irqsafe(sdr->fd, VIDIOC_S_FMT, &fmt)) {
-    fprintf(stderr, "sdr_open: ioctl failed %d, %s\n", errno, strerror(errno));
-    return (false);
+      break;
+    }
   }
 
-  if (fmt.fmt.sdr.pixelformat != V4L2_PIX_FMT_SDR_U8) {
-    fprintf(stderr,
-            "sdr_open: could not get desired pixel format "
-            "ioctl returned format %c%c%c%c\n",
-            (fmt.fmt.sdr.pixelformat >> 0) & 0xff,
-            (fmt.fmt.sdr.pixelformat >> 8) & 0xff,
-            (fmt.fmt.sdr.pixelformat >> 16) & 0xff,
-            (fmt.fmt.sdr.pixelformat >> 24) & 0xff);
+  sdr->format= sdr->ops->format;
+  atomic_init(&sdr->samp_rate, 0);
 
+  sdr->dev_path= strdup(path);
+  if (!sdr->dev_path) {
+    fprintf(stderr, "sdr_open: string allocation failed\n");
     return (false);
   }
 
-  return (true);
+  return(sdr->ops->open(sdr, args));
 }
 
-bool sdr_connect_buffers(struct sdr *sdr, uint32_t bufs_count)
+/**
+ * Find the value of key in a "key=value,key=value"
+ * argument string. Returns NULL if key is not set.
+ * Used by the backends to parse their arguments.
+ */
+const char *sdr_arg(const char *args, const char *key)
 {
-  struct v4l2_requestbuffers req;
-  struct v4l2_buffer buf;
+  size_t key_len= strlen(key);
 
-  if (!sdr || sdr->fd < 0 || sdr->buffers) {
-    fprintf(stderr, "sdr_connect_buffers: No sdr structure, device not open "
-            "or buffers already set\n");
+  for (const char *pos= args; pos && *pos; ) {
+    if (!strncmp(pos, key, key_len) && pos[key_len] == '=') {
+      return(pos + key_len + 1);
+    }
 
-    return (false);
+    pos= strchr(pos, ',');
+    if (pos) pos++;
   }
 
-  memset(&req, 0, sizeof(req));
-  req.count= bufs_count;
-  req.type= V4L2_BUF_TYPE_SDR_CAPTURE;
-  req.memory= V4L2_MEMORY_MMAP;
-
-  // Ask the v4l kernel code to prepare bufs_count buffers for us
-  if (!ioctl_irqsafe(sdr->fd, VIDIOC_REQBUFS, &req)) {
-    fprintf(stderr, "sdr_connect_buffers: ioctl failed %d, %s\n", errno, strerror(errno));
-    return (false);
-  }
+  return(NULL);
+}
 
-  sdr->buffers= calloc(bufs_count, sizeof(*sdr->buffers));
-  if (!sdr->buffers) {
-    fprintf(stderr, "sdr_connect_buffers: buffer list allocation failed\n");
-    return (false);
-  }
+/**
+ * Assign the next sequence number and the current
+ * time to the buffer that is about to be read.
+ * For backends that do not get them from the device.
+ */
+void sdr_stamp_buffer(struct sdr *sdr)
+{
+  struct timespec ts;
 
-  // Retreive the bufs_count buffers from the kernel
-  for (uint32_t bidx=0; bidx < req.count; bidx++) {
-    memset(&buf, 0, sizeof(buf));
-    buf.type= V4L2_BUF_TYPE_SDR_CAPTURE;
-    buf.memory= V4L2_MEMORY_MMAP;
-    buf.index= bidx;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
 
-    if (!ioctl_irqsafe(sdr->fd, VIDIOC_QUERYBUF, &buf)) {
-      fprintf(stderr, "sdr_connect_buffers: ioctl failed %d, %s\n", errno, strerror(errno));
-      return (false);
-    }
+  sdr->buffer_reader.sequence++;
+  sdr->buffer_reader.timestamp_ns= ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
 
-    sdr->buffers[bidx].len= buf.length;
-    sdr->buffers[bidx].start=
-      v4l2_mmap(NULL, buf.length, PROT_READ | PROT_WRITE, MAP_SHARED, sdr->fd, buf.m.offset);
+uint32_t sdr_caps(struct sdr *sdr)
+{
+  return(sdr->ops->caps);
+}
 
-    if (sdr->buffers[bidx].start == MAP_FAILED) {
-      fprintf(stderr, "sdr_connect_buffers: mmap failed\n");
-      return (false);
-    }
-  }
+enum sdr_format sdr_format(struct sdr *sdr)
+{
+  return(sdr->format);
+}
 
-  // Queue the received buffers as available
-  for (uint32_t bidx=0; bidx < req.count; bidx++) {
-    memset(&buf, 0, sizeof(buf));
-    buf.type = V4L2_BUF_TYPE_SDR_CAPTURE;
-    buf.memory = V4L2_MEMORY_MMAP;
-    buf.index = bidx;
+/**
+ * Bytes per complex sample
+ */
+size_t sdr_sample_size(enum sdr_format format)
+{
+  return(format == SDR_FORMAT_CU16LE ? 4 : 2);
+}
 
-    if (!ioctl_irqsafe(sdr->fd, VIDIOC_QBUF, &buf)) {
-      fprintf(stderr, "sdr_connect_buffers: ioctl failed %d, %s\n", errno, strerror(errno));
-      return (false);
-    }
+bool sdr_connect_buffers(struct sdr *sdr, uint32_t bufs_count)
+{
+  if (!sdr || !sdr->ops) {
+    fprintf(stderr, "sdr_connect_buffers: No sdr structure or device not open\n");
+    return (false);
   }
 
-  sdr->bufs_count= bufs_count;
-
-  return (true);
+  return(sdr->ops->connect_buffers(sdr, bufs_count));
 }
 
 bool sdr_start(struct sdr *sdr)
 {
-  enum v4l2_buf_type type;
-
-  if (!sdr || sdr->fd < 0) {
-    fprintf(stderr, "sdr_start: missing sdr struct or fd is closed\n");
-    return(false);
-  }
-
-  type= V4L2_BUF_TYPE_SDR_CAPTURE;
-
-  if (!ioctl_irqsafe(sdr->fd, VIDIOC_STREAMON, &type)) {
-    fprintf(stderr, "sdr_start: ioctl failed %d, %s\n", errno, strerror(errno));
+  if (!sdr || !sdr->ops) {
+    fprintf(stderr, "sdr_start: No sdr structure or device not open\n");
     return (false);
   }
 
-  return (true);
+  return(sdr->ops->start(sdr));
 }
 
 bool sdr_set_sample_rate(struct sdr *sdr, uint32_t samp_rate)
 {
-  if (!sdr || sdr->fd < 0) {
-    fprintf(stderr, "sdr_set_sample_rate: missing sdr struct or fd is closed\n");
-    return(false);
+  if (!sdr || !sdr->ops) {
+    fprintf(stderr, "sdr_set_sample_rate: No sdr structure or device not open\n");
+    return (false);
   }
 
-  struct v4l2_frequency frequency= {0};
-  frequency.tuner = 0;
-  frequency.type = V4L2_TUNER_ADC;
-  frequency.frequency = samp_rate;
-
-  if (!ioctl_irqsafe(sdr->fd, VIDIOC_S_FREQUENCY, &frequency)) {
-    fprintf(stderr, "sdr_set_sample_rate: ioctl failed %d, %s\n",
-            errno, strerror(errno));
-
+  if (!sdr->ops->set_sample_rate(sdr, samp_rate)) {
     return(false);
   }
 
+  atomic_store_explicit(&sdr->samp_rate, samp_rate, memory_order_relaxed);
+
   return(true);
 }
 
 bool sdr_set_center_freq(struct sdr *sdr, uint32_t freq)
 {
-  if (!sdr || sdr->fd < 0) {
-    fprintf(stderr, "sdr_set_center_freq: missing sdr struct or fd is closed\n");
-    return(false);
-  }
-
-  struct v4l2_frequency frequency= {0};
-  frequency.tuner = 1;
-  frequency.type = V4L2_TUNER_RF;
-  frequency.frequency = freq;
-
-  if (!ioctl_irqsafe(sdr->fd, VIDIOC_S_FREQUENCY, &frequency)) {
-    fprintf(stderr, "sdr_set_center_freq: ioctl failed %d, %s\n",
-            errno, strerror(errno));
-
-    return(false);
+  if (!sdr || !sdr->ops) {
+    fprintf(stderr, "sdr_set_center_freq: No sdr structure or device not open\n");
+    return (false);
   }
 
-  return(true);
+  return(sdr->ops->set_center_freq(sdr, freq));
 }
 
 bool sdr_stop(struct sdr *sdr)
 {
-  enum v4l2_buf_type type;
-
-  if (!sdr || sdr->fd < 0) {
-    fprintf(stderr, "sdr_stop: missing sdr struct or fd is closed\n");
-    return(false);
-  }
-
-  type= V4L2_BUF_TYPE_SDR_CAPTURE;
-
-  if (!ioctl_irqsafe(sdr->fd, VIDIOC_STREAMOFF, &type)) {
-    fprintf(stderr, "sdr_stop: ioctl failed %d, %s\n", errno, strerror(errno));
+  if (!sdr || !sdr->ops) {
+    fprintf(stderr, "sdr_stop: No sdr structure or device not open\n");
     return (false);
   }
 
-  return (true);
+  return(sdr->ops->stop(sdr));
 }
 
 bool sdr_destroy(struct sdr *sdr)
 {
-  if (!sdr || sdr->fd < 0 || (sdr->bufs_count && !sdr->buffers)) {
-    fprintf(stderr, "sdr_close: missing sdr struct or fd is closed\n");
-    return(false);
+  if (!sdr || !sdr->ops) {
+    fprintf(stderr, "sdr_destroy: No sdr structure or device not open\n");
+    return (false);
   }
 
-  for (uint32_t bidx= 0; bidx < sdr->bufs_count; bidx++) {
-    v4l2_munmap(sdr->buffers[bidx].start, sdr->buffers[bidx].len);
-  }
+  bool ret= sdr->ops->destroy(sdr);
 
-  if (sdr->buffers) {
-    free(sdr->buffers);
-  }
-
-  v4l2_close(sdr->fd);
   free(sdr->dev_path);
+  sdr->dev_path= NULL;
+  sdr->ops= NULL;
 
-  return(true);
+  return(ret);
 }
 
 /**
@@ -275,55 +217,12 @@ bool sdr_destroy(struct sdr *sdr)
  */
 ssize_t sdr_peek(struct sdr *sdr, size_t len, void **samples)
 {
-  if (!sdr || sdr->fd < 0 || !sdr->buffers) {
-    fprintf(stderr, "sdr_peek: missing sdr struct or fd is closed\n");
-    return(-1);
-  }
-
-  // check if there is already a buffer being read from
-  if (!sdr->buffer_reader.opened) {
-    struct v4l2_buffer buf;
-
-    memset(&buf, 0, sizeof(buf));
-    buf.type= V4L2_BUF_TYPE_SDR_CAPTURE;
-    buf.memory = V4L2_MEMORY_MMAP;
-
-    if(!ioctl_irqsafe(sdr->fd, VIDIOC_DQBUF, &buf)) {
-      fprintf(stderr, "sdr_peek: ioctl failed %d, %s\n", errno, strerror(errno));
-      return(-1);
-    }
-
-    sdr->buffer_reader.opened= true;
-
-    sdr->buffer_reader.bufnum= buf.index;
-    sdr->buffer_reader.rdpos= 0;
-    sdr->buffer_reader.peekpos= 0;
-  }
-
-  uint32_t bufnum= sdr->buffer_reader.bufnum;
-  uint32_t rdpos= sdr->buffer_reader.rdpos;
-
-  if (bufnum > sdr->bufs_count) {
-    fprintf(stderr,
-            "sdr_peek: illegal bufnum index (%d/%d)\n",
-            bufnum, sdr->bufs_count);
-
-    return (-1);
-  }
-
-  if (rdpos > sdr->buffers[bufnum].len) {
-    fprintf(stderr, "sdr_peek: buffer empty?\n");
-
+  if (!sdr || !sdr->ops) {
+    fprintf(stderr, "sdr_peek: No sdr structure or device not open\n");
     return (-1);
   }
 
-  size_t len_rem= sdr->buffers[bufnum].len - rdpos;
-  size_t len_trunc= len_rem < len ? len_rem : len;
-
-  if(samples) *samples= (uint8_t *)sdr->buffers[bufnum].start + rdpos;
-  sdr->buffer_reader.peekpos+= len_trunc;
-
-  return(len_trunc);
+  return(sdr->ops->peek(sdr, len, samples));
 }
 
 /**
@@ -332,52 +231,25 @@ ssize_t sdr_peek(struct sdr *sdr, size_t len, void **samples)
  */
 bool sdr_done(struct sdr *sdr)
 {
-  if (!sdr || sdr->fd < 0 || !sdr->buffers) {
-    fprintf(stderr, "sdr_peek: missing sdr struct or buffers\n");
-    return(-1);
-  }
-
-  if (!sdr->buffer_reader.opened) {
-    fprintf(stderr, "sdr_peek: buffer_reader not open. Peek was not called before\n");
-    return(-1);
+  if (!sdr || !sdr->ops) {
+    fprintf(stderr, "sdr_done: No sdr structure or device not open\n");
+    return (false);
   }
 
-  sdr->buffer_reader.rdpos= sdr->buffer_reader.peekpos;
-
-  size_t rdpos= sdr->buffer_reader.rdpos;
-  uint32_t bufnum= sdr->buffer_reader.bufnum;
+  return(sdr->ops->done(sdr));
+}
 
-  if (rdpos > sdr->buffers[bufnum].len) {
-    fprintf(stderr, "sdr_done: rdpos > buffer_len\n");
+bool sdr_seek(struct sdr *sdr, size_t len)
+{
+  if (!sdr || !sdr->ops) {
+    fprintf(stderr, "sdr_seek: No sdr structure or device not open\n");
     return (false);
   }
 
-  // Check if buffer is empty
-  if (rdpos == sdr->buffers[bufnum].len) {
-    struct v4l2_buffer buf;
-
-    // Requeue this buffer
-    memset(&buf, 0, sizeof(buf));
-    buf.type= V4L2_BUF_TYPE_SDR_CAPTURE;
-    buf.memory = V4L2_MEMORY_MMAP;
-    buf.index = bufnum;
-
-    if (!ioctl_irqsafe(sdr->fd, VIDIOC_QBUF, &buf)) {
-      fprintf(stderr, "sdr_done: ioctl failed %d, %s\n", errno, strerror(errno));
-      return (false);
-    }
-
-    /* Mark the reader as closed an make
-     * accidential accesses break horribly */
-    sdr->buffer_reader.opened= false;
-    sdr->buffer_reader.bufnum= (uint32_t) -1;
+  if (sdr->ops->seek) {
+    return(sdr->ops->seek(sdr, len));
   }
 
-  return(true);
-}
-
-bool sdr_seek(struct sdr *sdr, size_t len)
-{
   while(len) {
     ssize_t rd= sdr_peek(sdr, len, NULL);
 
@@ -385,7 +257,9 @@ bool sdr_seek(struct sdr *sdr, size_t len)
       return (false);
     }
 
-    sdr_done(sdr);
+    if (!sdr_done(sdr)) {
+      return (false);
+    }
 
     len-= rd;
   }
@@ -17,19 +17,76 @@
  * Boston, MA 02110-1301, USA.
  */
 
+
 #pragma once
 
 #include <stdint.h>
 #include <stdbool.h>
 #include <stdlib.h>
+#include <stdatomic.h>
+
+#include <sys/types.h>
 
 #define V4L2_PIX_FMT_SDR_U8     v4l2_fourcc('C', 'U', '0', '8')
 #define V4L2_PIX_FMT_SDR_U16LE  v4l2_fourcc('C', 'U', '1', '6')
 
+/* Sample formats a backend may deliver */
+enum sdr_format {
+  SDR_FORMAT_CU8= 0,      /* interleaved unsigned 8 bit I/Q */
+  SDR_FORMAT_CU16LE= 1,   /* interleaved unsigned 16 bit little endian I/Q */
+};
+
+/* sdr_peek hands out samples without copying them */
+#define SDR_CAP_ZERO_COPY (1 << 0)
+
+/* Samples arrive in real time and are lost if
+ * they are not read in time */
+#define SDR_CAP_LIVE (1 << 1)
+
+/* buffer_reader.timestamp_ns is taken by the device
+ * when the buffer was filled, not when it was read */
+#define SDR_CAP_TIMESTAMPS (1 << 2)
+
+struct sdr;
+
+/* Every backend implements these operations.
+ * seek may be NULL, it is then emulated using peek and done */
+struct sdr_ops {
+  const char *name;
+  uint32_t caps;
+  enum sdr_format format;
+
+  bool (*open)(struct sdr *sdr, const char *args);
+  bool (*connect_buffers)(struct sdr *sdr, uint32_t bufs_count);
+  bool (*start)(struct sdr *sdr);
+  bool (*set_sample_rate)(struct sdr *sdr, uint32_t samp_rate);
+  bool (*set_center_freq)(struct sdr *sdr, uint32_t freq);
+  bool (*stop)(struct sdr *sdr);
+  bool (*destroy)(struct sdr *sdr);
+  ssize_t (*peek)(struct sdr *sdr, size_t len, void **samples);
+  bool (*done)(struct sdr *sdr);
+  bool (*seek)(struct sdr *sdr, size_t len);
+};
+
+extern const struct sdr_ops sdr_v4l2_ops;
+extern const struct sdr_ops sdr_file_ops;
+extern const struct sdr_ops sdr_synth_ops;
+extern const struct sdr_ops sdr_rtltcp_ops;
+
 struct sdr {
+  const struct sdr_ops *ops;
+
   char *dev_path;
   int fd;
 
+  /* Initialized from ops->format, backends that
+   * learn the format on open may change it */
+  enum sdr_format format;
+
+  /* Last sample rate set using sdr_set_sample_rate, 0 before.
+   * Read by the capture thread */
+  _Atomic uint32_t samp_rate;
+
   struct {
     size_t len;
     void *start;
@@ -42,10 +99,24 @@ struct sdr {
     uint32_t bufnum;
     size_t rdpos;
     size_t peekpos;
+
+    /* Of the buffer that is currently read from.
+     * Backends without own metadata count the buffers
+     * and use the time they were received */
+    uint32_t sequence;
+    uint64_t timestamp_ns;
   } buffer_reader;
+
+  /* Backend specific state */
+  void *priv;
 };
 
-bool sdr_open(struct sdr *sdr, char *path);
+bool sdr_open(struct sdr *sdr, const char *path);
+const char *sdr_arg(const char *args, const char *key);
+void sdr_stamp_buffer(struct sdr *sdr);
+uint32_t sdr_caps(struct sdr *sdr);
+enum sdr_format sdr_format(struct sdr *sdr);
+size_t sdr_sample_size(enum sdr_format format);
 bool sdr_connect_buffers(struct sdr *sdr, uint32_t bufs_count);
 bool sdr_start(struct sdr *sdr);
 bool sdr_set_sample_rate(struct sdr *sdr, uint32_t samp_rate);
@@ -55,3 +126,5 @@ bool sdr_destroy(struct sdr *sdr);
 bool sdr_done(struct sdr *sdr);
 ssize_t sdr_peek(struct sdr *sdr, size_t len, void **samples);
 bool sdr_seek(struct sdr *sdr, size_t len);
+
+bool sdr_file_sync_delay(struct sdr *sdr, float *delay);
@@ -0,0 +1,266 @@
+/*
+ * Copyright 2016 Leonard Göhrs <leonard@goehrs.eu>
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+
+#include "sdr.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "rtl_tcp.h"
+
+/* Client for the rtl_tcp network protocol.
+ * Arguments: <host>:<port> */
+
+#define RTLTCP_BUFFER_LEN (65536)
+
+struct sdr_rtltcp {
+  /* Bytes received after the last complete IQ pair of
+   * the current buffer. They start the next buffer */
+  size_t carry;
+};
+
+static bool sdr_rtltcp_command(struct sdr *sdr, uint8_t cmd, uint32_t param)
+{
+  uint8_t msg[RTL_TCP_CMD_LEN];
+
+  rtl_tcp_pack_command(msg, cmd, param);
+
+  if (send(sdr->fd, msg, sizeof(msg), MSG_NOSIGNAL) != sizeof(msg)) {
+    fprintf(stderr, "sdr_rtltcp_command: send failed (%s)\n", strerror(errno));
+    return(false);
+  }
+
+  return(true);
+}
+
+static bool sdr_rtltcp_open(struct sdr *sdr, const char *args)
+{
+  char host[256];
+  const char *port= strrchr(args, ':');
+
+  if (!port || (size_t)(port - args) >= sizeof(host)) {
+    fprintf(stderr, "sdr_open: expected rtl_tcp:<host>:<port>\n");
+    return (false);
+  }
+
+  memcpy(host, args, port - args);
+  host[port - args]= 0;
+  port++;
+
+  struct sdr_rtltcp *tcp= calloc(1, sizeof(*tcp));
+
+  if (!tcp) {
+    fprintf(stderr, "sdr_open: allocating rtl_tcp state failed\n");
+    return (false);
+  }
+
+  sdr->priv= tcp;
+
+  struct addrinfo hints= {0}, *res= NULL;
+  hints.ai_family= AF_UNSPEC;
+  hints.ai_socktype= SOCK_STREAM;
+
+  int err= getaddrinfo(host, port, &hints, &res);
+
+  if (err) {
+    fprintf(stderr, "sdr_open: resolving %s failed (%s)\n", host, gai_strerror(err));
+    return (false);
+  }
+
+  for (struct addrinfo *ai= res; ai; ai= ai->ai_next) {
+    sdr->fd= socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+
+    if (sdr->fd < 0) continue;
+
+    if (connect(sdr->fd, ai->ai_addr, ai->ai_addrlen) == 0) break;
+
+    close(sdr->fd);
+    sdr->fd= -1;
+  }
+
+  freeaddrinfo(res);
+
+  if (sdr->fd < 0) {
+    fprintf(stderr, "sdr_open: connecting to %s failed\n", args);
+    return (false);
+  }
+
+  uint8_t hdr[RTL_TCP_HEADER_LEN];
+
+  if (recv(sdr->fd, hdr, sizeof(hdr), MSG_WAITALL) != sizeof(hdr) ||
+      memcmp(hdr, RTL_TCP_MAGIC, 4)) {
+    fprintf(stderr, "sdr_open: %s is not a rtl_tcp server\n", args);
+    return (false);
+  }
+
+  fprintf(stderr, "sdr_open: connected to rtl_tcp server %s\n", args);
+
+  return (true);
+}
+
+static bool sdr_rtltcp_connect_buffers(struct sdr *sdr, uint32_t bufs_count)
+{
+  if (!sdr || !bufs_count || sdr->buffers) {
+    fprintf(stderr, "sdr_connect_buffers: No sdr structure or bufs_count is zero\n");
+    return (false);
+  }
+
+  sdr->buffers= calloc(1, sizeof(*sdr->buffers));
+  if (!sdr->buffers) {
+    fprintf(stderr, "sdr_connect_buffers: Meta Buffer allocation failed\n");
+    return (false);
+  }
+
+  sdr->buffers[0].start= malloc(RTLTCP_BUFFER_LEN);
+  if(!sdr->buffers[0].start) {
+    fprintf(stderr, "sdr_connect_buffers: Buffer allocation failed\n");
+    return (false);
+  }
+
+  sdr->buffers[0].len= 0;
+  sdr->bufs_count= 1;
+
+  return(true);
+}
+
+static bool sdr_rtltcp_start(struct sdr *sdr)
+{
+  return(sdr != NULL);
+}
+
+static bool sdr_rtltcp_set_sample_rate(struct sdr *sdr, uint32_t samp_rate)
+{
+  return(sdr_rtltcp_command(sdr, RTL_TCP_SET_SAMPLE_RATE, samp_rate));
+}
+
+static bool sdr_rtltcp_set_center_freq(struct sdr *sdr, uint32_t freq)
+{
+  return(sdr_rtltcp_command(sdr, RTL_TCP_SET_FREQ, freq));
+}
+
+static bool sdr_rtltcp_stop(struct sdr *sdr)
+{
+  return(sdr != NULL);
+}
+
+static bool sdr_rtltcp_destroy(struct sdr *sdr)
+{
+  if (sdr->buffers) {
+    free(sdr->buffers->start);
+    free(sdr->buffers);
+  }
+
+  if (sdr->fd >= 0) {
+    close(sdr->fd);
+  }
+
+  free(sdr->priv);
+  sdr->priv= NULL;
+
+  return(true);
+}
+
+static ssize_t sdr_rtltcp_peek(struct sdr *sdr, size_t len, void **samples)
+{
+  if (!sdr || sdr->fd < 0 || !sdr->buffers) {
+    fprintf(stderr, "sdr_peek: missing sdr struct or socket is closed\n");
+    return(-1);
+  }
+
+  if (!sdr->buffer_reader.opened) {
+    struct sdr_rtltcp *tcp= sdr->priv;
+    uint8_t *buf= sdr->buffers[0].start;
+
+    /* A signal or a closing peer may end the wait for a
+     * complete buffer early, possibly in the middle of an IQ
+     * pair. Its first half is kept for the next buffer,
+     * so that I and Q never swap places */
+    if (tcp->carry) {
+      buf[0]= buf[sdr->buffers[0].len];
+    }
+
+    ssize_t rd= recv(sdr->fd, buf + tcp->carry, RTLTCP_BUFFER_LEN - tcp->carry, MSG_WAITALL);
+
+    if (rd <= 0) {
+      fprintf(stderr, "sdr_peek: connection to %s lost\n", sdr->dev_path);
+      return(-1);
+    }
+
+    size_t total= tcp->carry + rd;
+
+    sdr->buffers[0].len= total & ~(size_t)1;
+    tcp->carry= total & 1;
+    sdr_stamp_buffer(sdr);
+
+    sdr->buffer_reader.opened= true;
+    sdr->buffer_reader.bufnum= 0;
+    sdr->buffer_reader.rdpos= 0;
+  }
+
+  size_t rdpos= sdr->buffer_reader.rdpos;
+  size_t len_rem= sdr->buffers[0].len - rdpos;
+  size_t len_trunc= len_rem < len ? len_rem : len;
+
+  if (samples) *samples= (uint8_t *)sdr->buffers[0].start + rdpos;
+  sdr->buffer_reader.peekpos= rdpos + len_trunc;
+
+  return(len_trunc);
+}
+
+static bool sdr_rtltcp_done(struct sdr *sdr)
+{
+  if (!sdr->buffer_reader.opened) {
+    fprintf(stderr, "sdr_done: buffer_reader not open. Peek was not called before\n");
+    return(false);
+  }
+
+  sdr->buffer_reader.rdpos= sdr->buffer_reader.peekpos;
+
+  if (sdr->buffer_reader.rdpos >= sdr->buffers[0].len) {
+    sdr->buffer_reader.opened= false;
+  }
+
+  return(true);
+}
+
+const struct sdr_ops sdr_rtltcp_ops= {
+  .name= "rtl_tcp",
+  .caps= SDR_CAP_LIVE,
+  .format= SDR_FORMAT_CU8,
+
+  .open= sdr_rtltcp_open,
+  .connect_buffers= sdr_rtltcp_connect_buffers,
+  .start= sdr_rtltcp_start,
+  .set_sample_rate= sdr_rtltcp_set_sample_rate,
+  .set_center_freq= sdr_rtltcp_set_center_freq,
+  .stop= sdr_rtltcp_stop,
+  .destroy= sdr_rtltcp_destroy,
+  .peek= sdr_rtltcp_peek,
+  .done= sdr_rtltcp_done,
+};
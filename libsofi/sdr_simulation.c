@@ -17,142 +17,502 @@
  * Boston, MA 02110-1301, USA.
  */
 
+
 #include "sdr.h"
+#include "recorder.h"
 
 #include <stdio.h>
 #include <stdint.h>
 #include <stdbool.h>
 #include <stdlib.h>
+#include <stdatomic.h>
 
 #include <errno.h>
 #include <string.h>
+#include <time.h>
 #include <sys/mman.h>
-#include <sys/ioctl.h>
+#include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
 
-bool sdr_open(struct sdr *sdr, char *path)
+/* The file backend replays recordings made by sofi_record
+ * or raw CU8 captures. The file is mapped into memory and
+ * peek hands out pointers into the mapping.
+ *
+ * Arguments: file:<path>[,speed=<factor>][,loop=1]
+ *
+ * speed=1 (the default) replays at the recorded sample rate,
+ * speed=0 as fast as the consumer reads. loop=1 restarts
+ * the replay at the end of the file instead of failing.
+ *
+ * All replays that are started together share a common
+ * time base and, when looping, a common length. Recordings
+ * start at their sync offset, so the channels of a recording
+ * set are aligned from the first sample on. */
+
+#define FILE_CHUNK_LEN (65536)
+#define FILE_DEFAULT_RATE (2000000)
+
+struct sdr_file {
+  const uint8_t *map;
+  size_t map_len;
+
+  /* The sample data and the part of it that is played */
+  const uint8_t *data;
+  size_t data_len;
+  size_t start;
+
+  /* index is NULL for raw files and
+   * recordings without index entries */
+  bool recording;
+  bool synced;
+  float sync_delay;
+  const struct rec_index_entry *index;
+  size_t index_count;
+  size_t index_start;
+  uint32_t seq_span;
+
+  uint32_t samp_rate;
+  double speed;
+  bool loop;
+
+  /* Read position in data and end of the current
+   * chunk (an index entry or FILE_CHUNK_LEN bytes) */
+  size_t pos;
+  size_t chunk_end;
+  size_t index_pos;
+  size_t peeked;
+
+  /* Bytes handed out since the start, including seeks.
+   * Determines when the next chunk is due */
+  uint64_t played;
+  uint32_t loops;
+};
+
+/* Time base and loop length shared by all running replays */
+static _Atomic uint64_t sdr_file_epoch_ns;
+static _Atomic uint64_t sdr_file_loop_samples;
+static _Atomic uint32_t sdr_file_running;
+
+static uint64_t sdr_file_now_ns(void)
 {
-  if (!sdr || !path) {
-    fprintf(stderr, "sdr_open: No sdr structure or device path\n");
-    return (false);
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return(ts.tv_sec * 1000000000ull + ts.tv_nsec);
+}
+
+static bool sdr_file_map_recording(struct sdr *sdr, struct sdr_file *file)
+{
+  const struct rec_header *hdr= (const struct rec_header *)file->map;
+
+  if (!hdr->index_offset ||
+      hdr->index_offset + hdr->index_count * sizeof(*file->index) > file->map_len ||
+      REC_HEADER_LEN + hdr->data_len > hdr->index_offset) {
+    fprintf(stderr, "sdr_open: recording is incomplete or damaged\n");
+    return(false);
+  }
+
+  sdr->format= hdr->format;
+  file->recording= true;
+
+  file->data= file->map + REC_HEADER_LEN;
+  file->data_len= hdr->data_len;
+  file->samp_rate= hdr->sample_rate;
+
+  /* Without index entries the data is
+   * replayed in fixed size chunks */
+  if (hdr->index_count) {
+    file->index= (const struct rec_index_entry *)(file->map + hdr->index_offset);
+    file->index_count= hdr->index_count;
+    file->seq_span= file->index[file->index_count - 1].sequence - file->index[0].sequence + 1;
+  }
+  else {
+    file->index= NULL;
+    file->index_count= 0;
   }
 
-  sdr->dev_path= strdup(path);
-  if (!sdr->dev_path) {
-    fprintf(stderr, "sdr_open: string allocation failed\n");
+  if (hdr->sync_offset >= 0) {
+    file->start= hdr->sync_offset * sdr_sample_size(sdr->format);
+    file->synced= true;
+    file->sync_delay= hdr->sync_delay;
+  }
+
+  if (file->start >= file->data_len) {
+    fprintf(stderr, "sdr_open: recording ends before the sync offset\n");
+    return(false);
+  }
+
+  while (file->index_start + 1 < file->index_count &&
+         file->index[file->index_start + 1].offset <= file->start) {
+    file->index_start++;
+  }
+
+  fprintf(stderr, "sdr_open: Recording of channel %u/%u, %u S/s, starting at sample %ld%+.3f\n",
+          hdr->channel, hdr->num_channels, hdr->sample_rate, (long)hdr->sync_offset,
+          hdr->sync_delay);
+
+  return(true);
+}
+
+static bool sdr_file_open(struct sdr *sdr, const char *args)
+{
+  struct sdr_file *file= calloc(1, sizeof(*file));
+
+  if (!file) {
+    fprintf(stderr, "sdr_open: allocating file state failed\n");
     return (false);
   }
 
-  sdr->fd= open(sdr->dev_path, O_RDWR);
+  sdr->priv= file;
+
+  const char *speed= sdr_arg(args, "speed");
+  const char *loop= sdr_arg(args, "loop");
+
+  file->speed= speed ? strtod(speed, NULL) : 1.0;
+  file->loop= loop && atoi(loop);
+  file->samp_rate= FILE_DEFAULT_RATE;
+
+  char path[4096];
+  size_t path_len= strcspn(args, ",");
+
+  snprintf(path, sizeof(path), "%.*s", (int)path_len, args);
+
+  sdr->fd= open(path, O_RDONLY);
   if (sdr->fd < 0) {
     fprintf(stderr, "sdr_open: open(%s) failed (%s)\n",
-            sdr->dev_path, strerror(errno));
+            path, strerror(errno));
+
+    return (false);
+  }
+
+  struct stat st;
 
+  if (fstat(sdr->fd, &st) || !st.st_size) {
+    fprintf(stderr, "sdr_open: %s is empty or can not be read\n", path);
     return (false);
   }
 
-  fprintf(stderr, "sdr_open: File %s is used for simulation\n", sdr->dev_path);
+  file->map_len= st.st_size;
+  file->map= mmap(NULL, file->map_len, PROT_READ, MAP_SHARED, sdr->fd, 0);
+
+  if (file->map == MAP_FAILED) {
+    fprintf(stderr, "sdr_open: mmap(%s) failed (%s)\n",
+            path, strerror(errno));
+
+    file->map= NULL;
+    return (false);
+  }
+
+  madvise((void *)file->map, file->map_len, MADV_SEQUENTIAL);
+
+  if (file->map_len >= REC_HEADER_LEN &&
+      !memcmp(file->map, REC_MAGIC, sizeof(((struct rec_header *)0)->magic))) {
+
+    if (!sdr_file_map_recording(sdr, file)) {
+      return (false);
+    }
+  }
+  else {
+    file->data= file->map;
+    file->data_len= file->map_len;
+  }
+
+  fprintf(stderr, "sdr_open: File %s is used for simulation (%s)\n",
+          path, file->speed > 0 ? "paced" : "as fast as possible");
 
   return (true);
 }
 
-bool sdr_connect_buffers(struct sdr *sdr, uint32_t bufs_count)
+static bool sdr_file_connect_buffers(struct sdr *sdr, uint32_t bufs_count)
 {
   if (!sdr || !bufs_count || sdr->buffers) {
     fprintf(stderr, "sdr_connect_buffers: No sdr structure or bufs_count is zero\n");
     return (false);
   }
 
+  struct sdr_file *file= sdr->priv;
+
+  /* The whole recording is a single buffer */
   sdr->buffers= calloc(1, sizeof(*sdr->buffers));
-  if (!sdr->dev_path) {
+  if (!sdr->buffers) {
     fprintf(stderr, "sdr_connect_buffers: Meta Buffer allocation failed\n");
     return (false);
   }
 
-  sdr->buffers[0].start= calloc(1, 65536);
-  if(!sdr->buffers[0].start) {
-    fprintf(stderr, "sdr_connect_buffers: Buffer allocation failed\n");
-    return (false);
-  }
-
-  sdr->buffers[0].len= 65536;
+  sdr->buffers[0].start= (void *)file->data;
+  sdr->buffers[0].len= file->data_len;
   sdr->bufs_count= 1;
 
   return(true);
 }
 
-bool sdr_start(struct sdr *sdr)
+static bool sdr_file_start(struct sdr *sdr)
 {
-  return(sdr != NULL);
+  struct sdr_file *file= sdr->priv;
+
+  file->pos= file->start;
+  file->chunk_end= file->start;
+  file->index_pos= file->index_start;
+  file->played= 0;
+  file->loops= 0;
+
+  /* The shortest recording determines the loop length */
+  uint64_t samples= (file->data_len - file->start) / sdr_sample_size(sdr->format);
+  uint64_t loop_samples= atomic_load(&sdr_file_loop_samples);
+
+  if (!atomic_fetch_add(&sdr_file_running, 1)) {
+    atomic_store(&sdr_file_epoch_ns, 0);
+    atomic_store(&sdr_file_loop_samples, samples);
+  }
+  else {
+    while ((!loop_samples || samples < loop_samples) &&
+           !atomic_compare_exchange_weak(&sdr_file_loop_samples, &loop_samples, samples));
+  }
+
+  return(true);
 }
 
-bool sdr_set_sample_rate(struct sdr *sdr, uint32_t samp_rate)
+static bool sdr_file_set_sample_rate(struct sdr *sdr, uint32_t samp_rate)
 {
-  return(sdr != NULL && samp_rate);
+  struct sdr_file *file= sdr->priv;
+
+  if (!samp_rate) {
+    return(false);
+  }
+
+  /* Recordings are always played at their own rate */
+  if (!file->recording) {
+    file->samp_rate= samp_rate;
+  }
+
+  return(true);
 }
 
-bool sdr_set_center_freq(struct sdr *sdr, uint32_t freq)
+static bool sdr_file_set_center_freq(struct sdr *sdr, uint32_t freq)
 {
   return(sdr != NULL && freq);
 }
 
-bool sdr_stop(struct sdr *sdr)
+static bool sdr_file_stop(struct sdr *sdr)
 {
-  return(sdr != NULL);
+  if (!sdr) {
+    return(false);
+  }
+
+  atomic_fetch_sub(&sdr_file_running, 1);
+
+  return(true);
 }
 
-bool sdr_destroy(struct sdr *sdr)
+static bool sdr_file_destroy(struct sdr *sdr)
 {
   if (!sdr || sdr->fd < 0) {
     fprintf(stderr, "sdr_close: missing sdr struct or fd is closed\n");
     return(false);
   }
 
+  struct sdr_file *file= sdr->priv;
+
+  if (file->map) {
+    munmap((void *)file->map, file->map_len);
+  }
+
   close(sdr->fd);
-  free(sdr->dev_path);
 
-  free(sdr->buffers->start);
   free(sdr->buffers);
+  free(file);
+
+  sdr->buffers= NULL;
+  sdr->priv= NULL;
 
   return(true);
 }
 
-ssize_t sdr_peek(struct sdr *sdr, size_t len, void **samples)
+/**
+ * End of the played part of the data.
+ * While looping all replays use the same length.
+ */
+static size_t sdr_file_end(struct sdr *sdr, struct sdr_file *file)
 {
-  if (!sdr || sdr->fd < 0 || !sdr->buffers || !samples) {
-    fprintf(stderr, "sdr_peek: missing sdr struct or fd is closed\n");
-    return(-1);
+  if (!file->loop) {
+    return(file->data_len);
   }
 
-  size_t alen= (len > sdr->buffers[0].len) ? sdr->buffers[0].len : len;
+  uint64_t loop_samples= atomic_load(&sdr_file_loop_samples);
+
+  return(file->start + loop_samples * sdr_sample_size(sdr->format));
+}
 
-  ssize_t res= read(sdr->fd, sdr->buffers[0].start, alen);
+/**
+ * Move to the chunk that contains pos, wrapping around
+ * at the end. Returns false at the end of a non looping replay.
+ */
+static bool sdr_file_next_chunk(struct sdr *sdr, struct sdr_file *file)
+{
+  size_t end= sdr_file_end(sdr, file);
 
-  if(res > 0) {
-    *samples= sdr->buffers[0].start;
-    return(res);
+  if (file->pos >= end) {
+    if (!file->loop) {
+      return(false);
+    }
+
+    file->pos= file->start + (file->pos - end) % (end - file->start);
+    file->index_pos= file->index_start;
+    file->loops++;
+  }
+
+  if (file->index) {
+    while (file->index_pos + 1 < file->index_count &&
+           file->index[file->index_pos + 1].offset <= file->pos) {
+      file->index_pos++;
+    }
+
+    const struct rec_index_entry *entry= &file->index[file->index_pos];
+
+    file->chunk_end= entry->offset + entry->len;
   }
   else {
+    file->chunk_end= (file->pos / FILE_CHUNK_LEN + 1) * FILE_CHUNK_LEN;
+  }
+
+  if (file->chunk_end > end) {
+    file->chunk_end= end;
+  }
+
+  sdr_stamp_buffer(sdr);
+
+  if (file->index) {
+    sdr->buffer_reader.sequence=
+      file->index[file->index_pos].sequence + file->loops * file->seq_span;
+  }
+
+  return(true);
+}
+
+/**
+ * Wait until the samples up to played + len
+ * would have been received by a real device
+ */
+static void sdr_file_pace(struct sdr *sdr, struct sdr_file *file, size_t len)
+{
+  if (file->speed <= 0) {
+    return;
+  }
+
+  uint64_t epoch= atomic_load(&sdr_file_epoch_ns);
+
+  if (!epoch) {
+    uint64_t now= sdr_file_now_ns();
+
+    epoch= atomic_compare_exchange_strong(&sdr_file_epoch_ns, &epoch, now) ? now : epoch;
+  }
+
+  uint64_t samples= (file->played + len) / sdr_sample_size(sdr->format);
+  uint64_t due= epoch + samples * (1e9 / (file->samp_rate * file->speed));
+
+  struct timespec ts= {
+    .tv_sec= due / 1000000000ull,
+    .tv_nsec= due % 1000000000ull
+  };
+
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+}
+
+static ssize_t sdr_file_peek(struct sdr *sdr, size_t len, void **samples)
+{
+  if (!sdr || sdr->fd < 0 || !sdr->buffers) {
+    fprintf(stderr, "sdr_peek: missing sdr struct or fd is closed\n");
     return(-1);
   }
+
+  struct sdr_file *file= sdr->priv;
+
+  if (file->pos >= file->chunk_end && !sdr_file_next_chunk(sdr, file)) {
+    return(-1);
+  }
+
+  size_t avail= file->chunk_end - file->pos;
+  size_t alen= (len > avail) ? avail : len;
+
+  sdr_file_pace(sdr, file, alen);
+
+  file->peeked= alen;
+
+  if (samples) *samples= (void *)(file->data + file->pos);
+
+  return(alen);
 }
 
-bool sdr_done(struct sdr *sdr)
+static bool sdr_file_done(struct sdr *sdr)
 {
-  return(sdr != NULL);
+  struct sdr_file *file= sdr->priv;
+
+  file->pos+= file->peeked;
+  file->played+= file->peeked;
+  file->peeked= 0;
+
+  return(true);
 }
 
-bool sdr_seek(struct sdr *sdr, size_t len)
+static bool sdr_file_seek(struct sdr *sdr, size_t len)
 {
   if (!sdr || sdr->fd < 0 || !sdr->buffers) {
     fprintf(stderr, "sdr_seek: missing sdr struct or fd is closed\n");
     return(false);
   }
 
-  if(lseek(sdr->fd, len, SEEK_CUR) < 0) {
+  struct sdr_file *file= sdr->priv;
+
+  /* Skipped samples still count for the pacing,
+   * a real device would have to receive them too */
+  file->pos+= len;
+  file->played+= len;
+  file->peeked= 0;
+
+  if (file->pos >= file->chunk_end && !sdr_file_next_chunk(sdr, file)) {
     return(false);
   }
 
   return(true);
 }
+
+/**
+ * Get the fractional delay that sync_sdrs found when the
+ * recording sdr replays was made. False if sdr does not
+ * replay a synchronized recording.
+ */
+bool sdr_file_sync_delay(struct sdr *sdr, float *delay)
+{
+  if (!sdr || sdr->ops != &sdr_file_ops) {
+    return(false);
+  }
+
+  struct sdr_file *file= sdr->priv;
+
+  if (!file || !file->synced) {
+    return(false);
+  }
+
+  *delay= file->sync_delay;
+
+  return(true);
+}
+
+const struct sdr_ops sdr_file_ops= {
+  .name= "file",
+  .caps= SDR_CAP_ZERO_COPY,
+  .format= SDR_FORMAT_CU8,
+
+  .open= sdr_file_open,
+  .connect_buffers= sdr_file_connect_buffers,
+  .start= sdr_file_start,
+  .set_sample_rate= sdr_file_set_sample_rate,
+  .set_center_freq= sdr_file_set_center_freq,
+  .stop= sdr_file_stop,
+  .destroy= sdr_file_destroy,
+  .peek= sdr_file_peek,
+  .done= sdr_file_done,
+  .seek= sdr_file_seek,
+};
@@ -0,0 +1,539 @@
+/*
+ * Copyright 2016 Leonard Göhrs <leonard@goehrs.eu>
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+
+#include "sdr.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include <errno.h>
+#include <string.h>
+#include <math.h>
+
+#include <volk/volk.h>
+
+/* The synthetic backend simulates one antenna of an array
+ * that receives a set of emitters, as fast as the consumer
+ * reads. Every channel is opened as its own device with the
+ * same scene description, the emitter signals are generated
+ * from fixed seeds so all channels see the same signals.
+ *
+ * Arguments:
+ *   ch=<antenna index of this channel>
+ *   ants=<x>:<y>;<x>:<y>;...
+ *     antenna positions in meters, like the ones
+ *     passed to AntennaArray in sofi_ui.py
+ *   tx=<offset>:<bearing>:<power>:<bandwidth>;...
+ *     emitters with the frequency offset from the center
+ *     in Hz, bearing in degrees counterclockwise from the
+ *     x axis, power in dBFS and bandwidth in Hz.
+ *     A bandwidth of 0 is an unmodulated carrier.
+ *   noise=<receiver noise power in dBFS>, seed=<noise seed>
+ *   offset=<samples>, phase=<degrees>
+ *     error of this receiver. The channel starts offset
+ *     samples later in the common signal and is rotated
+ *     by phase.
+ *
+ * The default scene is a single antenna receiving a carrier
+ * at +100 kHz and a wideband emitter, which gives
+ * sync_sdrs something to correlate. */
+
+#define SYNTH_BUFFER_LEN (65536)
+#define SYNTH_DEFAULT_RATE (2000000)
+#define SYNTH_DEFAULT_CENTER (97500000)
+#define SYNTH_MAX_ANTENNAS (32)
+#define SYNTH_MAX_EMITTERS (16)
+#define SYNTH_NOISE_LANES (8)
+#define SYNTH_SPEED_OF_LIGHT (299792458.0)
+
+struct synth_emitter {
+  double freq;
+  double bearing;
+  float amp;
+  double bandwidth;
+
+  /* One pole lowpass that shapes the modulation */
+  float lp_coeff;
+  float lp_gain;
+  lv_32fc_t lp_state;
+  uint64_t rng[SYNTH_NOISE_LANES];
+
+  /* Oscillator phase and the constant phase
+   * shift at this antenna */
+  lv_32fc_t phase;
+  lv_32fc_t steer;
+};
+
+struct sdr_synth {
+  uint32_t samp_rate;
+  uint32_t center_freq;
+
+  uint32_t channel;
+  size_t num_antennas;
+  double antennas[SYNTH_MAX_ANTENNAS][2];
+
+  size_t num_emitters;
+  struct synth_emitter emitters[SYNTH_MAX_EMITTERS];
+
+  float noise;
+  uint64_t rng[SYNTH_NOISE_LANES];
+
+  float phase_offset;
+  size_t skip;
+
+  /* Scratch buffers of SYNTH_BUFFER_LEN/2 samples */
+  lv_32fc_t *acc;
+  lv_32fc_t *env;
+  lv_32fc_t *tmp;
+};
+
+static double synth_arg(const char *args, const char *key, double def)
+{
+  const char *val= sdr_arg(args, key);
+
+  return(val ? strtod(val, NULL) : def);
+}
+
+/**
+ * Parse a list of tuples "a:b:..;a:b:..;..." of
+ * tuple_len numbers each.
+ * Returns the number of tuples or -1 on a syntax error.
+ */
+static ssize_t synth_parse_tuples(const char *list, double *dst,
+                                  size_t tuple_len, size_t max_tuples)
+{
+  size_t count= 0;
+
+  for (const char *pos= list; *pos && *pos != ','; count++) {
+    if (count >= max_tuples) {
+      return(-1);
+    }
+
+    for (size_t i=0; i<tuple_len; i++) {
+      char *end;
+
+      dst[count * tuple_len + i]= strtod(pos, &end);
+
+      char sep= (i + 1 < tuple_len) ? ':' : ';';
+
+      if (end == pos || (*end != sep && !(sep == ';' && (!*end || *end == ',')))) {
+        return(-1);
+      }
+
+      pos= (*end == sep) ? end + 1 : end;
+    }
+  }
+
+  return(count);
+}
+
+static float synth_db_to_amp(double db)
+{
+  return(pow(10, db / 20));
+}
+
+static void synth_seed(uint64_t *rng, uint64_t seed)
+{
+  for (size_t l=0; l<SYNTH_NOISE_LANES; l++) {
+    rng[l]= (seed * SYNTH_NOISE_LANES + l + 1) * 0xda942042e4dd58b5ull;
+  }
+}
+
+/* Uniform noise in [-1, 1) */
+static inline float synth_uniform(uint64_t *rng)
+{
+  *rng^= *rng << 13;
+  *rng^= *rng >> 7;
+  *rng^= *rng << 17;
+
+  return((int32_t)(*rng >> 32) * (1.0f / 2147483648.0f));
+}
+
+/**
+ * Write len noise values with a variance of
+ * 2/3 * scale^2 to dst. The generator runs
+ * SYNTH_NOISE_LANES independent streams so that
+ * the compiler can vectorize it.
+ * len must be a multiple of SYNTH_NOISE_LANES.
+ */
+static void synth_noise(uint64_t *state, float *dst, float scale, size_t len)
+{
+  uint64_t rng[SYNTH_NOISE_LANES];
+
+  memcpy(rng, state, sizeof(rng));
+
+  for (size_t i=0; i<len; i+= SYNTH_NOISE_LANES) {
+    for (size_t l=0; l<SYNTH_NOISE_LANES; l++) {
+      /* The sum of two uniforms is a good enough
+       * approximation of gaussian noise here */
+      float u1= synth_uniform(&rng[l]);
+      float u2= synth_uniform(&rng[l]);
+
+      dst[i + l]= scale * (u1 + u2);
+    }
+  }
+
+  memcpy(state, rng, sizeof(rng));
+}
+
+/**
+ * Recalculate the phase shifts of all emitters at
+ * this antenna. Depends on the center frequency.
+ */
+static void sdr_synth_place(struct sdr_synth *syn)
+{
+  const double *pos= syn->antennas[syn->channel];
+
+  for (size_t ei=0; ei<syn->num_emitters; ei++) {
+    struct synth_emitter *em= &syn->emitters[ei];
+
+    /* A plane wave from the bearing reaches antennas
+     * that are further in its direction earlier */
+    double proj= pos[0] * cos(em->bearing) + pos[1] * sin(em->bearing);
+    double wavelength= SYNTH_SPEED_OF_LIGHT / (syn->center_freq + em->freq);
+    double ph= 2 * M_PI * proj / wavelength + syn->phase_offset;
+
+    em->steer= cosf(ph) + I * sinf(ph);
+  }
+}
+
+static bool sdr_synth_open(struct sdr *sdr, const char *args)
+{
+  struct sdr_synth *syn= calloc(1, sizeof(*syn));
+
+  if (!syn) {
+    fprintf(stderr, "sdr_open: allocating synth state failed\n");
+    return (false);
+  }
+
+  sdr->priv= syn;
+
+  syn->samp_rate= SYNTH_DEFAULT_RATE;
+  syn->center_freq= SYNTH_DEFAULT_CENTER;
+  syn->channel= synth_arg(args, "ch", 0);
+  syn->noise= synth_db_to_amp(synth_arg(args, "noise", -26)) / sqrtf(4.0f/3);
+  syn->phase_offset= synth_arg(args, "phase", 0) * M_PI / 180;
+
+  const char *ants= sdr_arg(args, "ants");
+  const char *tx= sdr_arg(args, "tx");
+
+  ssize_t num_ants= synth_parse_tuples(ants ? ants : "0:0", syn->antennas[0],
+                                       2, SYNTH_MAX_ANTENNAS);
+
+  if (num_ants <= 0 || syn->channel >= num_ants) {
+    fprintf(stderr, "sdr_open: invalid antenna list or channel\n");
+    return (false);
+  }
+
+  syn->num_antennas= num_ants;
+
+  double txs[SYNTH_MAX_EMITTERS][4];
+  ssize_t num_tx= synth_parse_tuples(tx ? tx : "100000:0:-6:0;0:0:-20:2000000",
+                                     txs[0], 4, SYNTH_MAX_EMITTERS);
+
+  if (num_tx < 0) {
+    fprintf(stderr, "sdr_open: invalid emitter list\n");
+    return (false);
+  }
+
+  syn->num_emitters= num_tx;
+
+  for (size_t ei=0; ei<syn->num_emitters; ei++) {
+    struct synth_emitter *em= &syn->emitters[ei];
+
+    em->freq= txs[ei][0];
+    em->bearing= txs[ei][1] * M_PI / 180;
+    em->amp= synth_db_to_amp(txs[ei][2]);
+    em->bandwidth= txs[ei][3];
+    synth_seed(em->rng, ~(uint64_t)ei);
+    em->phase= 1;
+  }
+
+  sdr_synth_place(syn);
+
+  uint64_t seed= synth_arg(args, "seed", syn->channel + 1);
+
+  synth_seed(syn->rng, seed);
+
+  size_t max_samples= SYNTH_BUFFER_LEN / 2;
+
+  syn->acc= aligned_alloc(64, max_samples * sizeof(lv_32fc_t));
+  syn->env= aligned_alloc(64, max_samples * sizeof(lv_32fc_t));
+  syn->tmp= aligned_alloc(64, max_samples * sizeof(lv_32fc_t));
+
+  if (!syn->acc || !syn->env || !syn->tmp) {
+    fprintf(stderr, "sdr_open: allocating synth buffers failed\n");
+    return (false);
+  }
+
+  if (!sdr_set_sample_rate(sdr, SYNTH_DEFAULT_RATE)) {
+    return (false);
+  }
+
+  syn->skip= synth_arg(args, "offset", 0);
+
+  fprintf(stderr, "sdr_open: synthesizing antenna %u/%ld, %ld emitters\n",
+          syn->channel, syn->num_antennas, syn->num_emitters);
+
+  return (true);
+}
+
+static bool sdr_synth_connect_buffers(struct sdr *sdr, uint32_t bufs_count)
+{
+  if (!sdr || !bufs_count || sdr->buffers) {
+    fprintf(stderr, "sdr_connect_buffers: No sdr structure or bufs_count is zero\n");
+    return (false);
+  }
+
+  sdr->buffers= calloc(1, sizeof(*sdr->buffers));
+  if (!sdr->buffers) {
+    fprintf(stderr, "sdr_connect_buffers: Meta Buffer allocation failed\n");
+    return (false);
+  }
+
+  sdr->buffers[0].start= malloc(SYNTH_BUFFER_LEN);
+  if(!sdr->buffers[0].start) {
+    fprintf(stderr, "sdr_connect_buffers: Buffer allocation failed\n");
+    return (false);
+  }
+
+  sdr->buffers[0].len= SYNTH_BUFFER_LEN;
+  sdr->bufs_count= 1;
+
+  return(true);
+}
+
+static bool sdr_synth_start(struct sdr *sdr)
+{
+  return(sdr != NULL);
+}
+
+static bool sdr_synth_set_sample_rate(struct sdr *sdr, uint32_t samp_rate)
+{
+  struct sdr_synth *syn= sdr->priv;
+
+  if (!samp_rate) {
+    return(false);
+  }
+
+  syn->samp_rate= samp_rate;
+
+  for (size_t ei=0; ei<syn->num_emitters; ei++) {
+    struct synth_emitter *em= &syn->emitters[ei];
+
+    /* Scale the lowpass output to the emitter power.
+     * The input has a variance of 2/3 per component */
+    float a= (em->bandwidth > 0) ? 1 - exp(-2 * M_PI * em->bandwidth / samp_rate) : 0;
+
+    em->lp_coeff= a;
+    em->lp_gain= (a > 0) ? em->amp / sqrtf(4.0f/3 * a / (2 - a)) : 0;
+  }
+
+  return(true);
+}
+
+static bool sdr_synth_set_center_freq(struct sdr *sdr, uint32_t freq)
+{
+  struct sdr_synth *syn= sdr->priv;
+
+  if (!freq) {
+    return(false);
+  }
+
+  syn->center_freq= freq;
+  sdr_synth_place(syn);
+
+  return(true);
+}
+
+static bool sdr_synth_stop(struct sdr *sdr)
+{
+  return(sdr != NULL);
+}
+
+static bool sdr_synth_destroy(struct sdr *sdr)
+{
+  struct sdr_synth *syn= sdr->priv;
+
+  if (sdr->buffers) {
+    free(sdr->buffers->start);
+    free(sdr->buffers);
+  }
+
+  if (syn) {
+    free(syn->acc);
+    free(syn->env);
+    free(syn->tmp);
+  }
+
+  free(syn);
+
+  return(true);
+}
+
+/**
+ * Fill env with the complex envelope of an emitter.
+ * Every channel runs it on the same seed and gets
+ * the same envelope. Only the lowpass is recursive.
+ */
+static void synth_envelope(struct synth_emitter *em, lv_32fc_t *env, size_t num)
+{
+  if (em->lp_coeff <= 0) {
+    for (size_t i=0; i<num; i++) {
+      env[i]= em->amp;
+    }
+
+    return;
+  }
+
+  float a= em->lp_coeff;
+  float g= em->lp_gain;
+  float si= crealf(em->lp_state);
+  float sq= cimagf(em->lp_state);
+  float *iq= (float *)env;
+
+  synth_noise(em->rng, iq, 1, 2*num);
+
+  for (size_t i=0; i<num; i++) {
+    si+= a * (iq[2*i] - si);
+    sq+= a * (iq[2*i + 1] - sq);
+
+    iq[2*i]= g * si;
+    iq[2*i + 1]= g * sq;
+  }
+
+  em->lp_state= si + I * sq;
+}
+
+/**
+ * Generate num samples into syn->acc
+ */
+static void sdr_synth_generate(struct sdr_synth *syn, size_t num)
+{
+  memset(syn->acc, 0, num * sizeof(*syn->acc));
+
+  for (size_t ei=0; ei<syn->num_emitters; ei++) {
+    struct synth_emitter *em= &syn->emitters[ei];
+
+    double step= 2 * M_PI * em->freq / syn->samp_rate;
+    lv_32fc_t inc= cosf(step) + I * sinf(step);
+
+    lv_32fc_t phase= em->phase * em->steer;
+
+    synth_envelope(em, syn->env, num);
+
+    volk_32fc_s32fc_x2_rotator_32fc(syn->tmp, syn->env, inc, &phase, num);
+
+    em->phase= phase * conjf(em->steer);
+    volk_32f_x2_add_32f((float *)syn->acc, (float *)syn->acc,
+                        (float *)syn->tmp, 2 * num);
+  }
+
+  synth_noise(syn->rng, (float *)syn->tmp, syn->noise, 2 * num);
+  volk_32f_x2_add_32f((float *)syn->acc, (float *)syn->acc,
+                      (float *)syn->tmp, 2 * num);
+}
+
+static void sdr_synth_quantize(uint8_t *dst, const float *src, size_t len)
+{
+  for (size_t i=0; i<len; i++) {
+    float q= 127.5f + 127.5f * src[i];
+
+    q= q < 0 ? 0 : q;
+    q= q > 255 ? 255 : q;
+
+    dst[i]= (uint8_t)q;
+  }
+}
+
+static ssize_t sdr_synth_peek(struct sdr *sdr, size_t len, void **samples)
+{
+  if (!sdr || !sdr->buffers) {
+    fprintf(stderr, "sdr_peek: missing sdr struct or buffers\n");
+    return(-1);
+  }
+
+  if (!sdr->buffer_reader.opened) {
+    struct sdr_synth *syn= sdr->priv;
+    size_t num= sdr->buffers[0].len / 2;
+
+    /* The receiver offset is applied by starting to read
+     * within the generated blocks. This way every channel
+     * generates the same blocks and the emitter signals
+     * stay identical */
+    for (; syn->skip >= num; syn->skip-= num) {
+      sdr_synth_generate(syn, num);
+    }
+
+    sdr_synth_generate(syn, num);
+    sdr_synth_quantize(sdr->buffers[0].start, (float *)syn->acc, sdr->buffers[0].len);
+
+    sdr_stamp_buffer(sdr);
+
+    sdr->buffer_reader.opened= true;
+    sdr->buffer_reader.bufnum= 0;
+    sdr->buffer_reader.rdpos= 2 * syn->skip;
+
+    syn->skip= 0;
+  }
+
+  size_t rdpos= sdr->buffer_reader.rdpos;
+  size_t len_rem= sdr->buffers[0].len - rdpos;
+  size_t len_trunc= len_rem < len ? len_rem : len;
+
+  if (samples) *samples= (uint8_t *)sdr->buffers[0].start + rdpos;
+  sdr->buffer_reader.peekpos= rdpos + len_trunc;
+
+  return(len_trunc);
+}
+
+static bool sdr_synth_done(struct sdr *sdr)
+{
+  if (!sdr->buffer_reader.opened) {
+    fprintf(stderr, "sdr_done: buffer_reader not open. Peek was not called before\n");
+    return(false);
+  }
+
+  sdr->buffer_reader.rdpos= sdr->buffer_reader.peekpos;
+
+  if (sdr->buffer_reader.rdpos >= sdr->buffers[0].len) {
+    sdr->buffer_reader.opened= false;
+  }
+
+  return(true);
+}
+
+const struct sdr_ops sdr_synth_ops= {
+  .name= "synth",
+  .caps= SDR_CAP_ZERO_COPY,
+  .format= SDR_FORMAT_CU8,
+
+  .open= sdr_synth_open,
+  .connect_buffers= sdr_synth_connect_buffers,
+  .start= sdr_synth_start,
+  .set_sample_rate= sdr_synth_set_sample_rate,
+  .set_center_freq= sdr_synth_set_center_freq,
+  .stop= sdr_synth_stop,
+  .destroy= sdr_synth_destroy,
+  .peek= sdr_synth_peek,
+  .done= sdr_synth_done,
+};
@@ -0,0 +1,718 @@
+/*
+ * Copyright 2016 Leonard Göhrs <leonard@goehrs.eu>
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+
+
+/* End to end benchmark of the signal processing chain.
+ *
+ * The first part runs the stages single threaded on
+ * samples from the given devices, one frame at a time:
+ *   source    sdr_peek/sdr_done on the devices
+ *   convert   raw IQ to windowed complex floats
+ *   fft       batched forward transforms
+ *   combiner  cross spectrum accumulation of all edges
+ * The second part synchronizes the devices and runs
+ * the complete threaded pipeline like libsofi does.
+ *
+ * Without device arguments a synth scene with one
+ * antenna per channel is generated. Use speed=0 for
+ * replays (see sdr_simulation.c), paced replays measure
+ * the pacing instead of the pipeline.
+ *
+ * CPU utilization is given in cores, 1.0 is one core busy
+ * for the whole run. The report is written as JSON. */
+
+#define DEFAULT_NUM_SDRS (4)
+#define DEFAULT_FFT_LEN (1024)
+#define DEFAULT_DECIMATION (CB_DECIMATOR)
+#define DEFAULT_BUFFERS (32)
+#define DEFAULT_BATCH (4)
+#define DEFAULT_FRAMES (4096)
+#define DEFAULT_SECONDS (5)
+#define SYNC_LEN (1<<18)
+#define CAPTURE_RING_LEN (1<<24)
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include <string.h>
+#include <time.h>
+#include <math.h>
+#include <unistd.h>
+
+#include "sdr.h"
+#include "capture_thread.h"
+#include "fft_thread.h"
+#include "synchronize.h"
+#include "window.h"
+#include "combiner.h"
+#include "combiner_thread.h"
+#include "drift.h"
+#include "convert.h"
+#include "wisdom.h"
+
+struct bench_config {
+  size_t num_sdrs;
+  size_t fft_len;
+  size_t decimation;
+  size_t buffers;
+  size_t batch;
+  size_t frames;
+  double seconds;
+  enum sync_weighting weighting;
+  const char *output;
+
+  char **devices;
+};
+
+/* Per frame timings of one stage */
+struct bench_stage {
+  const char *name;
+
+  double *latencies;
+  size_t count;
+
+  double wall;
+  double cpu;
+  uint64_t samples;
+};
+
+static double now_sec(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return(ts.tv_sec + ts.tv_nsec * 1e-9);
+}
+
+static double cpu_sec(clockid_t clock)
+{
+  struct timespec ts;
+
+  clock_gettime(clock, &ts);
+
+  return(ts.tv_sec + ts.tv_nsec * 1e-9);
+}
+
+static double thread_cpu_sec(pthread_t thread)
+{
+  clockid_t clock;
+
+  if (pthread_getcpuclockid(thread, &clock)) {
+    return(0);
+  }
+
+  return(cpu_sec(clock));
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+  double da= *(const double *)a;
+  double db= *(const double *)b;
+
+  return((da > db) - (da < db));
+}
+
+/**
+ * Sorts vals
+ */
+static double percentile(double *vals, size_t count, double p)
+{
+  if (!count) {
+    return(0);
+  }
+
+  qsort(vals, count, sizeof(*vals), cmp_double);
+
+  size_t idx= p * (count - 1) + 0.5;
+
+  return(vals[idx]);
+}
+
+static void json_string(FILE *fp, const char *str)
+{
+  fputc('"', fp);
+
+  for (; *str; str++) {
+    if (*str == '"' || *str == '\\') fputc('\\', fp);
+
+    fputc(*str, fp);
+  }
+
+  fputc('"', fp);
+}
+
+static void json_latency(FILE *fp, const char *name, double *vals, size_t count)
+{
+  double p50= percentile(vals, count, 0.5);
+  double p99= percentile(vals, count, 0.99);
+  double max= percentile(vals, count, 1);
+
+  fprintf(fp, "\"%s\": {\"p50\": %.3f, \"p99\": %.3f, \"max\": %.3f}",
+          name, p50 * 1e6, p99 * 1e6, max * 1e6);
+}
+
+static bool bench_stage_init(struct bench_stage *st, const char *name, size_t count)
+{
+  memset(st, 0, sizeof(*st));
+
+  st->name= name;
+  st->latencies= calloc(count, sizeof(*st->latencies));
+
+  return(st->latencies != NULL);
+}
+
+static void bench_stage_json(FILE *fp, struct bench_stage *st, bool last)
+{
+  if (st->wall <= 0) {
+    st->wall= 1e-9;
+  }
+
+  fprintf(fp, "    \"%s\": {\"msps\": %.3f, \"msps_per_core\": %.3f, \"cpu\": %.3f, ",
+          st->name,
+          st->samples / st->wall / 1e6,
+          st->cpu > 0 ? st->samples / st->cpu / 1e6 : 0,
+          st->cpu / st->wall);
+
+  json_latency(fp, "frame_latency_us", st->latencies, st->count);
+
+  fprintf(fp, "}%s\n", last ? "" : ",");
+}
+
+static bool open_devices(struct bench_config *cfg, struct sdr *devs,
+                         struct capture_thread *caps)
+{
+  for (size_t i=0; i<cfg->num_sdrs; i++) {
+    if(!sdr_open(&devs[i], cfg->devices[i]) ||
+       !sdr_connect_buffers(&devs[i], 8) ||
+       !sdr_set_center_freq(&devs[i], 975*100*1000) ||
+       !ct_setup(&caps[i], &devs[i], CAPTURE_RING_LEN)) {
+      return(false);
+    }
+  }
+
+  for (size_t i=0; i<cfg->num_sdrs; i++) {
+    if(!sdr_start(&devs[i]) || !ct_start(&caps[i])) {
+      return(false);
+    }
+  }
+
+  for (size_t i=cfg->num_sdrs; i-- > 0;) {
+    if(!sdr_set_sample_rate(&devs[i], 2000000)) {
+      return(false);
+    }
+  }
+
+  return(true);
+}
+
+/**
+ * Run the stages one after another in this thread
+ */
+static bool bench_stages(struct bench_config *cfg, struct capture_thread *caps,
+                         float *window, struct bench_stage *stages)
+{
+  size_t num= cfg->num_sdrs;
+  size_t len= cfg->fft_len;
+  size_t batch= cfg->batch;
+  size_t frames= cfg->frames - cfg->frames % batch;
+
+  struct bench_stage *st_source= &stages[0];
+  struct bench_stage *st_convert= &stages[1];
+  struct bench_stage *st_fft= &stages[2];
+  struct bench_stage *st_combiner= &stages[3];
+
+  if (!bench_stage_init(st_source, "source", frames * num) ||
+      !bench_stage_init(st_convert, "convert", frames * num) ||
+      !bench_stage_init(st_fft, "fft", frames * num / batch) ||
+      !bench_stage_init(st_combiner, "combiner", frames)) {
+    fprintf(stderr, "bench: allocating timings failed\n");
+    return(false);
+  }
+
+  struct converter convs[num];
+  fftwf_complex *ins[num];
+  fftwf_complex *outs[num];
+  fftwf_plan plans[num];
+
+  size_t num_edges= num * (num - 1) / 2;
+  fftwf_complex *accs[num_edges];
+
+  for (size_t i=0; i<num; i++) {
+    ins[i]= fftwf_alloc_complex(len * batch);
+    outs[i]= fftwf_alloc_complex(len * batch);
+
+    if (!ins[i] || !outs[i] ||
+        !cv_init(&convs[i], window, len, sdr_format(caps[i].dev))) {
+      fprintf(stderr, "bench: setting up stages failed\n");
+      return(false);
+    }
+
+    plans[i]= ft_plan(len, batch, ins[i], outs[i], FFTW_MEASURE);
+
+    if (!plans[i]) {
+      fprintf(stderr, "bench: fftwf_plan failed\n");
+      return(false);
+    }
+  }
+
+  for (size_t ei=0; ei<num_edges; ei++) {
+    accs[ei]= fftwf_alloc_complex(len);
+
+    if (!accs[ei]) {
+      fprintf(stderr, "bench: allocating accumulators failed\n");
+      return(false);
+    }
+
+    memset(accs[ei], 0, sizeof(fftwf_complex) * len);
+  }
+
+  for (size_t frame=0; frame<frames; frame+= batch) {
+    for (size_t i=0; i<num; i++) {
+      for (size_t bi=0; bi<batch; bi++) {
+        double t_source= 0, t_convert= 0;
+        double c_source= 0, c_convert= 0;
+        size_t sample_size= convs[i].sample_size;
+
+        for(size_t pos=0; pos < len;) {
+          void *samples;
+
+          double t0= now_sec(), c0= cpu_sec(CLOCK_THREAD_CPUTIME_ID);
+
+          ssize_t bytes_rd= ct_peek(&caps[i], sample_size * (len - pos), &samples);
+
+          if (bytes_rd < 0) {
+            fprintf(stderr, "bench: reading samples failed\n");
+            return(false);
+          }
+
+          double t1= now_sec(), c1= cpu_sec(CLOCK_THREAD_CPUTIME_ID);
+
+          size_t samples_rd= bytes_rd/sample_size;
+
+          cv_convert(&convs[i], ins[i] + bi*len, samples, pos, samples_rd);
+          pos+= samples_rd;
+
+          double t2= now_sec(), c2= cpu_sec(CLOCK_THREAD_CPUTIME_ID);
+
+          if (!ct_done(&caps[i])) {
+            return(false);
+          }
+
+          double t3= now_sec(), c3= cpu_sec(CLOCK_THREAD_CPUTIME_ID);
+
+          t_source+= (t1 - t0) + (t3 - t2);
+          c_source+= (c1 - c0) + (c3 - c2);
+          t_convert+= t2 - t1;
+          c_convert+= c2 - c1;
+        }
+
+        st_source->latencies[st_source->count++]= t_source;
+        st_source->wall+= t_source;
+        st_source->cpu+= c_source;
+        st_source->samples+= len;
+
+        st_convert->latencies[st_convert->count++]= t_convert;
+        st_convert->wall+= t_convert;
+        st_convert->cpu+= c_convert;
+        st_convert->samples+= len;
+      }
+
+      double t0= now_sec(), c0= cpu_sec(CLOCK_THREAD_CPUTIME_ID);
+
+      fftwf_execute(plans[i]);
+
+      double t1= now_sec(), c1= cpu_sec(CLOCK_THREAD_CPUTIME_ID);
+
+      /* Per frame, like the other stages */
+      st_fft->latencies[st_fft->count++]= (t1 - t0) / batch;
+      st_fft->wall+= t1 - t0;
+      st_fft->cpu+= c1 - c0;
+      st_fft->samples+= len * batch;
+    }
+
+    for (size_t bi=0; bi<batch; bi++) {
+      fftwf_complex *spectra[num];
+
+      for (size_t i=0; i<num; i++) {
+        spectra[i]= outs[i] + bi*len;
+      }
+
+      double t0= now_sec(), c0= cpu_sec(CLOCK_THREAD_CPUTIME_ID);
+
+      cb_cmac(num, spectra, accs, NULL, 0, len);
+
+      double t1= now_sec(), c1= cpu_sec(CLOCK_THREAD_CPUTIME_ID);
+
+      st_combiner->latencies[st_combiner->count++]= t1 - t0;
+      st_combiner->wall+= t1 - t0;
+      st_combiner->cpu+= c1 - c0;
+      st_combiner->samples+= len * num;
+    }
+  }
+
+  for (size_t i=0; i<num; i++) {
+    fftwf_destroy_plan(plans[i]);
+    fftwf_free(ins[i]);
+    fftwf_free(outs[i]);
+    cv_destroy(&convs[i]);
+  }
+
+  for (size_t ei=0; ei<num_edges; ei++) {
+    fftwf_free(accs[ei]);
+  }
+
+  return(true);
+}
+
+struct bench_pipeline {
+  double sync_wall;
+  double sync_cpu;
+
+  double wall;
+  uint64_t frames;
+  uint64_t outputs;
+
+  double *intervals;
+  size_t num_intervals;
+
+  double fft_latency_mean;
+  double fft_latency_max;
+
+  double cpu_capture;
+  double cpu_fft;
+  double cpu_workers;
+  double cpu_combiner;
+  double cpu_total;
+};
+
+static void pipeline_cpu(struct bench_config *cfg, struct capture_thread *caps,
+                         struct fft_thread *ffts, struct combiner_thread *cbt,
+                         double *cpus)
+{
+  memset(cpus, 0, sizeof(double) * 5);
+
+  for (size_t i=0; i<cfg->num_sdrs; i++) {
+    if (!caps[i].direct) {
+      cpus[0]+= thread_cpu_sec(caps[i].thread);
+    }
+
+    cpus[1]+= thread_cpu_sec(ffts[i].thread);
+  }
+
+  /* Worker 0 runs in the combiner thread */
+  for (size_t wi=1; wi<cbt->cb->num_workers; wi++) {
+    cpus[2]+= thread_cpu_sec(cbt->cb->workers[wi].thread);
+  }
+
+  cpus[3]= thread_cpu_sec(cbt->thread);
+  cpus[4]= cpu_sec(CLOCK_PROCESS_CPUTIME_ID);
+}
+
+/**
+ * Synchronize and run the threaded pipeline
+ */
+static bool bench_pipeline(struct bench_config *cfg, struct capture_thread *caps,
+                           float *window, struct bench_pipeline *res)
+{
+  size_t num= cfg->num_sdrs;
+  size_t num_workers= cb_workers_for(num);
+
+  struct fft_thread ffts[num];
+  struct combiner cb;
+  struct combiner_thread cbt;
+  struct drift_tracker dt;
+
+  float delays[num];
+
+  double t0= now_sec(), c0= cpu_sec(CLOCK_PROCESS_CPUTIME_ID);
+
+  if(!sync_sdrs(caps, num, SYNC_LEN, cfg->weighting, delays)) {
+    return(false);
+  }
+
+  res->sync_wall= now_sec() - t0;
+  res->sync_cpu= (cpu_sec(CLOCK_PROCESS_CPUTIME_ID) - c0) / res->sync_wall;
+
+  for (size_t i=0; i<num; i++) {
+    if(!ft_setup(&ffts[i], &caps[i], window, cfg->fft_len,
+                 cfg->buffers, cfg->batch, num_workers, true) ||
+       !ft_start(&ffts[i])) {
+      return(false);
+    }
+  }
+
+  if(!cb_init(&cb, ffts, num, num_workers) ||
+     !cb_set_integration(&cb, CB_INTEGRATE_BLOCK, cfg->decimation, cfg->decimation) ||
+     !cb_set_delays(&cb, delays) || !dt_init(&dt, &cb, delays) ||
+     !cbt_setup(&cbt, &cb) || !cbt_set_drift_tracker(&cbt, &dt) || !cbt_start(&cbt)) {
+    return(false);
+  }
+
+  size_t max_intervals= cfg->seconds * 2e6 / (cfg->fft_len * cfg->decimation) * 4 + 16;
+
+  res->intervals= calloc(max_intervals, sizeof(*res->intervals));
+  if (!res->intervals) {
+    return(false);
+  }
+
+  /* Skip the first result, it includes the start up */
+  const struct cbt_result *result= cbt_next(&cbt, 0);
+  if (!result) {
+    return(false);
+  }
+
+  double cpus_start[5], cpus_end[5];
+  uint64_t seq= result->seq;
+  uint64_t frame_start= seq * cfg->decimation;
+
+  pipeline_cpu(cfg, caps, ffts, &cbt, cpus_start);
+
+  double start= now_sec();
+  double last= start;
+
+  while (last - start < cfg->seconds && res->num_intervals < max_intervals) {
+    result= cbt_next(&cbt, seq);
+    if (!result) {
+      return(false);
+    }
+
+    double now= now_sec();
+
+    res->outputs+= result->seq - seq;
+    res->intervals[res->num_intervals++]= (now - last) / (result->seq - seq);
+
+    seq= result->seq;
+    last= now;
+  }
+
+  pipeline_cpu(cfg, caps, ffts, &cbt, cpus_end);
+
+  res->wall= last - start;
+  res->frames= seq * cfg->decimation - frame_start;
+
+  res->cpu_capture= (cpus_end[0] - cpus_start[0]) / res->wall;
+  res->cpu_fft= (cpus_end[1] - cpus_start[1]) / res->wall;
+  res->cpu_workers= (cpus_end[2] - cpus_start[2]) / res->wall;
+  res->cpu_combiner= (cpus_end[3] - cpus_start[3]) / res->wall;
+  res->cpu_total= (cpus_end[4] - cpus_start[4]) / res->wall;
+
+  for (size_t i=0; i<num; i++) {
+    double mean_us, max_us;
+
+    ft_get_latency(&ffts[i], &mean_us, &max_us);
+
+    res->fft_latency_mean+= mean_us / num;
+    if (max_us > res->fft_latency_max) res->fft_latency_max= max_us;
+  }
+
+  /* The fft threads have to keep running until the
+   * combiner thread finished its last step.
+   * The buffers are not freed, the combiner does
+   * not hand back the frames it holds on exit */
+  bool ok= cbt_stop(&cbt) && cb_cleanup(&cb);
+
+  dt_destroy(&dt);
+
+  for (size_t i=0; i<num; i++) {
+    ok= ft_stop(&ffts[i]) && ok;
+  }
+
+  return(ok);
+}
+
+static bool write_report(struct bench_config *cfg, struct bench_stage *stages,
+                         size_t num_stages, struct bench_pipeline *pl)
+{
+  FILE *fp= strcmp(cfg->output, "-") ? fopen(cfg->output, "w") : stdout;
+
+  if (!fp) {
+    fprintf(stderr, "bench: can not open %s\n", cfg->output);
+    return(false);
+  }
+
+  double msps= pl->frames * cfg->fft_len * cfg->num_sdrs / pl->wall / 1e6;
+
+  fprintf(fp, "{\n");
+  fprintf(fp, "  \"config\": {\"num_sdrs\": %ld, \"fft_len\": %ld, \"decimation\": %ld, "
+          "\"buffers\": %ld, \"batch\": %ld, \"frames\": %ld, \"seconds\": %.1f, "
+          "\"cores\": %ld,\n    \"devices\": [",
+          cfg->num_sdrs, cfg->fft_len, cfg->decimation, cfg->buffers,
+          cfg->batch, cfg->frames, cfg->seconds, sysconf(_SC_NPROCESSORS_ONLN));
+
+  for (size_t i=0; i<cfg->num_sdrs; i++) {
+    json_string(fp, cfg->devices[i]);
+    fprintf(fp, "%s", (i + 1 < cfg->num_sdrs) ? ", " : "");
+  }
+
+  fprintf(fp, "]},\n");
+
+  fprintf(fp, "  \"stages\": {\n");
+
+  for (size_t si=0; si<num_stages; si++) {
+    bench_stage_json(fp, &stages[si], si + 1 == num_stages);
+  }
+
+  fprintf(fp, "  },\n");
+
+  fprintf(fp, "  \"sync\": {\"weighting\": \"%s\", \"seconds\": %.3f, \"cpu\": %.3f},\n",
+          (cfg->weighting == SYNC_WEIGHT_PHAT) ? "phat" : "none",
+          pl->sync_wall, pl->sync_cpu);
+
+  fprintf(fp, "  \"pipeline\": {\"seconds\": %.3f, \"msps\": %.3f, \"msps_per_core\": %.3f, "
+          "\"outputs\": %ld,\n    ",
+          pl->wall, msps, pl->cpu_total > 0 ? msps / pl->cpu_total : 0, pl->outputs);
+
+  json_latency(fp, "output_interval_us", pl->intervals, pl->num_intervals);
+
+  fprintf(fp, ",\n    \"fft_frame_latency_us\": {\"mean\": %.3f, \"max\": %.3f},\n",
+          pl->fft_latency_mean, pl->fft_latency_max);
+
+  fprintf(fp, "    \"cpu\": {\"capture\": %.3f, \"fft\": %.3f, \"combiner_workers\": %.3f, "
+          "\"combiner\": %.3f, \"total\": %.3f}}\n",
+          pl->cpu_capture, pl->cpu_fft, pl->cpu_workers, pl->cpu_combiner, pl->cpu_total);
+
+  fprintf(fp, "}\n");
+
+  if (fp != stdout) {
+    fclose(fp);
+  }
+
+  return(true);
+}
+
+static void usage(const char *name)
+{
+  fprintf(stderr,
+          "Usage: %s [-n sdrs] [-l fft len] [-d decimation] [-b buffers] [-B batch]\n"
+          "          [-f frames] [-s seconds] [-w none|phat] [-o output.json]\n"
+          "          [device ...]\n",
+          name);
+}
+
+/**
+ * The default synth scene, the antennas are
+ * placed on a circle with a radius of 25cm
+ */
+static char *synth_device(size_t channel, size_t num)
+{
+  char ants[32 * 24]= "";
+  char *spec= malloc(1024);
+
+  if (!spec) {
+    return(NULL);
+  }
+
+  for (size_t i=0; i<num; i++) {
+    double angle= 2 * M_PI * i / num;
+    size_t used= strlen(ants);
+
+    snprintf(ants + used, sizeof(ants) - used, "%s%.4f:%.4f",
+             i ? ";" : "", 0.25 * cos(angle), 0.25 * sin(angle));
+  }
+
+  snprintf(spec, 1024, "synth:ch=%ld,ants=%s,tx=100000:30:-10:0;-400000:200:-12:50000;"
+           "0:0:-16:2000000", channel, ants);
+
+  return(spec);
+}
+
+int main(int argc, char **argv)
+{
+  struct bench_config cfg= {
+    .num_sdrs= DEFAULT_NUM_SDRS,
+    .fft_len= DEFAULT_FFT_LEN,
+    .decimation= DEFAULT_DECIMATION,
+    .buffers= DEFAULT_BUFFERS,
+    .batch= DEFAULT_BATCH,
+    .frames= DEFAULT_FRAMES,
+    .seconds= DEFAULT_SECONDS,
+    .weighting= SYNC_WEIGHT_PHAT,
+    .output= "-",
+  };
+
+  for (int opt; (opt= getopt(argc, argv, "n:l:d:b:B:f:s:w:o:h")) != -1;) {
+    switch (opt) {
+    case 'n': cfg.num_sdrs= atol(optarg); break;
+    case 'l': cfg.fft_len= atol(optarg); break;
+    case 'd': cfg.decimation= atol(optarg); break;
+    case 'b': cfg.buffers= atol(optarg); break;
+    case 'B': cfg.batch= atol(optarg); break;
+    case 'f': cfg.frames= atol(optarg); break;
+    case 's': cfg.seconds= atof(optarg); break;
+    case 'w':
+      if (!strcmp(optarg, "phat")) cfg.weighting= SYNC_WEIGHT_PHAT;
+      else if (!strcmp(optarg, "none")) cfg.weighting= SYNC_WEIGHT_NONE;
+      else {
+        usage(argv[0]);
+        return(1);
+      }
+      break;
+    case 'o': cfg.output= optarg; break;
+    default:
+      usage(argv[0]);
+      return(1);
+    }
+  }
+
+  if (optind < argc) {
+    cfg.num_sdrs= argc - optind;
+    cfg.devices= argv + optind;
+  }
+  else {
+    cfg.devices= calloc(cfg.num_sdrs, sizeof(*cfg.devices));
+
+    for (size_t i=0; cfg.devices && i<cfg.num_sdrs && cfg.num_sdrs <= 32; i++) {
+      cfg.devices[i]= synth_device(i, cfg.num_sdrs);
+      if (!cfg.devices[i]) cfg.devices= NULL;
+    }
+  }
+
+  if (cfg.num_sdrs < 2 || cfg.num_sdrs > 32 || !cfg.devices ||
+      !cfg.fft_len || !cfg.decimation || !cfg.batch ||
+      cfg.buffers % cfg.batch || cfg.frames < cfg.batch) {
+    usage(argv[0]);
+    return(1);
+  }
+
+  ws_load(ws_default_path());
+
+  float *window= window_hamming(cfg.fft_len);
+
+  struct sdr devs[cfg.num_sdrs];
+  struct capture_thread caps[cfg.num_sdrs];
+
+  struct bench_stage stages[4];
+  struct bench_pipeline pipeline= {0};
+
+  if (!window || !open_devices(&cfg, devs, caps) ||
+      !bench_stages(&cfg, caps, window, stages) ||
+      !bench_pipeline(&cfg, caps, window, &pipeline) ||
+      !write_report(&cfg, stages, 4, &pipeline)) {
+    return(1);
+  }
+
+  ws_save(ws_default_path());
+
+  return(0);
+}
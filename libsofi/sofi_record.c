@@ -0,0 +1,141 @@
+/*
+ * Copyright 2016 Leonard Göhrs <leonard@goehrs.eu>
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+
+/* Record all channels to disk, see recorder.h.
+ * The receivers are synchronized first and the
+ * resulting offsets are stored with the recordings.
+ *
+ * Usage: sofi_record <seconds> <output prefix> <device> <device> ...
+ * Writes <output prefix><channel>.sofirec */
+
+#define CENTER_FREQ (975*100*1000)
+#define SAMPLE_RATE (2000000)
+#define SYNC_LEN (1<<18)
+#define CAPTURE_RING_LEN (1<<24)
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include <string.h>
+#include <time.h>
+
+#include "sdr.h"
+#include "capture_thread.h"
+#include "recorder.h"
+#include "synchronize.h"
+#include "wisdom.h"
+
+static double now_sec(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return(ts.tv_sec + ts.tv_nsec * 1e-9);
+}
+
+int main(int argc, char **argv)
+{
+  if (argc < 5) {
+    fprintf(stderr, "Usage: %s <seconds> <output prefix> <device> <device> ...\n", argv[0]);
+    return(1);
+  }
+
+  double duration= atof(argv[1]);
+  const char *prefix= argv[2];
+  size_t num_devs= argc - 3;
+
+  struct sdr devs[num_devs];
+  struct capture_thread caps[num_devs];
+  struct recorder recs[num_devs];
+
+  ws_load(ws_default_path());
+
+  for (size_t i=0; i<num_devs; i++) {
+    char path[4096];
+
+    snprintf(path, sizeof(path), "%s%ld.sofirec", prefix, i);
+
+    fprintf(stderr, "Record %s to %s\n", argv[i + 3], path);
+
+    if (!sdr_open(&devs[i], argv[i + 3]) ||
+        !sdr_connect_buffers(&devs[i], 8) ||
+        !sdr_set_center_freq(&devs[i], CENTER_FREQ) ||
+        !ct_setup(&caps[i], &devs[i], CAPTURE_RING_LEN) ||
+        !rec_open(&recs[i], path, &devs[i], i, num_devs, SAMPLE_RATE, CENTER_FREQ) ||
+        !ct_set_recorder(&caps[i], &recs[i])) {
+      return(1);
+    }
+  }
+
+  for (size_t i=0; i<num_devs; i++) {
+    if (!sdr_start(&devs[i]) || !ct_start(&caps[i])) {
+      return(1);
+    }
+  }
+
+  for (size_t i=num_devs; i-- > 0;) {
+    if (!sdr_set_sample_rate(&devs[i], SAMPLE_RATE)) {
+      return(1);
+    }
+  }
+
+  float delays[num_devs];
+
+  if (!sync_sdrs(caps, num_devs, SYNC_LEN, SYNC_WEIGHT_PHAT, delays)) {
+    return(1);
+  }
+
+  /* After syncing the read positions of all
+   * rings point to the same instant. The recordings
+   * hold the same bytes as the rings, padding included */
+  for (size_t i=0; i<num_devs; i++) {
+    size_t sample_size= sdr_sample_size(sdr_format(&devs[i]));
+
+    rec_set_sync_offset(&recs[i], ct_consumed(&caps[i]) / sample_size, delays[i]);
+  }
+
+  fprintf(stderr, "Recording for %.1fs\n", duration);
+
+  /* The capture threads queue the samples for the
+   * recorders, just keep the rings drained */
+  for (double end= now_sec() + duration; now_sec() < end; ) {
+    for (size_t i=0; i<num_devs; i++) {
+      if (ct_peek(&caps[i], SIZE_MAX, NULL) < 0 || !ct_done(&caps[i])) {
+        return(1);
+      }
+    }
+  }
+
+  bool ok= true;
+
+  for (size_t i=0; i<num_devs; i++) {
+    ok= ct_stop(&caps[i]) && ok;
+    ok= (caps[i].rec != NULL) && ok;
+    ok= rec_close(&recs[i]) && ok;
+    ok= sdr_stop(&devs[i]) && ok;
+  }
+
+  fprintf(stderr, "Recording %s\n", ok ? "done" : "failed");
+
+  return(ok ? 0 : 1);
+}
@@ -0,0 +1,162 @@
+/*
+ * Copyright 2016 Leonard Göhrs <leonard@goehrs.eu>
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+
+/* A stand-in rtl_tcp server. It serves the samples
+ * of any sdr backend, e.g. a recording or the
+ * synthetic generator, to one rtl_tcp client at a time.
+ *
+ * Usage: sofi_rtl_tcp <port> <device> */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "sdr.h"
+#include "rtl_tcp.h"
+
+static bool handle_command(struct sdr *dev, int client)
+{
+  uint8_t msg[RTL_TCP_CMD_LEN];
+
+  if (recv(client, msg, sizeof(msg), MSG_WAITALL) != sizeof(msg)) {
+    return(false);
+  }
+
+  uint32_t param= rtl_tcp_unpack_u32(msg + 1);
+
+  switch (msg[0]) {
+  case RTL_TCP_SET_FREQ:
+    fprintf(stderr, "Set center frequency %u\n", param);
+    sdr_set_center_freq(dev, param);
+    break;
+
+  case RTL_TCP_SET_SAMPLE_RATE:
+    fprintf(stderr, "Set sample rate %u\n", param);
+    sdr_set_sample_rate(dev, param);
+    break;
+
+  default:
+    fprintf(stderr, "Ignoring command 0x%02x %u\n", msg[0], param);
+  }
+
+  return(true);
+}
+
+static void serve_client(struct sdr *dev, int client)
+{
+  uint8_t hdr[RTL_TCP_HEADER_LEN];
+
+  memcpy(hdr, RTL_TCP_MAGIC, 4);
+  rtl_tcp_pack_u32(hdr + 4, 0);
+  rtl_tcp_pack_u32(hdr + 8, 0);
+
+  if (send(client, hdr, sizeof(hdr), MSG_NOSIGNAL) != sizeof(hdr)) {
+    return;
+  }
+
+  for (;;) {
+    struct pollfd pfd= {.fd= client, .events= POLLIN};
+
+    while (poll(&pfd, 1, 0) > 0) {
+      if (!handle_command(dev, client)) {
+        return;
+      }
+    }
+
+    void *samples;
+    ssize_t len= sdr_peek(dev, SIZE_MAX, &samples);
+
+    if (len < 0) {
+      return;
+    }
+
+    for (ssize_t pos= 0; pos < len; ) {
+      ssize_t wr= send(client, (uint8_t *)samples + pos, len - pos, MSG_NOSIGNAL);
+
+      if (wr <= 0) {
+        sdr_done(dev);
+        return;
+      }
+
+      pos+= wr;
+    }
+
+    if (!sdr_done(dev)) {
+      return;
+    }
+  }
+}
+
+int main(int argc, char **argv)
+{
+  if (argc != 3) {
+    fprintf(stderr, "Usage: %s <port> <device>\n", argv[0]);
+    return(1);
+  }
+
+  struct sdr dev;
+
+  if (!sdr_open(&dev, argv[2]) || !sdr_connect_buffers(&dev, 8) ||
+      !sdr_start(&dev)) {
+    return(1);
+  }
+
+  int srv= socket(AF_INET6, SOCK_STREAM, 0);
+  int one= 1;
+
+  struct sockaddr_in6 addr= {0};
+  addr.sin6_family= AF_INET6;
+  addr.sin6_addr= in6addr_any;
+  addr.sin6_port= htons(atoi(argv[1]));
+
+  if (srv < 0 ||
+      setsockopt(srv, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) < 0 ||
+      bind(srv, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+      listen(srv, 1) < 0) {
+    fprintf(stderr, "Listening on port %s failed (%s)\n", argv[1], strerror(errno));
+    return(1);
+  }
+
+  fprintf(stderr, "Serving %s on port %s\n", argv[2], argv[1]);
+
+  for (;;) {
+    int client= accept(srv, NULL, NULL);
+
+    if (client < 0) {
+      fprintf(stderr, "accept failed (%s)\n", strerror(errno));
+      continue;
+    }
+
+    fprintf(stderr, "Client connected\n");
+
+    serve_client(&dev, client);
+    close(client);
+
+    fprintf(stderr, "Client disconnected\n");
+  }
+}
@@ -0,0 +1,102 @@
+/*
+ * Copyright 2016 Leonard Göhrs <leonard@goehrs.eu>
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+
+/* This tool trains FFTW wisdom for every transform
+ * SoFi uses, using the FFTW_PATIENT planner.
+ * The wisdom is stored in the file libsofi loads
+ * at startup, so later starts get good plans
+ * without measuring anything.
+ *
+ * Usage: sofi_wisdom [wisdom file] */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include <fftw3.h>
+
+#include "fft_thread.h"
+#include "synchronize.h"
+#include "wisdom.h"
+
+/* Keep these in sync with the users */
+static const struct {
+  const char *user;
+  size_t len;
+  size_t batch_len;
+  bool sync;
+} problems[]= {
+  {"libsofi fft threads",    1024,    4, false},
+  {"drift tracker",          1024,    1, true},
+  {"rf_monitor fft threads", 128,     4, false},
+  {"sync_sdrs transforms",   1<<14,   1, false},
+  {"sync_sdrs correlation",  1<<14,   1, true},
+};
+
+int main(int argc, char **argv)
+{
+  const char *path= (argc > 1) ? argv[1] : ws_default_path();
+
+  if (!path) {
+    fprintf(stderr, "sofi_wisdom: no wisdom file given and $HOME is not set\n");
+    return(1);
+  }
+
+  ws_load(path);
+
+  for (size_t pi=0; pi < sizeof(problems)/sizeof(*problems); pi++) {
+    size_t len= problems[pi].len * problems[pi].batch_len;
+
+    fftwf_complex *in= fftwf_alloc_complex(len);
+    fftwf_complex *out= fftwf_alloc_complex(len);
+
+    if (!in || !out) {
+      fprintf(stderr, "sofi_wisdom: allocating buffers failed\n");
+      return(1);
+    }
+
+    fprintf(stderr, "sofi_wisdom: planning %s (%ld x %ld)\n",
+            problems[pi].user, problems[pi].batch_len, problems[pi].len);
+
+    fftwf_plan plan= problems[pi].sync
+      ? sync_plan(problems[pi].len, in, out, FFTW_PATIENT)
+      : ft_plan(problems[pi].len, problems[pi].batch_len, in, out, FFTW_PATIENT);
+
+    if (!plan) {
+      fprintf(stderr, "sofi_wisdom: planning failed\n");
+      return(1);
+    }
+
+    fftwf_destroy_plan(plan);
+    fftwf_free(in);
+    fftwf_free(out);
+
+    /* Save after every problem, the patient
+     * planner may take a while */
+    if (!ws_save(path)) {
+      return(1);
+    }
+  }
+
+  fprintf(stderr, "sofi_wisdom: wisdom written to %s\n", path);
+
+  return(0);
+}
@@ -0,0 +1,92 @@
+/*
+ * Copyright 2016 Leonard Göhrs <leonard@goehrs.eu>
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+
+#include "stats.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+void st_latency_init(struct st_latency *lat)
+{
+  atomic_init(&lat->count, 0);
+  atomic_init(&lat->sum_ns, 0);
+  atomic_init(&lat->max_ns, 0);
+
+  for (size_t bi=0; bi<ST_HIST_BUCKETS; bi++) {
+    atomic_init(&lat->buckets[bi], 0);
+  }
+}
+
+/**
+ * Add the current values of lat to dst
+ */
+void st_latency_read(struct st_latency *lat, struct st_histogram *dst)
+{
+  uint64_t max_ns= st_load(&lat->max_ns);
+
+  dst->count+= st_load(&lat->count);
+  dst->sum_ns+= st_load(&lat->sum_ns);
+
+  if (max_ns > dst->max_ns) dst->max_ns= max_ns;
+
+  for (size_t bi=0; bi<ST_HIST_BUCKETS; bi++) {
+    dst->buckets[bi]+= st_load(&lat->buckets[bi]);
+  }
+}
+
+/**
+ * Estimate the p-th percentile (0 to 1) in us.
+ * Gives the upper bound of the bucket it falls into,
+ * so the result is at most a factor of two too large.
+ */
+double st_percentile_us(const struct st_histogram *hist, double p)
+{
+  uint64_t total= 0;
+
+  for (size_t bi=0; bi<ST_HIST_BUCKETS; bi++) {
+    total+= hist->buckets[bi];
+  }
+
+  if (!total) {
+    return(0);
+  }
+
+  uint64_t rank= p * (total - 1) + 1;
+  uint64_t seen= 0;
+
+  for (size_t bi=0; bi<ST_HIST_BUCKETS; bi++) {
+    seen+= hist->buckets[bi];
+
+    if (seen >= rank) {
+      double upper_ns= (double)(2ull << bi);
+
+      return((upper_ns < hist->max_ns ? upper_ns : hist->max_ns) / 1000.0);
+    }
+  }
+
+  return(hist->max_ns / 1000.0);
+}
+
+double st_mean_us(const struct st_histogram *hist)
+{
+  return(hist->count ? (hist->sum_ns / 1000.0) / hist->count : 0);
+}
@@ -0,0 +1,140 @@
+/*
+ * Copyright 2016 Leonard Göhrs <leonard@goehrs.eu>
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+
+#include <time.h>
+
+/* Hot path statistics.
+ *
+ * Every counter block is written by exactly one thread,
+ * so an update is a relaxed load and store and never a
+ * locked read-modify-write. Readers load the counters at
+ * any time without synchronizing with the writer, the
+ * values they get may be a few updates old. */
+
+/* Bucket i of a histogram counts values
+ * in [2^i, 2^(i+1)) ns, bucket 0 also counts 0 */
+#define ST_HIST_BUCKETS (32)
+
+struct st_latency {
+  _Atomic uint64_t count;
+  _Atomic uint64_t sum_ns;
+  _Atomic uint64_t max_ns;
+  _Atomic uint64_t buckets[ST_HIST_BUCKETS];
+};
+
+/* Plain copy of one or the sum of multiple st_latency */
+struct st_histogram {
+  uint64_t count;
+  uint64_t sum_ns;
+  uint64_t max_ns;
+  uint64_t buckets[ST_HIST_BUCKETS];
+};
+
+/* The statistics of all stages, summed up over all
+ * devices. Filled by the *_get_stats functions of
+ * the modules. The layout is mirrored in __init__.py */
+struct st_report {
+  /* Capture threads, only for live devices */
+  uint64_t capture_buffers;
+  uint64_t capture_bytes;
+  uint64_t capture_dropped;
+  uint64_t capture_gaps;
+  uint64_t capture_padded;
+  uint64_t capture_skipped;
+  uint64_t capture_lost_sync;
+  uint64_t capture_rec_stopped;
+  uint64_t ring_overruns;
+  uint64_t ring_fill;
+  uint64_t ring_fill_max;
+  uint64_t ring_len;
+  struct st_histogram dequeue;
+  struct st_histogram ring_write;
+
+  /* Fft threads */
+  uint64_t fft_frames;
+  uint64_t fft_buffers;
+  uint64_t fft_in_use;
+  uint64_t fft_in_use_max;
+  struct st_histogram fft_load;
+  struct st_histogram fft_compute;
+  struct st_histogram fft_latency;
+  struct st_histogram fft_buffer_wait;
+
+  /* Combiner */
+  uint64_t results;
+  uint64_t results_dropped;
+  struct st_histogram combiner_wait;
+  struct st_histogram combiner_step;
+
+  /* Drift tracker */
+  uint64_t drift_measurements;
+  uint64_t drift_slips;
+};
+
+static inline uint64_t st_now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return(ts.tv_sec * 1000000000ull + ts.tv_nsec);
+}
+
+static inline uint64_t st_load(_Atomic uint64_t *ctr)
+{
+  return(atomic_load_explicit(ctr, memory_order_relaxed));
+}
+
+/* Only for counters that have a single writer */
+static inline void st_add(_Atomic uint64_t *ctr, uint64_t val)
+{
+  atomic_store_explicit(ctr, st_load(ctr) + val, memory_order_relaxed);
+}
+
+static inline void st_max(_Atomic uint64_t *ctr, uint64_t val)
+{
+  if (val > st_load(ctr)) {
+    atomic_store_explicit(ctr, val, memory_order_relaxed);
+  }
+}
+
+static inline void st_latency_add(struct st_latency *lat, uint64_t ns)
+{
+  size_t bucket= ns ? 63 - __builtin_clzll(ns) : 0;
+
+  if (bucket >= ST_HIST_BUCKETS) bucket= ST_HIST_BUCKETS - 1;
+
+  st_add(&lat->count, 1);
+  st_add(&lat->sum_ns, ns);
+  st_max(&lat->max_ns, ns);
+  st_add(&lat->buckets[bucket], 1);
+}
+
+void st_latency_init(struct st_latency *lat);
+void st_latency_read(struct st_latency *lat, struct st_histogram *dst);
+double st_percentile_us(const struct st_histogram *hist, double p);
+double st_mean_us(const struct st_histogram *hist);
@@ -22,7 +22,6 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <stdlib.h>
-#include <float.h>
 
 #include <errno.h>
 #include <string.h>
@@ -31,11 +30,14 @@
 
 #include <math.h>
 
-#include "sdr.h"
+#include "capture_thread.h"
 #include "fft_thread.h"
+#include "convert.h"
+#include "synchronize.h"
 #include <volk/volk.h>
 
 #include "window.h"
+#include "wisdom.h"
 
 inline float mag_squared(fftwf_complex z)
 {
@@ -64,157 +66,612 @@ inline int64_t arr_max(int64_t *vals, size_t len)
   return(max);
 }
 
-bool sync_sdrs(struct sdr *devs, size_t num_devs, size_t sync_len)
+/**
+ * Create the inverse transform used to calculate correlations.
+ * Exported so that wisdom can be trained for it.
+ */
+fftwf_plan sync_plan(size_t sync_len, fftwf_complex *in, fftwf_complex *out,
+                     unsigned flags)
 {
-  if (!devs || !num_devs) {
-    fprintf(stderr, "sync_sdrs: no devices\n");
-    return(false);
+  return(ws_plan_dft(sync_len, 1, in, out, FFTW_BACKWARD, flags));
+}
+
+/* Iterations of the golden section search for the
+ * fractional peak, each shrinks the interval to 62% */
+#define SYNC_REFINE_STEPS (24)
+
+/**
+ * Squared magnitude of the correlation at a fractional lag,
+ * evaluated as the inverse DTFT of the cross spectrum.
+ * The signed bins -sync_len/2 to sync_len/2-1 are summed,
+ * which interpolates the band limited correlation exactly.
+ */
+static double sync_correlation_at(fftwf_complex *cross, size_t sync_len, double lag)
+{
+  const float *c= (const float *)cross;
+
+  double step= 2 * M_PI * lag / sync_len;
+  double step_re= cos(step), step_im= sin(step);
+
+  /* Rotator starting at the most negative bin */
+  double rot_re= cos(-step * (sync_len/2));
+  double rot_im= sin(-step * (sync_len/2));
+
+  double sum_re= 0, sum_im= 0;
+
+  for (size_t i=0; i<sync_len; i++) {
+    size_t k= (i + sync_len/2) % sync_len;
+
+    sum_re+= c[2*k]*rot_re - c[2*k+1]*rot_im;
+    sum_im+= c[2*k]*rot_im + c[2*k+1]*rot_re;
+
+    double re= rot_re*step_re - rot_im*step_im;
+    rot_im= rot_re*step_im + rot_im*step_re;
+    rot_re= re;
+  }
+
+  return(sum_re*sum_re + sum_im*sum_im);
+}
+
+/**
+ * Position of the correlation maximum next to the
+ * integer lag peak, relative to it, between -0.5 and 0.5.
+ * The maximum is searched for using a golden section search
+ * on the correlation interpolated from the cross spectrum.
+ */
+double sync_refine_peak(fftwf_complex *cross, size_t sync_len, int64_t peak)
+{
+  const double ratio= (sqrt(5) - 1) / 2;
+
+  double lo= -0.5, hi= 0.5;
+  double x1= hi - ratio * (hi - lo);
+  double x2= lo + ratio * (hi - lo);
+  double y1= sync_correlation_at(cross, sync_len, peak + x1);
+  double y2= sync_correlation_at(cross, sync_len, peak + x2);
+
+  for (int step=0; step<SYNC_REFINE_STEPS; step++) {
+    if (y1 > y2) {
+      hi= x2;
+      x2= x1;
+      y2= y1;
+      x1= hi - ratio * (hi - lo);
+      y1= sync_correlation_at(cross, sync_len, peak + x1);
+    }
+    else {
+      lo= x1;
+      x1= x2;
+      y1= y2;
+      x2= lo + ratio * (hi - lo);
+      y2= sync_correlation_at(cross, sync_len, peak + x2);
+    }
   }
 
-  float *window= window_hamming(sync_len);
-  if(!window) {
+  return((lo + hi) / 2);
+}
+
+/* Samples at the start of the stream that are thrown
+ * away, they may still be recorded at the old sample rate */
+#define SYNC_SETTLE (1<<17)
+
+/* The coarse search correlates sums of this many samples */
+#define SYNC_DECIMATION (16)
+
+/* Length of the full resolution correlation and the lags
+ * it searches. The range covers a few coarse steps */
+#define SYNC_FINE_LEN (1<<14)
+#define SYNC_FINE_RANGE (4 * SYNC_DECIMATION)
+
+/* Give up if the fine search does not agree by then */
+#define SYNC_MAX_ROUNDS (16)
+
+/* Correlation peaks closer than this many standard deviations
+ * to the mean of the rest of the correlation are not trusted,
+ * lags within SYNC_PSR_EXCLUDE of the peak are not part of the rest.
+ * Noise alone reaches about 6 after GCC-PHAT. Without weighting
+ * the broad peak of narrowband signals is mostly counted as
+ * sidelobes, so only ambiguous correlations are rejected */
+#define SYNC_MIN_PSR_PHAT (8)
+#define SYNC_MIN_PSR_NONE (2)
+#define SYNC_PSR_EXCLUDE (4)
+
+/* Bins are normalized to magnitude 1 using GCC-PHAT, this
+ * fraction of the mean magnitude keeps empty bins from
+ * being amplified to full weight */
+#define SYNC_PHAT_FLOOR (1e-3f)
+
+/* Samples are converted in chunks of this length, longer
+ * converters take long to set up (see cv_profile_kernels) */
+#define SYNC_CONVERT_LEN (1<<14)
+
+/* One resolution of the search */
+struct sync_stage {
+  size_t len;
+  size_t decimation;
+  size_t fft_len;
+
+  /* Lags up to +-max_lag fft bins are searched */
+  int64_t max_lag;
+  bool refine;
+
+  /* Applied after the decimation */
+  float *window;
+  fftwf_plan forward;
+  fftwf_plan inverse;
+};
+
+struct sync_state {
+  struct capture_thread *caps;
+  size_t num_devs;
+  enum sync_weighting weighting;
+
+  /* Per device, without window */
+  struct converter *convs;
+
+  struct sync_stage *stage;
+
+  /* Per device, cross and correlation are unused for the first one */
+  fftwf_complex **samples;
+  fftwf_complex **spectra;
+  fftwf_complex **cross;
+  fftwf_complex **correlation;
+
+  /* Results of the pair searches, relative to the first device */
+  int64_t *shifts;
+  float *fractions;
+  bool *at_edge;
+  float *psr;
+};
+
+struct sync_job {
+  struct sync_state *st;
+  size_t dev;
+  pthread_t thread;
+  bool ok;
+};
+
+static bool sync_stage_init(struct sync_stage *stage, size_t len, size_t decimation,
+                            int64_t max_lag, bool refine,
+                            fftwf_complex *in, fftwf_complex *out)
+{
+  stage->len= len;
+  stage->decimation= decimation;
+  stage->fft_len= len / decimation;
+  stage->max_lag= max_lag;
+  stage->refine= refine;
+
+  stage->window= window_hamming(stage->fft_len);
+
+  if (!stage->window) {
     fprintf(stderr, "sync_sdrs: creating window function failed\n");
     return(false);
   }
 
-  struct fft_thread ffts[num_devs];
+  stage->forward= ft_plan(stage->fft_len, 1, in, out, FFTW_ESTIMATE);
+  stage->inverse= sync_plan(stage->fft_len, in, out, FFTW_ESTIMATE);
 
-  for (size_t i=0; i<num_devs; i++) {
-    fprintf(stderr, "sync_sdrs: setting up dev %ld\n", i);
+  if (!stage->forward || !stage->inverse) {
+    fprintf(stderr, "sync_sdrs: fftwf_plan failed\n");
+    return(false);
+  }
 
-    if (!ft_setup(&ffts[i], &devs[i], window, sync_len, 1, 1, false)) {
-      fprintf(stderr, "sync_sdrs: ft_setup failed\n");
-      return(false);
+  return(true);
+}
+
+static void sync_stage_destroy(struct sync_stage *stage)
+{
+  free(stage->window);
+
+  fftwf_destroy_plan(stage->forward);
+  fftwf_destroy_plan(stage->inverse);
+}
+
+/**
+ * Read the next stage->len samples of a device, add up
+ * groups of decimation samples, window and transform them
+ */
+static void *sync_acquire_main(void *dat)
+{
+  struct sync_job *job= dat;
+  struct sync_state *st= job->st;
+  struct sync_stage *stage= st->stage;
+  struct capture_thread *ct= &st->caps[job->dev];
+  struct converter *cv= &st->convs[job->dev];
+  fftwf_complex *samples= st->samples[job->dev];
+
+  job->ok= false;
+
+  for(size_t pos=0; pos < stage->len;) {
+    void *raw;
+
+    size_t chunk_pos= pos % cv->len_fft;
+    size_t chunk_rem= cv->len_fft - chunk_pos;
+
+    if (chunk_rem > stage->len - pos) chunk_rem= stage->len - pos;
+
+    ssize_t bytes_rd= ct_peek(ct, cv->sample_size * chunk_rem, &raw);
+
+    if (bytes_rd < 0) {
+      return(NULL);
     }
 
-    if (!ft_start(&ffts[i])) {
-      fprintf(stderr, "sync_sdrs: ft_start failed\n");
-      return(false);
+    size_t samples_rd= bytes_rd / cv->sample_size;
+
+    cv_convert(cv, samples + pos - chunk_pos, raw, chunk_pos, samples_rd);
+    pos+= samples_rd;
+
+    if (!ct_done(ct)) {
+      return(NULL);
     }
   }
 
-  fftwf_complex *conjugate= fftwf_alloc_complex(sync_len);
-  fftwf_complex *correlation= fftwf_alloc_complex(sync_len);
-  if(!conjugate || !correlation) {
-    fprintf(stderr, "sync_sdrs: allocating correlation buffers faileded\n");
+  float *smp= (float *)samples;
 
-    return(false);
+  for (size_t o=0; o<stage->fft_len; o++) {
+    float re= 0, im= 0;
+
+    for (size_t i= o * stage->decimation; i < (o + 1) * stage->decimation; i++) {
+      re+= smp[2*i];
+      im+= smp[2*i + 1];
+    }
+
+    smp[2*o]= re * stage->window[o];
+    smp[2*o + 1]= im * stage->window[o];
   }
 
-  fftwf_plan plan= fftwf_plan_dft_1d(sync_len, conjugate, correlation,
-                                     FFTW_BACKWARD, FFTW_ESTIMATE);
-  if (!plan) {
-    fprintf(stderr, "sync_sdrs: fftwf_plan failed\n");
-    return(false);
+  fftwf_execute_dft(stage->forward, samples, st->spectra[job->dev]);
+
+  job->ok= true;
+
+  return(NULL);
+}
+
+/**
+ * GCC-PHAT weighting: normalize every bin of the cross spectrum
+ * to unit magnitude, so that only the phase slope is left.
+ * Strong narrowband carriers no longer dominate the correlation
+ * with their broad peak and the peak of the wideband parts
+ * becomes sharp.
+ */
+static void sync_phat(fftwf_complex *cross, float *mag, size_t len)
+{
+  float *c= (float *)cross;
+  double sum= 0;
+
+  volk_32fc_magnitude_squared_32f(mag, (lv_32fc_t *)cross, len);
+
+  for (size_t i=0; i<len; i++) {
+    mag[i]= sqrtf(mag[i]);
+    sum+= mag[i];
   }
 
-  bool synced= false;
+  float bias= SYNC_PHAT_FLOOR * sum / len;
 
-  for(uint64_t frame=0; !synced; frame++) {
-    fprintf(stderr, "sync_sdrs: syncing frame %ld\n", frame);
+  for (size_t i=0; i<len; i++) {
+    float weight= 1.0f / (mag[i] + bias);
 
-    struct fft_buffer *bufs[num_devs];
+    c[2*i]*= weight;
+    c[2*i + 1]*= weight;
+  }
+}
 
-    for (size_t i=0; i<num_devs; i++) {
-      bufs[i]= ft_get_frame(&ffts[i], frame);
-      if(!bufs[i]) {
-        fprintf(stderr, "sync_sdrs: retrieving fft failed\n");
-        return(false);
-      }
-    }
+/**
+ * Peak to sidelobe ratio of a correlation: the distance of
+ * the peak from the mean of all lags further than
+ * SYNC_PSR_EXCLUDE away from it, in standard deviations.
+ * mag is used as scratch space.
+ */
+static float sync_psr(fftwf_complex *correlation, float *mag, size_t len, int64_t peak)
+{
+  double sum= 0, sum_sq= 0;
+  size_t count= 0;
 
-    int64_t shifts[num_devs];
-    shifts[0]= 0;
+  volk_32fc_magnitude_squared_32f(mag, (lv_32fc_t *)correlation, len);
 
-    for (size_t sdev=1; sdev<num_devs; sdev++) {
-      volk_32fc_x2_multiply_conjugate_32fc((lv_32fc_t *)conjugate,
-                                           (lv_32fc_t *)bufs[0]->out,
-                                           (lv_32fc_t *)bufs[sdev]->out,
-                                           sync_len);
+  for (size_t i=0; i<len; i++) {
+    int64_t lag= (i < len/2) ? (int64_t)i : (int64_t)i - (int64_t)len;
 
-      fftwf_execute(plan);
+    if (llabs(lag - peak) <= SYNC_PSR_EXCLUDE) continue;
 
-      struct {
-        float mag_sq;
-        int64_t shift;
-      } maximum= { .mag_sq=FLT_MIN, .shift=0};
+    double m= sqrt(mag[i]);
 
-      // Check if maximum correlation is in left half of fft (negative shift)
-      for (uint32_t i=0; i<sync_len/2; i++) {
-        float ms= mag_squared(correlation[i])/window[i];
+    sum+= m;
+    sum_sq+= m*m;
+    count++;
+  }
 
-        if (ms > maximum.mag_sq) {
-          maximum.mag_sq= ms;
-          maximum.shift= -(int64_t)i;
-        }
-      }
+  size_t peak_idx= (peak < 0) ? (size_t)(peak + (int64_t)len) : (size_t)peak;
+
+  double mean= sum / count;
+  double dev= sqrt(sum_sq / count - mean*mean);
 
-      // Or right half of fft (positive shift)
-      for (uint32_t f=1, r=sync_len-1; f<sync_len/2; f++, r--) {
-        float ms= mag_squared(correlation[r])/window[r];
+  return(dev > 0 ? (sqrt(mag[peak_idx]) - mean) / dev : 0);
+}
+
+/**
+ * Correlate a device with the first one and find
+ * the peak within the lags of the stage
+ */
+static void *sync_correlate_main(void *dat)
+{
+  struct sync_job *job= dat;
+  struct sync_state *st= job->st;
+  struct sync_stage *stage= st->stage;
+  size_t dev= job->dev;
+  size_t len= stage->fft_len;
+
+  volk_32fc_x2_multiply_conjugate_32fc((lv_32fc_t *)st->cross[dev],
+                                       (lv_32fc_t *)st->spectra[0],
+                                       (lv_32fc_t *)st->spectra[dev],
+                                       len);
+
+  /* The samples buffer is not needed after the transform */
+  float *scratch= (float *)st->samples[dev];
+
+  if (st->weighting == SYNC_WEIGHT_PHAT) {
+    sync_phat(st->cross[dev], scratch, len);
+  }
 
-        if (ms > maximum.mag_sq) {
-          maximum.mag_sq= ms;
-          maximum.shift= f;
-        }
+  fftwf_execute_dft(stage->inverse, st->cross[dev], st->correlation[dev]);
+
+  struct {
+    float mag_sq;
+    int64_t lag;
+  } maximum= { .mag_sq=-1, .lag=0};
+
+  for (int64_t lag= -stage->max_lag; lag <= stage->max_lag; lag++) {
+    size_t idx= (lag < 0) ? (size_t)(lag + (int64_t)len) : (size_t)lag;
+    float ms= mag_squared(st->correlation[dev][idx]);
+
+    if (ms > maximum.mag_sq) {
+      maximum.mag_sq= ms;
+      maximum.lag= lag;
+    }
+  }
+
+  /* The shift is the negated correlation lag */
+  st->shifts[dev]= -maximum.lag * (int64_t)stage->decimation;
+  st->at_edge[dev]= (maximum.lag == -stage->max_lag || maximum.lag == stage->max_lag);
+  st->fractions[dev]= stage->refine
+    ? -sync_refine_peak(st->cross[dev], len, maximum.lag)
+    : 0;
+  st->psr[dev]= sync_psr(st->correlation[dev], scratch, len, maximum.lag);
+
+  job->ok= true;
+
+  return(NULL);
+}
+
+/**
+ * Run fn for the devices first to num_devs-1 in parallel
+ */
+static bool sync_parallel(struct sync_state *st, void *(*fn)(void *), size_t first)
+{
+  struct sync_job jobs[st->num_devs];
+  bool ok= true;
+
+  for (size_t i=first; i<st->num_devs; i++) {
+    jobs[i].st= st;
+    jobs[i].dev= i;
+    jobs[i].ok= false;
+
+    if (pthread_create(&jobs[i].thread, NULL, fn, &jobs[i]) != 0) {
+      fprintf(stderr, "sync_sdrs: pthread_create failed\n");
+
+      for (size_t j=first; j<i; j++) {
+        pthread_join(jobs[j].thread, NULL);
       }
 
-      shifts[sdev]= maximum.shift;
+      return(false);
     }
+  }
+
+  for (size_t i=first; i<st->num_devs; i++) {
+    pthread_join(jobs[i].thread, NULL);
+
+    ok= ok && jobs[i].ok;
+  }
+
+  return(ok);
+}
 
-    // Output the offsets
-    fprintf(stderr, "sync_sdrs: receiver offsets: ");
-    for(size_t dev=0; dev<num_devs; dev++) fprintf(stderr, "%li ", shifts[dev]);
-    fprintf(stderr, "\n");
+/**
+ * Measure the offsets of all devices at the resolution of
+ * stage and skip samples on the devices that are ahead.
+ * Nothing is skipped and *trusted is cleared if any of the
+ * correlation peaks is not clearly above its sidelobes.
+ */
+static bool sync_round(struct sync_state *st, struct sync_stage *stage, bool *trusted)
+{
+  st->stage= stage;
 
-    int64_t min_shift= arr_min(shifts, num_devs);
-    int64_t max_shift= arr_max(shifts, num_devs);
+  if (!sync_parallel(st, sync_acquire_main, 0) ||
+      !sync_parallel(st, sync_correlate_main, 1)) {
+    fprintf(stderr, "sync_sdrs: reading or correlating samples failed\n");
 
-    synced= min_shift == max_shift;
+    return(false);
+  }
 
-    for(size_t dev=0; dev<num_devs; dev++) {
-      shifts[dev]-= min_shift;
+  float min_psr= (st->weighting == SYNC_WEIGHT_PHAT) ? SYNC_MIN_PSR_PHAT : SYNC_MIN_PSR_NONE;
+
+  *trusted= true;
+
+  for (size_t dev=1; dev<st->num_devs; dev++) {
+    if (st->psr[dev] < min_psr) *trusted= false;
+  }
+
+  if (!*trusted) {
+    return(true);
+  }
+
+  int64_t min_shift= arr_min(st->shifts, st->num_devs);
+
+  for (size_t dev=0; dev<st->num_devs; dev++) {
+    size_t skip= (st->shifts[dev] - min_shift) * sdr_sample_size(sdr_format(st->caps[dev].dev));
+
+    if (skip && !ct_seek(&st->caps[dev], skip)) {
+      return(false);
     }
+  }
 
-    for(size_t dev=0; dev<num_devs; dev++) {
-      /* frame 0 can not be trusted as the sample rate
-       * is changed while it is recored */
-      if(frame >= 1) {
-        // Read shifts[dev] 2-byte samples
-        sdr_seek(&devs[dev], shifts[dev] * 2);
-      }
+  return(true);
+}
+
+/**
+ * Align the sample streams of all devices by skipping samples.
+ *
+ * Coarse offsets of up to +-sync_len/2 samples are found
+ * by correlating sums of SYNC_DECIMATION samples.
+ * Short full resolution correlations, searched only around
+ * zero lag, then remove what is left until all devices agree.
+ * The correlations of all pairs run in parallel.
+ * Rounds whose correlation peaks do not stand out from the
+ * sidelobes by SYNC_MIN_PSR_* are discarded and the search
+ * starts over with the coarse resolution on new samples.
+ *
+ * @param weighting SYNC_WEIGHT_PHAT to whiten the cross spectra
+ *        before correlating them, which gives sharp peaks even
+ *        for narrowband signals. SYNC_WEIGHT_NONE correlates
+ *        the plain spectra.
+ * @param delays NULL or num_devs values that receive the delay
+ *        of every device relative to the first one that is left
+ *        after the alignment, in fractions of a sample.
+ *        See cb_set_delays.
+ */
+bool sync_sdrs(struct capture_thread *caps, size_t num_devs, size_t sync_len,
+               enum sync_weighting weighting, float *delays)
+{
+  if (!caps || !num_devs) {
+    fprintf(stderr, "sync_sdrs: no devices\n");
+    return(false);
+  }
+
+  if (sync_len < SYNC_FINE_LEN || sync_len % SYNC_DECIMATION) {
+    fprintf(stderr, "sync_sdrs: sync length %ld is too short\n", sync_len);
+    return(false);
+  }
+
+  struct sync_state st= {.caps= caps, .num_devs= num_devs, .weighting= weighting};
+
+  st.convs= calloc(num_devs, sizeof(*st.convs));
+  st.samples= calloc(num_devs, sizeof(*st.samples));
+  st.spectra= calloc(num_devs, sizeof(*st.spectra));
+  st.cross= calloc(num_devs, sizeof(*st.cross));
+  st.correlation= calloc(num_devs, sizeof(*st.correlation));
+  st.shifts= calloc(num_devs, sizeof(*st.shifts));
+  st.fractions= calloc(num_devs, sizeof(*st.fractions));
+  st.at_edge= calloc(num_devs, sizeof(*st.at_edge));
+  st.psr= calloc(num_devs, sizeof(*st.psr));
+
+  if (!st.convs || !st.samples || !st.spectra || !st.cross || !st.correlation ||
+      !st.shifts || !st.fractions || !st.at_edge || !st.psr) {
+    fprintf(stderr, "sync_sdrs: allocating state failed\n");
+    return(false);
+  }
+
+  size_t spec_len= sync_len / SYNC_DECIMATION;
+  if (spec_len < SYNC_FINE_LEN) spec_len= SYNC_FINE_LEN;
+
+  for (size_t i=0; i<num_devs; i++) {
+    if (!cv_init(&st.convs[i], NULL, SYNC_CONVERT_LEN, sdr_format(caps[i].dev))) {
+      return(false);
     }
 
-    /* Note: Do not release the fft buffer before the
-     * receiver realignement is made.
-     * Otherwise the fft thread might be reading from the device */
-    for (size_t i=0; i<num_devs; i++) {
-      if(synced) {
-        if (!ft_stop(&ffts[i])) {
-          fprintf(stderr, "sync_sdrs: stopping fft failed\n");
-          return(false);
-        }
-      }
+    st.samples[i]= fftwf_alloc_complex(sync_len);
+    st.spectra[i]= fftwf_alloc_complex(spec_len);
+    st.cross[i]= fftwf_alloc_complex(spec_len);
+    st.correlation[i]= fftwf_alloc_complex(spec_len);
 
-      if (!ft_release_frame(&ffts[i], bufs[i])) {
-        fprintf(stderr, "sync_sdrs: releasing fft failed\n");
-        return(false);
-      }
+    if (!st.samples[i] || !st.spectra[i] || !st.cross[i] || !st.correlation[i]) {
+      fprintf(stderr, "sync_sdrs: allocating correlation buffers failed\n");
+      return(false);
     }
   }
 
-  fftwf_destroy_plan(plan);
-  fftwf_free(conjugate);
-  fftwf_free(correlation);
+  struct sync_stage coarse, fine;
+
+  if (!sync_stage_init(&coarse, sync_len, SYNC_DECIMATION,
+                       sync_len / SYNC_DECIMATION / 2 - 1, false,
+                       st.cross[0], st.correlation[0]) ||
+      !sync_stage_init(&fine, SYNC_FINE_LEN, 1,
+                       SYNC_FINE_RANGE, true,
+                       st.cross[0], st.correlation[0])) {
+    return(false);
+  }
 
   for (size_t i=0; i<num_devs; i++) {
-    if(!ft_destroy(&ffts[i])) {
-      fprintf(stderr, "sync_sdrs: destroying fft thread failed\n");
+    if (!ct_seek(&caps[i], SYNC_SETTLE * sdr_sample_size(sdr_format(caps[i].dev)))) {
       return(false);
     }
   }
 
-  free(window);
+  bool synced= false;
+  bool coarse_done= false;
+
+  for (int round=0; !synced; round++) {
+    if (round >= SYNC_MAX_ROUNDS) {
+      fprintf(stderr, "sync_sdrs: no lock after %d rounds\n", round);
+      return(false);
+    }
+
+    struct sync_stage *stage= coarse_done ? &fine : &coarse;
+    bool trusted;
+
+    if (!sync_round(&st, stage, &trusted)) {
+      return(false);
+    }
+
+    fprintf(stderr, "sync_sdrs: %s receiver offsets: ", coarse_done ? "fine" : "coarse");
+    for(size_t dev=1; dev<num_devs; dev++) {
+      fprintf(stderr, "%+.2f (psr %.1f) ", st.shifts[dev] + st.fractions[dev], st.psr[dev]);
+    }
+    fprintf(stderr, trusted ? "\n" : "rejected\n");
+
+    /* A weak fine peak may just as well mean that the
+     * coarse offset was wrong, so start over */
+    if (!trusted) {
+      coarse_done= false;
+      continue;
+    }
+
+    if (!coarse_done) {
+      coarse_done= true;
+      continue;
+    }
+
+    synced= arr_min(st.shifts, num_devs) == arr_max(st.shifts, num_devs);
+
+    /* An offset beyond the fine range was not corrected */
+    for (size_t dev=1; dev<num_devs; dev++) {
+      if (st.at_edge[dev]) coarse_done= false;
+    }
+  }
+
+  /* Once the integer offsets are gone the fractional
+   * parts are what the combiner has to compensate */
+  if (delays) {
+    memcpy(delays, st.fractions, sizeof(*delays) * num_devs);
+  }
+
+  sync_stage_destroy(&coarse);
+  sync_stage_destroy(&fine);
+
+  for (size_t i=0; i<num_devs; i++) {
+    cv_destroy(&st.convs[i]);
+    fftwf_free(st.samples[i]);
+    fftwf_free(st.spectra[i]);
+    fftwf_free(st.cross[i]);
+    fftwf_free(st.correlation[i]);
+  }
+
+  free(st.convs);
+  free(st.samples);
+  free(st.spectra);
+  free(st.cross);
+  free(st.correlation);
+  free(st.shifts);
+  free(st.fractions);
+  free(st.at_edge);
+  free(st.psr);
 
   return (true);
 }
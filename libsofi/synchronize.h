@@ -23,6 +23,20 @@
 #include <stdbool.h>
 #include <stdlib.h>
 
-#include "sdr.h"
+#include <fftw3.h>
 
-bool sync_sdrs(struct sdr *devs, size_t num_devs, size_t sync_len);
+#include "capture_thread.h"
+
+/* How sync_sdrs weights the cross spectra */
+enum sync_weighting {
+  SYNC_WEIGHT_NONE= 0,
+  SYNC_WEIGHT_PHAT= 1,
+};
+
+fftwf_plan sync_plan(size_t sync_len, fftwf_complex *in, fftwf_complex *out,
+                     unsigned flags);
+
+double sync_refine_peak(fftwf_complex *cross, size_t sync_len, int64_t peak);
+
+bool sync_sdrs(struct capture_thread *caps, size_t num_devs, size_t sync_len,
+               enum sync_weighting weighting, float *delays);
@@ -0,0 +1,113 @@
+/*
+ * Copyright 2016 Leonard Göhrs <leonard@goehrs.eu>
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include <errno.h>
+#include <string.h>
+
+#include <fftw3.h>
+
+#include "wisdom.h"
+
+/**
+ * The wisdom file is taken from the SOFI_WISDOM
+ * environment variable or defaults to ~/.sofi_wisdom
+ */
+const char *ws_default_path(void)
+{
+  static char path[512];
+
+  const char *env= getenv("SOFI_WISDOM");
+  if (env && *env) {
+    return(env);
+  }
+
+  const char *home= getenv("HOME");
+  if (!home) {
+    return(NULL);
+  }
+
+  snprintf(path, sizeof(path), "%s/.sofi_wisdom", home);
+
+  return(path);
+}
+
+bool ws_load(const char *path)
+{
+  if (!path) {
+    return(false);
+  }
+
+  if (!fftwf_import_wisdom_from_filename(path)) {
+    fprintf(stderr, "ws_load: no usable wisdom in %s, planning will be slow\n", path);
+    return(false);
+  }
+
+  fprintf(stderr, "ws_load: imported wisdom from %s\n", path);
+
+  return(true);
+}
+
+bool ws_save(const char *path)
+{
+  if (!path) {
+    return(false);
+  }
+
+  if (!fftwf_export_wisdom_to_filename(path)) {
+    fprintf(stderr, "ws_save: writing wisdom to %s failed\n", path);
+    return(false);
+  }
+
+  return(true);
+}
+
+/**
+ * Plan howmany adjacent complex transforms of length len.
+ *
+ * Measured wisdom is used even if flags only asks
+ * for FFTW_ESTIMATE. This way the callers that can not
+ * afford measuring at startup get fast plans
+ * once the wisdom was trained.
+ */
+fftwf_plan ws_plan_dft(size_t len, size_t howmany,
+                       fftwf_complex *in, fftwf_complex *out,
+                       int sign, unsigned flags)
+{
+  int n= len;
+
+  fftwf_plan plan= fftwf_plan_many_dft(1, &n, howmany,
+                                       in, NULL, 1, len,
+                                       out, NULL, 1, len,
+                                       sign, (flags & ~FFTW_ESTIMATE) | FFTW_WISDOM_ONLY);
+
+  if (!plan) {
+    plan= fftwf_plan_many_dft(1, &n, howmany,
+                              in, NULL, 1, len,
+                              out, NULL, 1, len,
+                              sign, flags);
+  }
+
+  return(plan);
+}
@@ -60,12 +60,7 @@ class ScopeWindow(object):
         ax.set_title('Phase spectrum')
 
         self.spectrum_plots= ax.plot(
-            x_values, y_values,
-            x_values, y_values,
-            x_values, y_values,
-            x_values, y_values,
-            x_values, y_values,
-            x_values, y_values
+            *((x_values, y_values) * self.antenna_array.edges_count)
         )
         self.spectrum_canvas= FigureCanvas(fig)
 
@@ -102,7 +97,19 @@ class ScopeWindow(object):
 
 
     def backend_thread(self):
-        self.backend= libsofi.Sofi()
+        self.backend= libsofi.Sofi(self.antenna_array.antenna_count)
+
+        # Let libsofi calculate the direction infos
+        self.backend.set_antennas(
+            self.antenna_array.antennas, self.antenna_array.dir_len
+        )
+        self.antenna_array.doa_engine= self.backend
+
+        # and apply the phase calibration
+        self.antenna_array.calibration_sink= self.backend
+
+        # Signals are detected on every result
+        self.antenna_array.detector= self.backend
 
         for mag, phases in self.backend:
             if not self.running:
@@ -118,10 +125,16 @@ class ScopeWindow(object):
             for ph in phases
         )
 
-        if (self.frame%32) == 0:
+        # The detector in libsofi is cheap enough to
+        # follow every frame, the scipy one is not
+        if self.antenna_array.detector is not None:
+            self.antenna_array.update_points_native()
+
+        elif (self.frame%32) == 0:
             self.antenna_array.find_noisepoints(natural_mag)
             self.antenna_array.find_signalpoints(natural_mag)
 
+        if (self.frame%32) == 0:
             print('New noise points:', ', '.join(map(str, self.antenna_array.noise_points)))
             print('New signal points:', ', '.join(map(str, self.antenna_array.signal_points)))
 